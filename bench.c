@@ -0,0 +1,772 @@
+/*
+  Benchmark of the virtual file system.
+  vfs.c is compiled into this program and the low-level handlers the mount serves are called
+  directly, so no mount or root privilege is needed. each system call is played as the requests
+  the kernel sends for it when its caches miss, so the report is the daemon's share of the cost.
+  with --mounted=DIR the same workload is run with system calls on a mounted vfs instead, which
+  adds fuse and the kernel, and takes away what the kernel's caches answer
+*/
+
+// the handlers reply to a request of ours instead of to the kernel
+#define main vfs_main
+#define fuse_reply_err bench_reply_err
+#define fuse_reply_none bench_reply_none
+#define fuse_reply_entry bench_reply_entry
+#define fuse_reply_create bench_reply_create
+#define fuse_reply_attr bench_reply_attr
+#define fuse_reply_open bench_reply_open
+#define fuse_reply_write bench_reply_write
+#define fuse_reply_buf bench_reply_buf
+#define fuse_reply_data bench_reply_data
+#define fuse_reply_statfs bench_reply_statfs
+#include "vfs.c"
+#undef main
+
+#include <dirent.h>
+
+// what one run does: a chain of depth directories, files entries in the deepest one, and
+// one file of filesize bytes read and written io bytes at a time
+struct bench_config {
+	int depth;
+	int files;
+	off_t filesize;
+	size_t io;
+	int ops;
+};
+
+// at most this many values per comma separated option
+#define BENCH_LIST 8
+
+static const char *mounted;
+static struct fuse_file_info bench_fi;
+static int bench_errors;
+
+// what a handler replied: an error, the inode of an entry, or the bytes of data.
+// data goes to buf, up to size bytes
+struct fuse_req {
+	int err;
+	fuse_ino_t ino;
+	char *buf;
+	size_t size;
+	size_t len;
+};
+
+static struct fuse_req req;
+
+// the directory the kernel would have in its cache, holding a lookup on it like the kernel does
+static char parent_path[MAX_PATH_LEN];
+static fuse_ino_t parent_ino = FUSE_ROOT_ID;
+
+// the inode of the file b_open opened
+static fuse_ino_t open_ino;
+
+// an entry as fuse_add_direntry puts it in a readdir reply, in the kernel's format
+struct bench_dirent {
+	uint64_t ino;
+	uint64_t off;
+	uint32_t namelen;
+	uint32_t type;
+	char name[];
+};
+
+#define BENCH_DIRENT_SIZE(d) ((offsetof(struct bench_dirent, name) + (d)->namelen + 7) & ~(size_t) 7)
+
+// latencies of the phase being timed, in nanoseconds
+static int64_t *lat;
+static size_t nlat, latcap;
+
+static int64_t now_ns(void);
+static void phase_begin(void);
+static void phase_time(int64_t start, int res);
+static void phase_report(const char *name, off_t bytes);
+static void bench_path(char *dst, const char *path);
+static fuse_ino_t b_dir(const char *path, size_t len);
+static const char *b_parent(const char *path);
+static void b_forget(fuse_ino_t ino);
+static int b_mkdir(const char *path);
+static int b_rmdir(const char *path);
+static int b_create(const char *path);
+static int b_getattr(const char *path);
+static int b_getattr_miss(const char *path);
+static int b_readdir(const char *path);
+static int b_open(const char *path);
+static void b_close(const char *path, int fd);
+static int b_write(const char *path, int fd, const char *buf, size_t n, off_t off);
+static int b_read(const char *path, int fd, char *buf, size_t n, off_t off);
+static int b_unlink(const char *path);
+static int b_rename(const char *from, const char *to);
+static void bench_run(const char *top, const struct bench_config *c);
+static int parse_list(const char *s, off_t *v);
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void phase_begin(void)
+{
+	nlat = 0;
+	bench_errors = 0;
+}
+
+static void phase_time(int64_t start, int res)
+{
+	// one operation that began at start has finished with res
+	int64_t *p;
+	int64_t t = now_ns() - start;
+	if (res < 0) {
+		bench_errors++;
+	}
+	if (nlat == latcap) {
+		p = realloc(lat, (latcap ? latcap * 2 : 1024) * sizeof(int64_t));
+		if (p == NULL) {
+			return;
+		}
+		lat = p;
+		latcap = latcap ? latcap * 2 : 1024;
+	}
+	lat[nlat++] = t;
+}
+
+static int cmp_lat(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static void phase_report(const char *name, off_t bytes)
+{
+	// throughput is over the time spent inside the operations, the bookkeeping between them
+	// is left out. bytes is the data moved, 0 for metadata operations
+	int64_t total = 0;
+	size_t i;
+	if (nlat == 0) {
+		return;
+	}
+	for (i = 0; i < nlat; i++) {
+		total += lat[i];
+	}
+	qsort(lat, nlat, sizeof(int64_t), cmp_lat);
+	printf("%-14s %9zu %11.0f %9.1f %9.1f %9.1f", name, nlat, nlat / (total / 1e9),
+	       lat[nlat * 50 / 100] / 1e3, lat[nlat * 99 / 100] / 1e3, lat[nlat * 999 / 1000] / 1e3);
+	if (bytes > 0) {
+		printf(" %9.1f MB/s", bytes / (total / 1e9) / (1 << 20));
+	}
+	if (bench_errors > 0) {
+		printf("  %d failed", bench_errors);
+	}
+	printf("\n");
+}
+
+int bench_reply_err(fuse_req_t r, int err)
+{
+	r->err = err;
+	return 0;
+}
+
+void bench_reply_none(fuse_req_t r)
+{
+	r->err = 0;
+}
+
+int bench_reply_entry(fuse_req_t r, const struct fuse_entry_param *e)
+{
+	// a negative entry has inode 0, as the kernel takes it
+	r->err = e->ino == 0 ? ENOENT : 0;
+	r->ino = e->ino;
+	return 0;
+}
+
+int bench_reply_create(fuse_req_t r, const struct fuse_entry_param *e, const struct fuse_file_info *fi)
+{
+	(void) fi;
+	return bench_reply_entry(r, e);
+}
+
+int bench_reply_attr(fuse_req_t r, const struct stat *attr, double timeout)
+{
+	(void) attr;
+	(void) timeout;
+	r->err = 0;
+	return 0;
+}
+
+int bench_reply_open(fuse_req_t r, const struct fuse_file_info *fi)
+{
+	(void) fi;
+	r->err = 0;
+	return 0;
+}
+
+int bench_reply_write(fuse_req_t r, size_t count)
+{
+	r->err = 0;
+	r->len = count;
+	return 0;
+}
+
+int bench_reply_buf(fuse_req_t r, const char *buf, size_t size)
+{
+	r->err = 0;
+	r->len = size < r->size ? size : r->size;
+	memcpy(r->buf, buf, r->len);
+	return 0;
+}
+
+int bench_reply_data(fuse_req_t r, struct fuse_bufvec *bufv, enum fuse_buf_copy_flags flags)
+{
+	// the data is copied out of the image or the cache, as the kernel's read would
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(r->size);
+	ssize_t res;
+	(void) flags;
+	dst.buf[0].mem = r->buf;
+	res = fuse_buf_copy(&dst, bufv, 0);
+	r->err = res < 0 ? (int) -res : 0;
+	r->len = res < 0 ? 0 : res;
+	return 0;
+}
+
+int bench_reply_statfs(fuse_req_t r, const struct statvfs *st)
+{
+	(void) st;
+	r->err = 0;
+	return 0;
+}
+
+// the operations, on vfs_ll_oper or, with --mounted, on the mount with system calls.
+// paths are from the file system's root, each returns 0 or -errno.
+// in process an entry the kernel would be given is forgotten at the end of the call, as the
+// kernel does when it lets the entry go
+static void bench_path(char *dst, const char *path)
+{
+	snprintf(dst, MAX_PATH_LEN, "%s%s", mounted, path);
+}
+
+static void b_forget(fuse_ino_t ino)
+{
+	if (ino != FUSE_ROOT_ID) {
+		vfs_ll_oper.forget(&req, ino, 1);
+	}
+}
+
+static fuse_ino_t b_dir(const char *path, size_t len)
+{
+	// make parent_ino the directory named by the first len bytes of path, looking it up a name
+	// at a time when it is another one than last time. the walk is not part of the calls the
+	// mount gets for a name in a directory the kernel has cached
+	const char *p, *next, *end = path + len;
+	char comp[MAX_NAME_LEN + 1];
+	fuse_ino_t ino = FUSE_ROOT_ID;
+
+	if (len == strlen(parent_path) && strncmp(path, parent_path, len) == 0) {
+		return parent_ino;
+	}
+	b_forget(parent_ino);
+	for (p = path + 1; p < end; p = next + 1) {
+		next = memchr(p, '/', end - p);
+		if (next == NULL) {
+			next = end;
+		}
+		snprintf(comp, sizeof(comp), "%.*s", (int) (next - p), p);
+		vfs_ll_oper.lookup(&req, ino, comp);
+		b_forget(ino);
+		ino = req.err == 0 ? req.ino : FUSE_ROOT_ID;
+	}
+	parent_ino = ino;
+	snprintf(parent_path, sizeof(parent_path), "%.*s", (int) len, path);
+	return ino;
+}
+
+static const char *b_parent(const char *path)
+{
+	// make parent_ino the directory path is in, and return the last name of path
+	const char *name = strrchr(path, '/') + 1;
+	b_dir(path, name - 1 - path);
+	return name;
+}
+
+static int b_mkdir(const char *path)
+{
+	char p[MAX_PATH_LEN];
+	const char *name;
+	if (mounted == NULL) {
+		name = b_parent(path);
+		vfs_ll_oper.mkdir(&req, parent_ino, name, 0755);
+		if (req.err == 0) {
+			b_forget(req.ino);
+		}
+		return -req.err;
+	}
+	bench_path(p, path);
+	return mkdir(p, 0755) == 0 ? 0 : -errno;
+}
+
+static int b_rmdir(const char *path)
+{
+	char p[MAX_PATH_LEN];
+	const char *name;
+	if (mounted == NULL) {
+		name = b_parent(path);
+		vfs_ll_oper.rmdir(&req, parent_ino, name);
+		return -req.err;
+	}
+	bench_path(p, path);
+	return rmdir(p) == 0 ? 0 : -errno;
+}
+
+static int b_create(const char *path)
+{
+	// a create is followed by the release of the file it opened, as with creat() and close()
+	char p[MAX_PATH_LEN];
+	const char *name;
+	fuse_ino_t ino;
+	int fd;
+	if (mounted == NULL) {
+		name = b_parent(path);
+		memset(&bench_fi, 0, sizeof(bench_fi));
+		vfs_ll_oper.create(&req, parent_ino, name, S_IFREG | 0644, &bench_fi);
+		if (req.err == 0) {
+			ino = req.ino;
+			vfs_ll_oper.release(&req, ino, &bench_fi);
+			b_forget(ino);
+		}
+		return -req.err;
+	}
+	bench_path(p, path);
+	fd = open(p, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd == -1) {
+		return -errno;
+	}
+	close(fd);
+	return 0;
+}
+
+static int b_getattr(const char *path)
+{
+	// stat of a name the kernel has not cached is one lookup, which carries the attributes
+	char p[MAX_PATH_LEN];
+	const char *name;
+	struct stat st;
+	if (mounted == NULL) {
+		name = b_parent(path);
+		vfs_ll_oper.lookup(&req, parent_ino, name);
+		if (req.err == 0) {
+			b_forget(req.ino);
+		}
+		return -req.err;
+	}
+	bench_path(p, path);
+	return stat(p, &st) == 0 ? 0 : -errno;
+}
+
+static int b_getattr_miss(const char *path)
+{
+	// a lookup of a name that is not there, which is the expected outcome
+	int res = b_getattr(path);
+	return res == -ENOENT ? 0 : res == 0 ? -EEXIST : res;
+}
+
+static int b_readdir(const char *path)
+{
+	// a whole listing: opendir, readdir in pieces the size the kernel asks for, releasedir.
+	// each piece resumes at the cookie of the last entry of the one before
+	char p[MAX_PATH_LEN], buf[4096];
+	struct bench_dirent *de;
+	struct fuse_file_info fi;
+	fuse_ino_t ino;
+	off_t off = 0;
+	size_t pos;
+	DIR *d;
+	int n = 0, res;
+	if (mounted == NULL) {
+		ino = b_dir(path, strlen(path));
+		memset(&fi, 0, sizeof(fi));
+		vfs_ll_oper.opendir(&req, ino, &fi);
+		for (res = -req.err; res == 0; ) {
+			req.buf = buf;
+			req.size = sizeof(buf);
+			vfs_ll_oper.readdir(&req, ino, sizeof(buf), off, &fi);
+			res = -req.err;
+			if (res != 0 || req.len == 0) {
+				break;
+			}
+			for (pos = 0; pos < req.len; pos += BENCH_DIRENT_SIZE(de)) {
+				de = (struct bench_dirent *) (buf + pos);
+				off = de->off;
+				n++;
+			}
+		}
+		vfs_ll_oper.releasedir(&req, ino, &fi);
+		return res;
+	}
+	bench_path(p, path);
+	d = opendir(p);
+	if (d == NULL) {
+		return -errno;
+	}
+	while (readdir(d) != NULL) {
+		n++;
+	}
+	closedir(d);
+	return 0;
+}
+
+static int b_open(const char *path)
+{
+	// the descriptor the reads and writes of a phase go through, not timed.
+	// in process it is the handle open leaves in bench_fi, which fuse passes back the same way
+	char p[MAX_PATH_LEN];
+	const char *name;
+	int fd;
+	if (mounted == NULL) {
+		name = b_parent(path);
+		vfs_ll_oper.lookup(&req, parent_ino, name);
+		if (req.err != 0) {
+			return -1;
+		}
+		open_ino = req.ino;
+		memset(&bench_fi, 0, sizeof(bench_fi));
+		vfs_ll_oper.open(&req, open_ino, &bench_fi);
+		if (req.err != 0) {
+			b_forget(open_ino);
+			return -1;
+		}
+		return 0;
+	}
+	bench_path(p, path);
+	fd = open(p, O_RDWR);
+	if (fd == -1) {
+		perror(p);
+	}
+	return fd;
+}
+
+static void b_close(const char *path, int fd)
+{
+	(void) path;
+	if (mounted == NULL) {
+		vfs_ll_oper.release(&req, open_ino, &bench_fi);
+		b_forget(open_ino);
+	}
+	else if (fd >= 0) {
+		close(fd);
+	}
+}
+
+static int b_write(const char *path, int fd, const char *buf, size_t n, off_t off)
+{
+	// the mount takes writes through write_buf, with the data in the request's memory
+	struct fuse_bufvec bv = FUSE_BUFVEC_INIT(n);
+	ssize_t res;
+	(void) path;
+	if (mounted == NULL) {
+		bv.buf[0].mem = (void *) buf;
+		vfs_ll_oper.write_buf(&req, open_ino, &bv, off, &bench_fi);
+		res = -req.err;
+	}
+	else {
+		res = pwrite(fd, buf, n, off) == -1 ? -errno : 0;
+	}
+	return res < 0 ? res : 0;
+}
+
+static int b_read(const char *path, int fd, char *buf, size_t n, off_t off)
+{
+	ssize_t res;
+	(void) path;
+	if (mounted == NULL) {
+		req.buf = buf;
+		req.size = n;
+		vfs_ll_oper.read(&req, open_ino, n, off, &bench_fi);
+		res = -req.err;
+	}
+	else {
+		res = pread(fd, buf, n, off) == -1 ? -errno : 0;
+	}
+	return res < 0 ? res : 0;
+}
+
+static int b_unlink(const char *path)
+{
+	char p[MAX_PATH_LEN];
+	const char *name;
+	if (mounted == NULL) {
+		name = b_parent(path);
+		vfs_ll_oper.unlink(&req, parent_ino, name);
+		return -req.err;
+	}
+	bench_path(p, path);
+	return unlink(p) == 0 ? 0 : -errno;
+}
+
+static int b_rename(const char *from, const char *to)
+{
+	// both names are in one directory
+	char p[MAX_PATH_LEN], q[MAX_PATH_LEN];
+	const char *name;
+	if (mounted == NULL) {
+		name = b_parent(from);
+		vfs_ll_oper.rename(&req, parent_ino, name, parent_ino, strrchr(to, '/') + 1);
+		return -req.err;
+	}
+	bench_path(p, from);
+	bench_path(q, to);
+	return rename(p, q) == 0 ? 0 : -errno;
+}
+
+// time op(path) for each i below n, path being fmt with dir and i filled in
+#define TIME_EACH(n, op, fmt, ...) do {						\
+	for (i = 0; i < (n); i++) {						\
+		snprintf(path, sizeof(path), fmt, __VA_ARGS__);		\
+		t = now_ns();							\
+		phase_time(t, op(path));					\
+	}									\
+} while (0)
+
+static void bench_run(const char *top, const struct bench_config *c)
+{
+	char dir[MAX_PATH_LEN], path[MAX_PATH_LEN], to[MAX_PATH_LEN];
+	char *buf;
+	off_t off, nio = c->filesize / c->io;
+	int i, fd;
+	int64_t t;
+
+	printf("\ndepth %d, %d files, file size %lld, io size %zu\n", c->depth, c->files,
+	       (long long) c->filesize, c->io);
+	printf("%-14s %9s %11s %9s %9s %9s\n", "op", "count", "ops/s", "p50 us", "p99 us", "p999 us");
+	buf = malloc(c->io);
+	if (buf == NULL) {
+		perror("bench");
+		return;
+	}
+	memset(buf, 'b', c->io);
+
+	// the chain of directories down to the one the files go in
+	phase_begin();
+	snprintf(dir, sizeof(dir), "%s", top);
+	for (i = 0; i < c->depth; i++) {
+		snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir), "/d%d", i);
+		t = now_ns();
+		phase_time(t, b_mkdir(dir));
+	}
+
+	phase_begin();
+	TIME_EACH(c->files, b_mkdir, "%s/s%d", dir, i);
+	phase_report("mkdir", 0);
+	phase_begin();
+	TIME_EACH(c->files, b_create, "%s/f%d", dir, i);
+	phase_report("create", 0);
+	phase_begin();
+	TIME_EACH(c->ops, b_getattr, "%s/f%d", dir, rand() % c->files);
+	phase_report("getattr hit", 0);
+	phase_begin();
+	TIME_EACH(c->ops, b_getattr_miss, "%s/m%d", dir, rand() % c->files);
+	phase_report("getattr miss", 0);
+	phase_begin();
+	TIME_EACH(c->ops / 100 + 1, b_readdir, "%s", dir);
+	phase_report("readdir", 0);
+
+	// one file, written and read in io size pieces, first in order and then at random
+	snprintf(path, sizeof(path), "%s/data", dir);
+	if (b_create(path) != 0 || (fd = b_open(path)) < 0) {
+		printf("cannot create %s\n", path);
+		free(buf);
+		return;
+	}
+	phase_begin();
+	for (off = 0; off < nio; off++) {
+		t = now_ns();
+		phase_time(t, b_write(path, fd, buf, c->io, off * c->io));
+	}
+	phase_report("seq write", nio * c->io);
+	phase_begin();
+	for (off = 0; off < nio; off++) {
+		t = now_ns();
+		phase_time(t, b_read(path, fd, buf, c->io, off * c->io));
+	}
+	phase_report("seq read", nio * c->io);
+	phase_begin();
+	for (i = 0; i < c->ops && nio > 0; i++) {
+		off = (off_t) (((uint64_t) rand() << 31 | rand()) % nio) * c->io;
+		t = now_ns();
+		phase_time(t, b_write(path, fd, buf, c->io, off));
+	}
+	phase_report("random write", (off_t) i * c->io);
+	phase_begin();
+	for (i = 0; i < c->ops && nio > 0; i++) {
+		off = (off_t) (((uint64_t) rand() << 31 | rand()) % nio) * c->io;
+		t = now_ns();
+		phase_time(t, b_read(path, fd, buf, c->io, off));
+	}
+	phase_report("random read", (off_t) i * c->io);
+	b_close(path, fd);
+
+	phase_begin();
+	for (i = 0; i < c->files; i++) {
+		snprintf(path, sizeof(path), "%s/f%d", dir, i);
+		snprintf(to, sizeof(to), "%s/g%d", dir, i);
+		t = now_ns();
+		phase_time(t, b_rename(path, to));
+	}
+	phase_report("rename", 0);
+	phase_begin();
+	TIME_EACH(c->files, b_unlink, "%s/g%d", dir, i);
+	phase_report("unlink", 0);
+	phase_begin();
+	TIME_EACH(c->files, b_rmdir, "%s/s%d", dir, i);
+	phase_report("rmdir", 0);
+
+	// and leave the tree empty for the next run
+	snprintf(path, sizeof(path), "%s/data", dir);
+	b_unlink(path);
+	for (i = c->depth; i > 0; i--) {
+		b_rmdir(dir);
+		*strrchr(dir, '/') = '\0';
+	}
+	free(buf);
+}
+
+static int parse_list(const char *s, off_t *v)
+{
+	// comma separated sizes, the number of them or -1 if one is not a size
+	char item[32];
+	int n = 0;
+	size_t len;
+	while (n < BENCH_LIST) {
+		len = strcspn(s, ",");
+		if (len == 0 || len >= sizeof(item)) {
+			return -1;
+		}
+		memcpy(item, s, len);
+		item[len] = '\0';
+		v[n] = parse_size(item);
+		if (v[n++] < 0) {
+			return -1;
+		}
+		if (s[len] == '\0') {
+			return n;
+		}
+		s += len + 1;
+	}
+	return -1;
+}
+
+int main(int argc, char *argv[])
+{
+	off_t depth[BENCH_LIST] = { 4 }, files[BENCH_LIST] = { 1000 }, filesize[BENCH_LIST] = { 4 << 20 };
+	off_t io[BENCH_LIST] = { 4096 };
+	int ndepth = 1, nfiles = 1, nfilesize = 1, nio = 1, ops = 2000;
+	int i, a, b, c, d;
+	blkno_t nblocks = (1 << 30) / BLOCK_SIZE;
+	char top[MAX_PATH_LEN];
+	struct bench_config cfg;
+
+	// never the real image, which would be formatted over
+	fuseimage = "/tmp/vfsbench.img";
+	// --depth, --files, --file-size and --io-size take comma separated lists and every
+	// combination is run; --ops=N is the count of random and getattr operations
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--depth=", 8) == 0) {
+			ndepth = parse_list(argv[i] + 8, depth);
+		}
+		else if (strncmp(argv[i], "--files=", 8) == 0) {
+			nfiles = parse_list(argv[i] + 8, files);
+		}
+		else if (strncmp(argv[i], "--file-size=", 12) == 0) {
+			nfilesize = parse_list(argv[i] + 12, filesize);
+		}
+		else if (strncmp(argv[i], "--io-size=", 10) == 0) {
+			nio = parse_list(argv[i] + 10, io);
+		}
+		else if (strncmp(argv[i], "--ops=", 6) == 0) {
+			ops = atoi(argv[i] + 6);
+		}
+		else if (strncmp(argv[i], "--image=", 8) == 0) {
+			fuseimage = argv[i] + 8;
+		}
+		else if (strncmp(argv[i], "--size=", 7) == 0) {
+			nblocks = parse_size(argv[i] + 7) / BLOCK_SIZE;
+		}
+		else if (strncmp(argv[i], "--cache=", 8) == 0) {
+			nbuf = atoi(argv[i] + 8);
+		}
+		else if (strncmp(argv[i], "--mounted=", 10) == 0) {
+			mounted = argv[i] + 10;
+		}
+		else {
+			fprintf(stderr, "usage: %s [--depth=N,..] [--files=N,..] [--file-size=N,..] [--io-size=N,..]\n"
+				"\t[--ops=N] [--image=PATH] [--size=N] [--cache=N] [--mounted=DIR]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (ndepth < 0 || nfiles < 0 || nfilesize < 0 || nio < 0 || ops < 1) {
+		fprintf(stderr, "bad option value\n");
+		return 1;
+	}
+	for (i = 0; i < nfiles; i++) {
+		if (files[i] < 1) {
+			fprintf(stderr, "--files needs at least 1\n");
+			return 1;
+		}
+	}
+	for (i = 0; i < nio; i++) {
+		if (io[i] < 1) {
+			fprintf(stderr, "--io-size needs at least 1 byte\n");
+			return 1;
+		}
+	}
+	srand(1);
+
+	// in process, a fresh image is formatted and mounted as fuse_main would
+	if (mounted == NULL) {
+		if (nbuf < 16 || bcache_init(nbuf) != 0) {
+			fprintf(stderr, "block cache: --cache needs at least 16 buffers\n");
+			return 1;
+		}
+		fusefd = open(fuseimage, O_RDWR | O_CREAT, 0644);
+		if (fusefd == -1 || mkfs(nblocks, nblocks / BLOCKS_PER_INODE, MAX_NAME_LEN) != 0) {
+			perror(fuseimage);
+			return 1;
+		}
+		if (load_superblock() != 0) {
+			return 1;
+		}
+		vfs_ll_oper.init(NULL, NULL);
+		printf("in process, %s\n", fuseimage);
+		snprintf(top, sizeof(top), "/bench");
+	}
+	else {
+		printf("mounted, %s\n", mounted);
+		snprintf(top, sizeof(top), "/bench.%d", (int) getpid());
+	}
+	if (b_mkdir(top) != 0) {
+		fprintf(stderr, "cannot make %s\n", top);
+		return 1;
+	}
+
+	for (a = 0; a < ndepth; a++) {
+		for (b = 0; b < nfiles; b++) {
+			for (c = 0; c < nfilesize; c++) {
+				for (d = 0; d < nio; d++) {
+					cfg.depth = depth[a];
+					cfg.files = files[b];
+					cfg.filesize = filesize[c];
+					cfg.io = io[d];
+					cfg.ops = ops;
+					bench_run(top, &cfg);
+				}
+			}
+		}
+	}
+
+	b_rmdir(top);
+	fflush(stdout);
+	if (mounted == NULL) {
+		b_forget(parent_ino);
+		vfs_ll_oper.destroy(NULL);
+	}
+	free(lat);
+	return 0;
+}
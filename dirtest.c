@@ -0,0 +1,359 @@
+/*
+  Test of directories whose names collide in their hash.
+  vfs.c is compiled into this program, as into the benchmark, and a scratch image is formatted
+  and worked on in process. names are made to share the low bits of their FNV-1a hash, or all
+  of it, and each directory must stay small, find and list every name once, give its overflow
+  blocks back as the names go, and pass --check
+*/
+
+#define main vfs_main
+#include "vfs.c"
+#undef main
+
+// names sharing this many low bits of their hash, and how long they are
+#define TEST_LOW_BITS 20
+#define TEST_LOW_NAMES 64
+#define TEST_LOW_LEN 250
+// names with one hash, more than a byte of the readdir cookie could tell apart
+#define TEST_DUP_NAMES 300
+// of them, names listed while others with their hash come and go
+#define TEST_CHURN_NAMES 60
+// names counted out in an ordinary directory
+#define TEST_PLAIN_NAMES 5000
+// entries a listing takes per call, so that it resumes from cookies often
+#define TEST_LIST_BATCH 7
+
+// the characters names are made of
+static const char test_chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-";
+
+static int test_failed;
+
+static void expect(int ok, const char *what)
+{
+	printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+	test_failed |= !ok;
+}
+
+static uint32_t fnv_step(uint32_t h, unsigned char c)
+{
+	return (h ^ c) * 16777619u;
+}
+
+static uint32_t fnv_unstep(uint32_t h, unsigned char c)
+{
+	// the state before c was hashed in. 16777619 is odd, so it has an inverse mod 2^32
+	uint32_t inv = 16777619u, i;
+	for (i = 0; i < 4; i++) {
+		inv *= 2 - 16777619u * inv;
+	}
+	return (h * inv) ^ c;
+}
+
+static void low_name(char *name, int i)
+{
+	// a name of TEST_LOW_LEN bytes whose hash ends in TEST_LOW_BITS zero bits. the prefix is
+	// hashed once, then the last four bytes are counted up until the hash fits
+	uint32_t h, mask = (1u << TEST_LOW_BITS) - 1;
+	unsigned n;
+	int k;
+	memset(name, 'x', TEST_LOW_LEN);
+	snprintf(name, TEST_LOW_LEN, "low%04d-", i);
+	name[strlen(name)] = 'x';
+	h = hash_name(2166136261u, name, TEST_LOW_LEN - 4);
+	for (n = 0; ; n++) {
+		for (k = 0; k < 4; k++) {
+			name[TEST_LOW_LEN - 4 + k] = test_chars[n >> (6 * k) & 63];
+		}
+		if ((hash_name(h, name + TEST_LOW_LEN - 4, 4) & mask) == 0) {
+			break;
+		}
+	}
+	name[TEST_LOW_LEN] = '\0';
+}
+
+struct fwd {
+	uint32_t h;
+	uint32_t chars;
+};
+
+static int cmp_fwd(const void *a, const void *b)
+{
+	uint32_t x = ((const struct fwd *) a)->h, y = ((const struct fwd *) b)->h;
+	return x < y ? -1 : x > y;
+}
+
+static int dup_names(char (*names)[16], int want, uint32_t *target)
+{
+	// want names that all hash to *target, met in the middle: three characters forward from a
+	// prefix, three back from the target. returns how many were made
+	static struct fwd f[64 * 64 * 64];
+	struct fwd key, *m;
+	uint32_t h, s;
+	int got = 0, p, i, a, b, c;
+	char prefix[16];
+
+	for (p = 0; got < want; p++) {
+		snprintf(prefix, sizeof(prefix), "dup%04d", p);
+		s = hash_name(2166136261u, prefix, strlen(prefix));
+		if (p == 0) {
+			*target = hash_name(s, "aaaaaa", 6);
+		}
+		for (i = 0; i < 64 * 64 * 64; i++) {
+			f[i].h = fnv_step(fnv_step(fnv_step(s, test_chars[i & 63]), test_chars[i >> 6 & 63]),
+			                  test_chars[i >> 12]);
+			f[i].chars = i;
+		}
+		qsort(f, 64 * 64 * 64, sizeof(struct fwd), cmp_fwd);
+		for (i = 0; i < 64 * 64 * 64 && got < want; i++) {
+			a = i & 63;
+			b = i >> 6 & 63;
+			c = i >> 12;
+			h = fnv_unstep(fnv_unstep(fnv_unstep(*target, test_chars[c]), test_chars[b]), test_chars[a]);
+			key.h = h;
+			m = bsearch(&key, f, 64 * 64 * 64, sizeof(struct fwd), cmp_fwd);
+			if (m == NULL) {
+				continue;
+			}
+			snprintf(names[got], 16, "%s%c%c%c%c%c%c", prefix, test_chars[m->chars & 63],
+			         test_chars[m->chars >> 6 & 63], test_chars[m->chars >> 12], test_chars[a], test_chars[b],
+			         test_chars[c]);
+			got++;
+		}
+	}
+	return got;
+}
+
+// what a listing saw, and the cookie the next call resumes at
+struct seen {
+	int n;
+	int batch;
+	off_t next;
+	char (*names)[TEST_LOW_LEN + 1];
+	int nnames;
+	int *count;
+};
+
+static int seen_fill(void *buf, const char *name, const struct stat *st, off_t off)
+{
+	struct seen *s = buf;
+	int i;
+	(void) st;
+	if (s->batch == TEST_LIST_BATCH) {
+		return 1;
+	}
+	s->batch++;
+	s->next = off;
+	if (name[0] == '.') {
+		return 0;
+	}
+	s->n++;
+	for (i = 0; i < s->nnames; i++) {
+		if (strcmp(s->names[i], name) == 0) {
+			s->count[i]++;
+		}
+	}
+	return 0;
+}
+
+static int list_once(blkno_t dirn, char (*names)[TEST_LOW_LEN + 1], int nnames)
+{
+	// whether a listing in small pieces gives each of the names exactly once and nothing else
+	struct seen s = { 0, 0, 0, names, nnames, calloc(nnames, sizeof(int)) };
+	int i, ok;
+	do {
+		s.batch = 0;
+		if (list_dir(dirn, s.next, NULL, &s, seen_fill) != 0) {
+			free(s.count);
+			return 0;
+		}
+	} while (s.batch == TEST_LIST_BATCH);
+	ok = s.n == nnames;
+	for (i = 0; i < nnames; i++) {
+		ok &= s.count[i] == 1;
+	}
+	free(s.count);
+	return ok;
+}
+
+static int t_create(blkno_t dirn, const char *name);
+static int t_unlink(blkno_t dirn, const char *name);
+
+static int list_churn(blkno_t dirn, char (*names)[TEST_LOW_LEN + 1], int nnames, int nstay)
+{
+	// whether a listing in small pieces gives each of the first nstay names exactly once and the
+	// others at most once, while after each piece one name it gave is removed and one of the
+	// names from nstay on is added. all of them hash alike, so only their cookies tell them apart
+	struct seen s = { 0, 0, 0, names, nnames, calloc(nnames, sizeof(int)) };
+	int i, ok = 1, gone = 0, added = nstay;
+	do {
+		s.batch = 0;
+		if (list_dir(dirn, s.next, NULL, &s, seen_fill) != 0) {
+			free(s.count);
+			return 0;
+		}
+		for (; gone < nstay && s.count[gone] == 0; gone++) {
+		}
+		if (gone < nstay) {
+			ok &= t_unlink(dirn, names[gone]) == 0;
+			gone++;
+		}
+		if (added < nnames) {
+			ok &= t_create(dirn, names[added++]) == 0;
+		}
+	} while (s.batch == TEST_LIST_BATCH);
+	for (i = 0; i < nnames; i++) {
+		ok &= s.count[i] <= 1;
+	}
+	for (i = gone; i < nstay; i++) {
+		ok &= s.count[i] == 1;
+	}
+	free(s.count);
+	return ok;
+}
+
+static blkno_t t_mkdir(const char *name)
+{
+	blkno_t res;
+	log_begin();
+	res = make_dir(Superblock.root, name, NULL);
+	log_end();
+	return res;
+}
+
+static int t_create(blkno_t dirn, const char *name)
+{
+	blkno_t res;
+	log_begin();
+	res = make_file(dirn, name, NULL);
+	log_end();
+	return res < 0 ? (int) res : 0;
+}
+
+static int t_unlink(blkno_t dirn, const char *name)
+{
+	int res;
+	log_begin();
+	res = unlink_entry(dirn, name);
+	log_end();
+	return res;
+}
+
+static int t_found(blkno_t dirn, char (*names)[TEST_LOW_LEN + 1], int nnames)
+{
+	// whether every name is found in the directory
+	int i, ok = 1;
+	lock_inode(dirn, 0);
+	for (i = 0; i < nnames; i++) {
+		ok &= dir_lookup(dirn, names[i], strlen(names[i])) > 0;
+	}
+	unlock_inode(dirn);
+	return ok;
+}
+
+static blkno_t t_blocks(struct inode *ino)
+{
+	// the blocks a file takes, its data and its index
+	blkno_t n = file_blocks(ino);
+	int l;
+	if (ino->indirect) {
+		n++;
+		for (l = 0; l < INDEX_DEPTH; l++) {
+			n += ino->nnode[l];
+		}
+	}
+	return n;
+}
+
+static void test_names(const char *dir, char (*names)[TEST_LOW_LEN + 1], int nnames, int maxblocks)
+{
+	// create the names in a new directory, which may take at most maxblocks blocks, then
+	// remove them, which must give back every block but the buckets and their index
+	blkno_t dirn = t_mkdir(dir), before = Superblock.freeblocks;
+	int i, ok = 1;
+	char what[100];
+
+	for (i = 0; i < nnames; i++) {
+		ok &= t_create(dirn, names[i]) == 0;
+	}
+	snprintf(what, sizeof(what), "%s: %d names created", dir, nnames);
+	expect(ok, what);
+	snprintf(what, sizeof(what), "%s: %lld blocks used, at most %d", dir,
+	         (long long) (before - Superblock.freeblocks + 1), maxblocks);
+	expect(before - Superblock.freeblocks + 1 <= maxblocks, what);
+	snprintf(what, sizeof(what), "%s: every name found", dir);
+	expect(t_found(dirn, names, nnames), what);
+	snprintf(what, sizeof(what), "%s: every name listed once", dir);
+	expect(list_once(dirn, names, nnames), what);
+	snprintf(what, sizeof(what), "%s: a name already there is refused", dir);
+	expect(t_create(dirn, names[nnames / 2]) == -EEXIST, what);
+
+	ok = 1;
+	for (i = 0; i < nnames; i += 2) {
+		ok &= t_unlink(dirn, names[i]) == 0;
+	}
+	for (i = 1; i < nnames; i += 2) {
+		ok &= t_create(dirn, names[i]) == -EEXIST && t_unlink(dirn, names[i]) == 0;
+	}
+	snprintf(what, sizeof(what), "%s: every name removed", dir);
+	expect(ok, what);
+	// freed blocks reach the free list when their transaction commits
+	log_commit();
+	snprintf(what, sizeof(what), "%s: only the buckets are left", dir);
+	expect(before - Superblock.freeblocks + 1 == t_blocks(get_inode(dirn)), what);
+}
+
+int main(int argc, char *argv[])
+{
+	static char names[TEST_PLAIN_NAMES][TEST_LOW_LEN + 1];
+	static char dups[TEST_DUP_NAMES][16];
+	uint32_t target;
+	blkno_t dirn;
+	int i, ok;
+
+	fuseimage = argc > 1 ? argv[1] : "/tmp/vfsdirtest.img";
+	fusefd = open(fuseimage, O_RDWR | O_CREAT, 0644);
+	if (bcache_init(nbuf) != 0 || fusefd == -1 || mkfs(100000, 20000, MAX_NAME_LEN) != 0
+	    || load_superblock() != 0) {
+		perror(fuseimage);
+		return 1;
+	}
+	vfs_ll_oper.init(NULL, NULL);
+
+	// names alike in their low bits go to one bucket until the directory is large enough to
+	// tell them apart, so they chain instead of splitting it
+	for (i = 0; i < TEST_LOW_NAMES; i++) {
+		low_name(names[i], i);
+	}
+	test_names("low", names, TEST_LOW_NAMES, 8);
+
+	// names with one hash cannot be parted at all, and only their cookies tell them apart
+	dup_names(dups, TEST_DUP_NAMES, &target);
+	ok = 1;
+	for (i = 0; i < TEST_DUP_NAMES; i++) {
+		ok &= hash_name(2166136261u, dups[i], strlen(dups[i])) == target;
+		strcpy(names[i], dups[i]);
+	}
+	expect(ok, "dup: the names share their hash");
+	test_names("dup", names, TEST_DUP_NAMES, 4);
+
+	// a name that stays keeps its cookie while names with its hash come and go around it
+	dirn = t_mkdir("churn");
+	ok = 1;
+	for (i = 0; i < TEST_CHURN_NAMES; i++) {
+		ok &= t_create(dirn, names[i]) == 0;
+	}
+	expect(ok && list_churn(dirn, names, 2 * TEST_CHURN_NAMES, TEST_CHURN_NAMES),
+	       "churn: names alike listed once while others come and go");
+
+	// an ordinary directory splits as it grows
+	for (i = 0; i < TEST_PLAIN_NAMES; i++) {
+		snprintf(names[i], sizeof(names[i]), "plain-file-%d", i);
+	}
+	test_names("plain", names, TEST_PLAIN_NAMES, 200);
+
+	log_commit();
+	expect(check_image(1) == 0 && check.fixed == 0, "--check finds nothing to repair");
+	vfs_ll_oper.destroy(NULL);
+	printf("%s\n", test_failed ? "FAILED" : "passed");
+	return test_failed;
+}
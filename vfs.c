@@ -4,1091 +4,6544 @@
 */
 
 #define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <endian.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <pthread.h>
 
-// limitation of this virtual file system
-#define MAX_BLOCK_NUM 10000
-#define MAX_INODE_NUM 2000
+// limitation of this virtual file system, the geometry of an image is chosen at mkfs and kept
+// in its superblock, the defaults below make a 40 MB image
 #define BLOCK_SIZE 4096
-#define MAX_FILE_BLOCK 400
-#define MAX_FILE_NUM 50
+#define MAX_FILE_SIZE ((off_t) INT32_MAX * BLOCK_SIZE)
 #define MAX_PATH_LEN 1000
-#define MAX_NAME_LEN 50
+#define MAX_NAME_LEN 255
+#define DEFAULT_BLOCKS 10000
+#define BLOCKS_PER_INODE 5
+#define MIN_BLOCKS 64
 
-static const char *fusedata = "/fusedata/fusedata.";
+// on-disk format
+#define VFS_MAGIC 0x31534656
+#define VFS_VERSION 7
+
+// block numbers are 64-bit, negative values carry -errno.
+// inodes are numbered from 1 and directory entries keep the number in 32 bits, inode 0 is none.
+// images made before version 6 have no inode table: an inode's number is its block number,
+// so there inodes are only placed below MAX_INODE_BLOCK. extents keep 48 bits of their start,
+// and so at most EXTENT_MAX_LEN blocks
+typedef int64_t blkno_t;
+#define MAX_INODE_BLOCK ((blkno_t) UINT32_MAX)
+#define MAX_INODES ((blkno_t) UINT32_MAX - 1)
+#define EXTENT_MAX_LEN 65535
+
+// the inode table packs fixed-size records INODES_PER_BLOCK to a block. an older image is read
+// as a table of one block-sized record per block, starting at block 0
+#define INODE_SIZE 256
+#define BLOCK_INODES (Superblock.inodeSize == BLOCK_SIZE)
+#define INODES_PER_BLOCK (BLOCK_SIZE / Superblock.inodeSize)
+#define INODE_BLOCK(n) (Superblock.itableStart + (n) / INODES_PER_BLOCK)
+#define INODE_POS(n) ((off_t) ((n) % INODES_PER_BLOCK) * Superblock.inodeSize)
+// inode numbers in use are below INODE_LIMIT
+#define INODE_LIMIT (BLOCK_INODES ? Superblock.maxBlocks : Superblock.maxInodes + 1)
+
+// name lookup cache, direct mapped
+#define DCACHE_SIZE 4096
+
+// block buffer cache: default size in buffers, and how often the flusher writes dirty ones back
+#define BCACHE_BUFS 1024
+#define BCACHE_FLUSH_SECS 5
+
+// metadata journal, in the blocks after the free list
+#define LOG_MAGIC 0x474f4c56
+#define LOG_PAYLOAD (BLOCK_SIZE - (int) sizeof(struct disk_logblock))
+// the largest transaction that is journaled, it leaves room for the free list records a commit adds
+#define LOG_MAX_TXN ((size_t) (journal.nblocks / 2 - 2) * LOG_PAYLOAD)
+// mkfs sizes the ring to the device, within these bounds
+#define LOG_MIN_BLOCKS 23
+#define LOG_MAX_BLOCKS 16384
+
+// free space bitmap: one bit per block, grouped into 64-bit words
+#define FREEMAP_WORDS ((Superblock.maxBlocks + 63) / 64)
+#define FREESUM_WORDS ((FREEMAP_WORDS + 63) / 64)
+
+// free inode bitmap: one bit per inode number, in the blocks from imapStart
+#define IMAP_WORDS ((Superblock.maxInodes + 1 + 63) / 64)
+
+// the bitmap is split into allocation groups of whole words, each with its own lock
+#define ALLOC_GROUPS 8
+#define GROUP_WORDS ((FREEMAP_WORDS + ALLOC_GROUPS - 1) / ALLOC_GROUPS)
+// a group's freedirty words are summarised one level up, so writing its free list back
+// scans a bit per 4096 words instead of the whole bitmap
+#define GROUP_DIRTYSUM_WORDS ((GROUP_WORDS / 64 + 2 + 63) / 64)
+
+// dcache entries are guarded by striped locks, entry i by lock i % CACHE_LOCKS
+#define CACHE_LOCKS 64
+
+// live statistics are read from this file in the root, which no directory lists.
+// handler latencies are counted in power of two buckets from 1 us, the last one unbounded
+#define STATS_PATH "/.vfsstats"
+#define LAT_BUCKETS 24
+
+// the mount serves the kernel by inode number. its root is FUSE_ROOT_ID, whatever number the
+// image gave it, and /.vfsstats has a number no inode can have
+#define STATS_INODE (MAX_INODE_BLOCK + 1)
+#define FUSE_INO(n) ((n) == Superblock.root ? FUSE_ROOT_ID : (fuse_ino_t) (n))
+#define INODE_NUM(ino) ((ino) == FUSE_ROOT_ID ? Superblock.root : (blkno_t) (ino))
+
+// every change reaches the image through this mount, so the kernel can keep names and
+// attributes it was given for long. the statistics file changes on its own and is never cached
+#define ENTRY_TIMEOUT 60.0
+#define ATTR_TIMEOUT 60.0
+
+static const char *fuseimage = "/fusedata/fusedata.img";
+static int fusefd = -1;
+
+// on-disk records are fixed size and every field is little-endian.
+// a 64-bit count is split into a low word and a _hi word, which older versions left zero.
+// the free list, the journal and the inode table sit at the start of the device, below block 2^32
+struct disk_superblock {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t creationTime;
+	uint32_t mounted;
+	uint32_t devId;
+	uint32_t freeStart;
+	uint32_t freeEnd;
+	uint32_t root;
+	uint32_t maxBlocks;
+	uint32_t freeblocks;
+	uint32_t freeinodes;
+	uint32_t clean;
+	// from version 4, older versions did not write them and have the default geometry
+	uint32_t blockSize;
+	uint32_t maxName;
+	uint32_t maxInodes;
+	uint32_t maxInodes_hi;
+	uint32_t maxBlocks_hi;
+	uint32_t freeblocks_hi;
+	uint32_t freeinodes_hi;
+	// from version 6, before it every inode had a block of its own and root was its number
+	uint32_t imapStart;
+	uint32_t itableStart;
+	uint32_t dataStart;
+	uint32_t inodeSize;
+};
+
+// an inode record holds a disk_inode, a directory's entries live in its data blocks.
+// a small file's bytes are kept inline, in the rest of its record, until it outgrows it
+struct disk_inode {
+	uint32_t size;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t mode;
+	uint32_t atime;
+	uint32_t ctime;
+	uint32_t mtime;
+	uint32_t linkcount;
+	uint32_t subn;
+	uint32_t indirect;
+	uint32_t location;
+	uint32_t parent;
+	uint32_t size_hi;
+	uint32_t location_hi;
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+// disk_inode flags, from version 5
+#define INODE_INLINE 1
+
+#define INLINE_OFF ((off_t) sizeof(struct disk_inode))
+// where inode n's inline bytes start in INODE_BLOCK(n)
+#define INLINE_POS(n) (INODE_POS(n) + INLINE_OFF)
+#define INLINE_MAX (Superblock.inodeSize - (int) sizeof(struct disk_inode))
+// the most any image keeps inline, what a buffer for inline bytes needs
+#define INLINE_BUF (BLOCK_SIZE - (int) sizeof(struct disk_inode))
+
+// a directory is a linear hash table: bucket b is logical block b of the directory
+// and packs variable-length entries after this header, "." and ".." are not stored.
+// from version 7 a bucket that splitting cannot relieve goes on in overflow blocks outside the
+// table: DIR_CHAINED in count says the last DIR_NEXT bytes hold the next block's number,
+// and the entries end before them. an overflow block is never left empty
+struct disk_dirblock {
+	uint32_t count;
+	uint32_t used;
+};
+
+#define DIR_CHAINED 0x80000000u
+#define DIR_NEXT ((int) sizeof(uint64_t))
+// a full bucket is split at most this many times for one insert before it chains
+#define DIR_MAX_SPLITS 4
+// names that hash alike are told apart by the low DIR_DUP_BITS bits of their readdir cookie,
+// a hash of the name from another seed, so a bucket takes at most DIR_MAX_DUPS of them
+#define DIR_DUP_BITS 30
+#define DIR_MAX_DUPS (1 << DIR_DUP_BITS)
+#define DIR_DUP_SEED (2166136261u ^ 0x5bd1e995u)
+
+struct disk_dirent {
+	uint32_t inode;
+	uint8_t namelen;
+	char type;
+	char name[];
+};
+
+// entries are padded so that the next one starts 4-byte aligned
+#define DIRENT_LEN(namelen) ((offsetof(struct disk_dirent, name) + (namelen) + 3) & ~3)
+// the most entries one block holds
+#define DIR_BLOCK_ENTRIES (BLOCK_SIZE / DIRENT_LEN(1))
+
+struct disk_extent {
+	uint32_t lblk;
+	uint32_t start;
+	uint16_t len;
+	uint16_t start_hi;
+};
+
+#define INDEX_EXTENTS ((int) ((BLOCK_SIZE - 8) / sizeof(struct disk_extent)))
+#define INDEX_DEPTH 3
+
+// a file with more than one data block maps them with a tree of index blocks rooted at location.
+// a depth 0 node holds extents, a deeper node holds {lblk, start = child node, len = 0} entries.
+// the tree is packed: every node but the last on each level is full, so it only changes at the end.
+struct disk_index {
+	uint32_t count;
+	uint32_t depth;
+	struct disk_extent ext[INDEX_EXTENTS];
+};
+
+// the journal is a header block followed by a ring of log blocks, numbered by a sequence that
+// only grows: sequence s lives in ring slot s % nblocks, and the header names the oldest live one.
+// a transaction's records are packed into one or more log blocks, the last one marked commit.
+// unsafe is set while changes that were too big to journal are going straight to their blocks
+struct disk_loghead {
+	uint32_t magic;
+	uint32_t tail;
+	uint32_t unsafe;
+};
+
+struct disk_logblock {
+	uint32_t magic;
+	uint32_t seq;
+	uint32_t used;
+	uint32_t commit;
+	uint32_t sum;
+};
+
+// new bytes for [off, off + len) of blockn, then the bytes padded to 4.
+// len 0 revokes blockn: earlier records for it are not replayed, it has been freed.
+// before version 4 records stop at len
+struct disk_logrec {
+	uint32_t blockn;
+	uint16_t off;
+	uint16_t len;
+	uint32_t blockn_hi;
+};
+
+#define LOGREC_V3_SIZE 8
 
 static struct superblock {
+	int version;
 	int creationTime;
 	int mounted;
 	int devId;
-	int freeStart;
-	int freeEnd;
-	int root;
-	int maxBlocks;
-	int freeblocks;
-	int freeinodes;
+	blkno_t freeStart;
+	blkno_t freeEnd;
+	blkno_t root;
+	blkno_t maxBlocks;
+	blkno_t freeblocks;
+	blkno_t maxInodes;
+	blkno_t freeinodes;
+	blkno_t imapStart;
+	blkno_t itableStart;
+	blkno_t dataStart;
+	int inodeSize;
+	int maxName;
+	int clean;
 }Superblock;
 
-struct file_to_inode_dict {
-	char type;	
-	char name[MAX_NAME_LEN];
-	int inode;
+// a run of len physical blocks starting at start, holding logical blocks lblk onwards
+struct extent {
+	int lblk;
+	blkno_t start;
+	int len;
 };
 
-static struct inode {
-	int size;
-	int uid;
-	int gid;
+// an inode in memory. what getattr and the block map read comes first, on one cache line,
+// the rest is only used when the inode changes.
+// nlookup counts the entries the kernel was given for it and has not forgotten yet
+struct inode {
 	int mode;
+	int linkcount;
+	off_t size;
 	int atime;
 	int ctime;
 	int mtime;
-	int linkcount;
+	int nextent;
+	int inlined;
+	struct extent *ext;
+	int uid;
+	int gid;
 	int subn;
+	blkno_t parent;
 	int indirect;
-	int location;
-	char type;
-	struct file_to_inode_dict filename_to_inode_dict[MAX_FILE_NUM];
-}block[MAX_BLOCK_NUM];
+	blkno_t location;
+	int extcap;
+	int extdirty;
+	int depth;
+	int nnode[INDEX_DEPTH];
+	blkno_t *node[INDEX_DEPTH];
+	unsigned long nlookup;
+	struct islab *slab;
+	struct inode *nextfree;
+};
+
+// the inode table maps an inode number to its struct inode, NULL until it is read in.
+// it is paged: a page of ITABLE_PAGE entries and their locks is allocated when an inode in it
+// is first used, so memory follows the inodes in use, only the page directory follows the size
+// of the device.
+// a freed inode's entry points at dead_inode, which has no links.
+// an inode that loses its last link while the kernel still holds it is an orphan: it stays in
+// the table, and on the image, with no links until the kernel forgets it.
+// one the kernel forgets with its links is evicted: its entry goes back to NULL and the next
+// use reads it in again, so memory follows the inodes the kernel holds, not all it has seen.
+// inodes are carved from slabs of INODE_SLAB. a slab with free inodes is on ifree, and one
+// left with none in use is given back, unless it is the only one with room
+#define ITABLE_PAGE 256
+#define INODE_SLAB 64
+
+static struct ipage {
+	struct inode *ino[ITABLE_PAGE];
+	pthread_rwlock_t lock[ITABLE_PAGE];
+}**itable;
+
+static struct islab {
+	struct islab *prev;
+	struct islab *next;
+	struct inode *free;
+	int nfree;
+	struct inode ino[INODE_SLAB];
+} *ifree;
+
+static struct inode dead_inode;
+static int ilive;
+static int islabs;
+static int ipages;
+
+// freemap bit set: block is free
+// freesum bit set: the freemap word has at least one free block
+// freedirty bit set: the freemap word has not been written to the free list yet.
+// freedirtysum bit set: the freedirty word has a bit set for a word of the group, counted from
+// the group's first freedirty word; each group has GROUP_DIRTYSUM_WORDS of them.
+// all four are sized from the superblock by alloc_tables
+static uint64_t *freemap;
+static uint64_t *freesum;
+static uint64_t *freedirty;
+static uint64_t *freedirtysum;
+
+// imap bit set: inode number is free, in images with an inode table.
+// a word is changed and written to the image under imap_lock, no free inode lies below word
+// ihint, so inodes are handed out lowest first and the table stays dense
+static uint64_t *imap;
+static blkno_t ihint;
+
+// set once fallocate has said the image's file system cannot punch holes
+static int nopunch;
+
+// operations run on many threads at once.
+// each inode has a reader/writer lock in its table page: reads and lookups in a directory hold
+// it shared, changes hold it exclusive. it is kept outside struct inode so freeing an inode does
+// not free a lock another thread is waiting on. a directory is always locked before anything
+// in it, and only a rename locks two directories, see do_rename. load_lock guards the table
+// and the slabs, and serializes reading inodes in on first use.
+// every operation that changes metadata joins the journal transaction before it takes any of these.
+// freemap words are changed under their group's lock, freesum, freedirty and freedirtysum bits
+// with atomic operations since their words span groups, and the group's free_lock orders
+// writers of its part of the free list.
+// block_lock may be held when a group lock is taken, never the other way round.
+// imap_lock is held while an imap word is written, so it is taken before block_lock
+static pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t imap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t rename_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t group_lock[ALLOC_GROUPS] = { [0 ... ALLOC_GROUPS - 1] = PTHREAD_MUTEX_INITIALIZER };
+static pthread_mutex_t free_lock[ALLOC_GROUPS] = { [0 ... ALLOC_GROUPS - 1] = PTHREAD_MUTEX_INITIALIZER };
+static int next_home;
+static __thread int home = -1;
+
+// dcache maps (directory inode, name) to an inode, an entry is filled with its directory locked.
+// inode 0 marks a negative entry: the name is known not to exist. parent 0 is no directory,
+// so an entry never filled matches nothing. entries name their directory by inode, so moving a
+// directory leaves those below it right. the path handlers --convert calls walk paths through it
+static struct dentry {
+	blkno_t parent;
+	blkno_t inode;
+	char name[MAX_NAME_LEN + 1];
+}dcache[DCACHE_SIZE];
+
+static pthread_mutex_t dcache_lock[CACHE_LOCKS] = { [0 ... CACHE_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER };
+
+// every block access goes through a fixed pool of buffers, hashed by block number.
+// lsn is the last transaction that changed the buffer, it may not be written back before
+// that transaction is durable in the journal.
+// a buffer with ref > 0 is being copied in or out and is neither evicted nor flushed.
+// writes only dirty the buffer: it reaches the image on eviction, from the flusher
+// thread, or at unmount, so repeated updates to the same block cost one write.
+// victims are picked by CLOCK: a sweep clears used bits and takes the first clear one.
+// a miss reads the block in without block_lock held, loading is set until it is there
+// and anyone else after the block waits on load_cond.
+static struct buf {
+	blkno_t blockn;
+	int ref;
+	int dirty;
+	int used;
+	int loading;
+	int next;
+	unsigned lsn;
+	char *data;
+}*bcache;
+
+static int nbuf = BCACHE_BUFS;
+static int *bhash;
+static int bhand;
+static char *bdata;
+static pthread_mutex_t block_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t load_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t buf_cond = PTHREAD_COND_INITIALIZER;
+static int bwaiting;
+static pthread_t flusher;
+static int flusher_running;
+
+// fsync callers share fdatasyncs: sync_started counts syncs begun, sync_done the last one finished.
+// a caller needs one that begins after it arrives, and if another caller is already running
+// a sync, it waits and the next one to begin covers everyone that arrived meanwhile
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long sync_started;
+static unsigned long sync_done;
+static int syncing;
+static int sync_res;
+
+// hit counts for block reads and writes, absorbed counts writes to an already dirty buffer,
+// the rest say who wrote dirty buffers back
+static struct bstat {
+	unsigned long reads;
+	unsigned long readhits;
+	unsigned long writes;
+	unsigned long writehits;
+	unsigned long absorbed;
+	unsigned long evictflush;
+	unsigned long timedflush;
+	unsigned long syncflush;
+	unsigned long syncs;
+	unsigned long syncwaits;
+	unsigned long commits;
+	unsigned long commitops;
+	unsigned long logblocks;
+	unsigned long checkpoints;
+	unsigned long overflows;
+}bstat;
+
+// what each handler in vfs_oper or vfs_ll_oper did: calls, failures, bytes read or written,
+// time spent and its latencies, and the image I/O it caused. I/O outside any handler, by the
+// flusher or at mount, is charged to OP_NONE
+enum {
+	OP_NONE,
+	OP_GETATTR,
+	OP_OPENDIR,
+	OP_READDIR,
+	OP_RELEASEDIR,
+	OP_OPEN,
+	OP_READ,
+	OP_READ_BUF,
+	OP_CREATE,
+	OP_MKDIR,
+	OP_RMDIR,
+	OP_RENAME,
+	OP_RELEASE,
+	OP_FLUSH,
+	OP_FSYNC,
+	OP_FSYNCDIR,
+	OP_WRITE,
+	OP_WRITE_BUF,
+	OP_LINK,
+	OP_UNLINK,
+	OP_STATFS,
+	OP_CHMOD,
+	OP_CHOWN,
+	OP_UTIMENS,
+	OP_TRUNCATE,
+	OP_LOOKUP,
+	OP_FORGET,
+	OP_SETATTR,
+	OP_COUNT
+};
+
+struct opstat {
+	unsigned long calls;
+	unsigned long errors;
+	unsigned long bytes;
+	unsigned long ns;
+	unsigned long lat[LAT_BUCKETS];
+	unsigned long reads;
+	unsigned long readbytes;
+	unsigned long writes;
+	unsigned long writebytes;
+	unsigned long syncs;
+	unsigned long punches;
+};
 
-static int freeblock[25][400];
-static char zero[BLOCK_SIZE];
+// every counter a thread keeps, all unsigned long so they can be summed as an array
+struct counters {
+	struct opstat op[OP_COUNT];
+	unsigned long allocs;
+	unsigned long allocblocks;
+	unsigned long allocshort;
+	unsigned long allocfails;
+	unsigned long freedblocks;
+	unsigned long dlookups;
+	unsigned long dhits;
+};
+
+// each thread counts into its own tstat, so counting takes no lock and shares no cache line.
+// reading the statistics adds all of them up. a tstat outlives its thread and is handed to the
+// next new one, so threads libfuse starts and stops do not use up memory.
+// spare_stats heads the list, and is shared by threads that could not get one of their own
+static struct tstat {
+	struct counters c;
+	int inuse;
+	struct tstat *next;
+}spare_stats;
+
+static __thread struct tstat *mystats;
+static __thread int curop;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+
+// a map from block numbers to a value, by open addressing, for the few blocks the journal tracks.
+// an entry keeps blockn + 1, so 0 marks an empty slot
+struct blockmap {
+	struct blockent {
+		blkno_t key;
+		unsigned long val;
+	}*ent;
+	size_t cap;
+	size_t n;
+};
+
+// operations that change metadata hold a handle on the running transaction, txn,
+// and write_block appends each change they make to it. commits happen when no handle is held:
+// the records go to the ring in one write, followed by one fdatasync, for every operation since
+// the last commit. blocks are written home lazily, and the tail only moves at a checkpoint,
+// when the ring is too full for another transaction or at unmount.
+// a transaction that outgrows LOG_MAX_TXN or half the cache overflows: it stops logging
+// and the header is marked unsafe until its changes are checkpointed.
+// blocks freed by the running transaction are only returned to the free list when it commits,
+// so nothing can reuse them and overwrite what the journal may still replay there. inodes it
+// frees wait the same way, so a lookup that raced with the removal does not find the number
+// already taken by a new file.
+// logged maps each block the ring holds records for to the last transaction that logged it,
+// so freeing it knows whether to revoke it. it is emptied when a checkpoint empties the ring
+static struct journal {
+	blkno_t start;
+	int nblocks;
+	uint32_t head;
+	uint32_t tail;
+	unsigned txn;
+	unsigned durable;
+	unsigned tailtxn;
+	int handles;
+	int committing;
+	int overflow;
+	int damaged;
+	int nbufs;
+	int ops;
+	char *buf;
+	size_t len;
+	size_t cap;
+	struct extent *freed;
+	int nfreed;
+	int freedcap;
+	blkno_t freedblocks;
+	blkno_t *ifreed;
+	int nifreed;
+	int ifreedcap;
+	struct blockmap logged;
+}journal = { .txn = 1, .tailtxn = 1 };
 
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+
+int bcache_init(int n);
+struct buf *bcache_get(blkno_t blockn, int fill, unsigned long *hits);
+void bcache_put(struct buf *b, int dirty);
+int bcache_writeback(struct buf *b);
+void bcache_flush(blkno_t start, blkno_t n, unsigned long *count);
+int bcache_drop(blkno_t start, blkno_t n);
+int bcache_discard(blkno_t start, blkno_t n);
+void bcache_report(void);
+static struct counters *thread_stats(void);
+static ssize_t image_read(void *buf, size_t len, off_t off);
+static ssize_t image_write(const void *buf, size_t len, off_t off);
+static int image_sync(void);
+static int is_stats_file(const char *path);
+static int open_file(blkno_t inoden, struct fuse_file_info *fi);
+int bcache_sync(void);
+static void log_overflow(void);
+ssize_t read_block(blkno_t blockn, void *buf, size_t len, off_t off);
+ssize_t write_block(blkno_t blockn, const void *buf, size_t len, off_t off);
+ssize_t write_data_block(blkno_t blockn, const void *buf, size_t len, off_t off);
+unsigned long blockmap_get(struct blockmap *m, blkno_t blockn);
+int blockmap_set(struct blockmap *m, blkno_t blockn, unsigned long val);
+void blockmap_clear(struct blockmap *m);
+void log_begin(void);
+void log_end(void);
+int log_commit(void);
+int log_checkpoint(void);
+int log_replay(void);
+void log_init(void);
+void log_free(blkno_t start, blkno_t len);
+static uint32_t hash_name(uint32_t h, const char *name, int len);
+int alloc_tables(void);
+static void dirty_word(blkno_t w);
+static void mark_run(blkno_t start, blkno_t len, int isfree);
 void initial_freeblock(void);
-int split_to_blockn(const char *path, int parent);
-int find_parent_inode(const char *path);
+blkno_t split_to_blockn(const char *path, int parent);
+blkno_t find_parent_inode(const char *path);
 char* split_to_name(const char *path);
+blkno_t dcache_get(blkno_t dir, const char *name, int len);
+blkno_t lookup_name(blkno_t dir, const char *name, int len);
+blkno_t lookup_path(const char *path, int len);
+void dcache_set(blkno_t dir, const char *name, int len, blkno_t inode);
+void dcache_update(blkno_t parent, const char *name, blkno_t inode);
+struct inode *lock_inode(blkno_t inoden, int write);
+struct inode *lock_dir(blkno_t dirn);
+void unlock_inode(blkno_t inoden);
 int same_name_in_path(const char *path);
-int find_first_freeblock(void);
-int find_name_in_inode(struct inode p, char *name);
-void write_freeblock(int idxi);
-void restore_freeblock(int idxn);
-void write_dir_inode(struct inode ino);
-void write_file_inode(struct inode ino, int blockn);
-void empty_file(int filelocation);
-void remove_file(int filelocation);
-int blocklist(char* list, int mode);
-void write_file(int filelocation, char* content, int from, int to);
+blkno_t find_first_freeblock(void);
+blkno_t alloc_inode(void);
+void release_inode(blkno_t n);
+void imap_free(blkno_t n);
+int alloc_blocks(int n, blkno_t *blocks);
+void free_blocks(int n, blkno_t *blocks);
+void release_blocks(blkno_t start, blkno_t len);
+int punch_blocks(blkno_t start, blkno_t len);
+blkno_t alloc_extent(blkno_t goal, int want, int *len);
+void free_extent(blkno_t start, int len);
+int add_extent(struct inode *ino, blkno_t start, int len);
+int extend_file(struct inode *ino, int n);
+int file_blocks(struct inode *ino);
+blkno_t last_file_block(struct inode *ino);
+blkno_t bmap(struct inode *ino, int lblk);
+int find_extent(struct inode *ino, int lblk);
+blkno_t bmap_run(struct inode *ino, int lblk, int *run);
+int write_index(struct inode *ino);
+void free_index(struct inode *ino);
+int grow_blocks(struct inode *ino, int n);
+void shrink_blocks(struct inode *ino, int nblocks);
+void truncate_blocks(struct inode *ino, int nblocks);
+blkno_t dir_lookup(blkno_t dirn, const char *name, int len);
+int dir_add(blkno_t dirn, const char *name, int len, blkno_t inode, char type);
+blkno_t dir_remove(blkno_t dirn, const char *name, int len);
+void dir_init_block(blkno_t blockn);
+void write_freeblock(void);
+void write_free_group(int g);
+void restore_freeblock(blkno_t idxn);
+int mkfs(blkno_t nblocks, blkno_t ninodes, int maxname);
+int load_superblock(void);
+int load_index(struct inode *ino);
+int read_inode(blkno_t inoden, struct inode *ino);
+struct inode *get_inode(blkno_t inoden);
+struct inode *new_inode(blkno_t inoden);
+void free_inode(blkno_t inoden);
+void write_superblock(void);
+void write_inode(struct inode *ino, blkno_t inoden);
+void remove_file(blkno_t filelocation);
 
-void initial_freeblock(void) 
+int bcache_init(int n)
 {
-	int i,j;
-	for (j = 0; j < 400; j++) {
-		if (j <= 25) 
-		freeblock[0][j] = 0;
-		else
-		freeblock[0][j] = j;
+	int i;
+	bcache = calloc(n, sizeof(struct buf));
+	bhash = malloc(n * sizeof(int));
+	bdata = malloc((size_t) n * BLOCK_SIZE);
+	if (bcache == NULL || bhash == NULL || bdata == NULL) {
+		return -1;
 	}
-	for (i = 1; i < 26; i++) {
-		for (j = 0; j < 400; j++) {
-			freeblock[i][j] = 400 * i + j;
-		}
+	for (i = 0; i < n; i++) {
+		bcache[i].blockn = -1;
+		bcache[i].next = -1;
+		bcache[i].data = bdata + (size_t) i * BLOCK_SIZE;
+		bhash[i] = -1;
 	}
+	nbuf = n;
+	bhand = 0;
+	return 0;
+}
 
-	freeblock[0][26] = 0;
+static int bcache_writable(struct buf *b)
+{
+	// write-ahead: a change goes home only after its transaction is in the journal,
+	// unless the transaction overflowed and is not being journaled at all
+	return b->lsn <= journal.durable || journal.overflow;
+}
 
-	for (i = 1; i < 26; i++) {
-		write_freeblock(i);
+static struct buf *bcache_find(blkno_t blockn)
+{
+	int i;
+	for (i = bhash[blockn % nbuf]; i != -1; i = bcache[i].next) {
+		if (bcache[i].blockn == blockn) {
+			return &bcache[i];
+		}
 	}
+	return NULL;
 }
 
-int split_to_blockn(const char *path, int parent) 
-{	
-	// parent == 1: find parent path inode
-	// parent == 0: find path inode
+static void bcache_unhash(struct buf *b)
+{
+	int *p = &bhash[b->blockn % nbuf];
+	while (*p != b - bcache) {
+		p = &bcache[*p].next;
+	}
+	*p = b->next;
+	b->blockn = -1;
+	b->next = -1;
+}
 
-	int i, j = 0, N;
-	char *name[MAX_FILE_NUM];
-	char temp[MAX_PATH_LEN];
-	strcpy(temp, path);
-	int temi[MAX_PATH_LEN];
+struct buf *bcache_get(blkno_t blockn, int fill, unsigned long *hits)
+{
+	// find or load blockn and take a reference, called with block_lock held, which is let go
+	// while the block is read in.
+	// fill == 0 skips reading a block the caller is about to overwrite whole.
+	// return NULL if the image cannot be read or written
+	struct buf *b;
+	int i, res, pinned;
 
-	for (i = 0; i < strlen(path); i++) {
-		if (temp[i] == '/') {
-			temp[i] = '\0';
-			temi[j++] = i;  
+	for (;;) {
+		b = bcache_find(blockn);
+		if (b != NULL) {
+			(*hits)++;
+			b->used = 1;
+			b->ref++;
+			while (b->loading) {
+				pthread_cond_wait(&load_cond, &block_lock);
+			}
+			if (b->blockn != blockn) {
+				// the read failed
+				b->ref--;
+				return NULL;
+			}
+			return b;
 		}
-	}
-	
-	N = j;
-	for (i = 0; i < N - parent; i++) {
-		name[i] = temp + temi[i] + 1;
-	}
-	
-	int inoden = 26;
-	for (i = 0; i < N - parent; i++) {
-		for (j = 0; j < MAX_FILE_NUM; j++) {
-			if (strcmp(block[inoden].filename_to_inode_dict[j].name, name[i]) == 0) {
-				inoden = block[inoden].filename_to_inode_dict[j].inode;
-				break;				
+		for (i = 0, pinned = 0; i < 2 * nbuf; i++) {
+			b = &bcache[bhand];
+			bhand = (bhand + 1) % nbuf;
+			if (b->ref > 0) {
+				continue;
+			}
+			if (b->dirty && !bcache_writable(b)) {
+				pinned = 1;
+				continue;
+			}
+			if (b->used) {
+				b->used = 0;
+				continue;
 			}
+			if (b->dirty) {
+				if (bcache_writeback(b) != 0) {
+					return NULL;
+				}
+				bstat.evictflush++;
+			}
+			if (b->blockn != -1) {
+				bcache_unhash(b);
+			}
+			b->blockn = blockn;
+			b->lsn = 0;
+			b->next = bhash[blockn % nbuf];
+			bhash[blockn % nbuf] = b - bcache;
+			b->used = 1;
+			b->ref = 1;
+			if (fill) {
+				b->loading = 1;
+				pthread_mutex_unlock(&block_lock);
+				res = image_read(b->data, BLOCK_SIZE, (off_t) blockn * BLOCK_SIZE);
+				pthread_mutex_lock(&block_lock);
+				b->loading = 0;
+				pthread_cond_broadcast(&load_cond);
+				if (res != BLOCK_SIZE) {
+					bcache_unhash(b);
+					b->ref--;
+					return NULL;
+				}
+			}
+			return b;
+		}
+		// every buffer is in use by another thread or holds a change the journal does not have
+		// yet: stop journaling the running transaction so those can go home, or wait for a buffer
+		if (pinned) {
+			log_overflow();
+		}
+		else {
+			bwaiting++;
+			pthread_cond_wait(&buf_cond, &block_lock);
+			bwaiting--;
 		}
 	}
-
-	return inoden;
 }
 
-int find_parent_inode(const char *path)
+void bcache_put(struct buf *b, int dirty)
 {
-	char temp[MAX_PATH_LEN];
-	int i, pathcount = 0;
-	int parent_inode;
-	strcpy(temp, path);
-
-	for (i = 0; i < strlen(path); i++) {
-		if (temp[i] == '/') {
-			pathcount++; 
-		}
+	b->ref--;
+	b->dirty |= dirty;
+	if (b->ref == 0 && bwaiting > 0) {
+		pthread_cond_broadcast(&buf_cond);
 	}
+}
 
-	if (pathcount == 1) {
-		return 26;
-	}
-	else {
-		parent_inode = split_to_blockn(path, 1);
-		return parent_inode;
+int bcache_writeback(struct buf *b)
+{
+	if (image_write(b->data, BLOCK_SIZE, (off_t) b->blockn * BLOCK_SIZE) != BLOCK_SIZE) {
+		return -1;
 	}
+	b->dirty = 0;
+	return 0;
 }
 
-char* split_to_name(const char *path) 
-{	
-	// split path to get file name
-
-	int i,j=0,N;	
-	char *name[MAX_FILE_NUM];
-	char temp[MAX_PATH_LEN];
-	char *tem;
-	strcpy(temp, path);
-	int temi[MAX_PATH_LEN];
+static int bcache_flushable(struct buf *b)
+{
+	// a referenced buffer may be half copied into, except during a commit when nothing writes
+	return b->dirty && (b->ref == 0 || journal.committing) && bcache_writable(b);
+}
 
-	for (i = 0; i < strlen(path); i++) {
-		if (temp[i] == '/') {
-			temp[i] = '\0';
-			temi[j++] = i;  
+void bcache_flush(blkno_t start, blkno_t n, unsigned long *count)
+{
+	// write back the dirty buffers for blocks [start, start + n), n == -1 means all of them.
+	// called with block_lock held, count is the statistic to charge
+	struct buf *b;
+	blkno_t i;
+	if (n == -1 || n > nbuf) {
+		for (i = 0; i < nbuf; i++) {
+			b = &bcache[i];
+			if (bcache_flushable(b) && (n == -1 || (b->blockn >= start && b->blockn < start + n))
+			    && bcache_writeback(b) == 0) {
+				(*count)++;
+			}
 		}
+		return;
 	}
-	
-	N = j;
-	for (i = 0; i < N; i++) {
-		name[i] = temp + temi[i] + 1;
+	for (i = start; i < start + n; i++) {
+		b = bcache_find(i);
+		if (b != NULL && bcache_flushable(b) && bcache_writeback(b) == 0) {
+			(*count)++;
+		}
 	}
-	
-	tem = name[--i];
-	return tem;
 }
 
-int find_name_in_inode(struct inode p, char *name)
+int bcache_drop(blkno_t start, blkno_t n)
 {
-	int i, hit = 0;
-	for (i = 0; i < p.subn; i++) {
-		if (strcmp(p.filename_to_inode_dict[i].name, name) == 0) {
-			hit = i;
-			return hit;
+	// forget blocks [start, start + n) before they are written around the cache,
+	// dirty ones go out first so bytes the caller does not overwrite survive.
+	// return -1 if one is in use, cannot be written yet or fails to and stays cached
+	struct buf *b;
+	blkno_t i;
+	int res = 0;
+	pthread_mutex_lock(&block_lock);
+	for (i = start; i < start + n; i++) {
+		b = bcache_find(i);
+		if (b == NULL) {
+			continue;
 		}
+		if (b->ref > 0 || (b->dirty && !bcache_writable(b))) {
+			res = -1;
+			continue;
+		}
+		if (b->dirty) {
+			if (bcache_writeback(b) != 0) {
+				res = -1;
+				continue;
+			}
+			bstat.syncflush++;
+		}
+		bcache_unhash(b);
+		b->used = 0;
 	}
-	return hit;
+	pthread_mutex_unlock(&block_lock);
+	return res;
 }
 
-int find_first_freeblock(void)
+int bcache_discard(blkno_t start, blkno_t n)
 {
-	int i, j, hit = 0, first_freeblock = -1;
-	for (i = 0; i < 25; i++) {
-		for (j = 0; j < 400; j++){
-			if (freeblock[i][j] != 0) {
-				first_freeblock = freeblock[i][j];
-				freeblock[i][j] = 0;
-				hit = 1;
-				write_freeblock(i+1);
-				break;
-			}
+	// forget blocks [start, start + n) without writing them back, nothing will read what they
+	// hold. return -1 if one is in use and stays cached
+	struct buf *b;
+	blkno_t i;
+	int res = 0;
+	pthread_mutex_lock(&block_lock);
+	for (i = start; i < start + n; i++) {
+		b = bcache_find(i);
+		if (b == NULL) {
+			continue;
 		}
-		if (hit == 1) {
-			break;
+		if (b->ref > 0) {
+			res = -1;
+			continue;
 		}
+		bcache_unhash(b);
+		b->dirty = 0;
+		b->used = 0;
 	}
-	if (first_freeblock != 1) {
-		Superblock.freeblocks--;
-	}
-	return first_freeblock;
+	pthread_mutex_unlock(&block_lock);
+	return res;
 }
 
-void write_dir_inode(struct inode ino) 
+static void *bcache_flusher(void *arg)
 {
-	char filename[30];
-	int i;
-
-	// get inode number
-	int ino_num = ino.filename_to_inode_dict[0].inode;
-	
-	FILE *fp;
-	sprintf(filename, "%s%d", fusedata, ino_num);
-	fp = fopen(filename, "r+");
-	
-	fprintf(fp, "{size:%d, uid:%d, gid:%d, mode:%d, atime:%d, ctime:%d, mtime:%d, linkcount:%d, ", 
-		    ino.size, ino.uid, ino.gid, ino.mode, ino.atime, ino.ctime, ino.mtime, ino.linkcount);
-	
-	fputs("filename_to_inode_dict: {", fp);
-	for (i = 0; i < ino.subn; i++) {
-		fprintf(fp, "%c:%s:%d", ino.filename_to_inode_dict[i].type, ino.filename_to_inode_dict[i].name,
-							    ino.filename_to_inode_dict[i].inode);
-		if (i < ino.subn - 1) {
-			fputs(", ", fp);
+	// commit the journal and write dirty buffers back every BCACHE_FLUSH_SECS until unmount
+	struct timespec ts;
+	(void) arg;
+	int pending;
+	pthread_mutex_lock(&block_lock);
+	while (flusher_running == 1) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += BCACHE_FLUSH_SECS;
+		pthread_cond_timedwait(&flush_cond, &block_lock, &ts);
+		if (flusher_running != 1) {
+			break;
+		}
+		// this is the group commit: everything done since the last one is committed together
+		pending = journal.len > 0 || journal.nfreed > 0 || journal.overflow;
+		pthread_mutex_unlock(&block_lock);
+		if (pending) {
+			log_commit();
 		}
+		pthread_mutex_lock(&block_lock);
+		bcache_flush(0, -1, &bstat.timedflush);
 	}
-	fputs("}}", fp);
-	fputs("00000000000000000000000000000", fp);
-	fclose(fp);
+	pthread_mutex_unlock(&block_lock);
+	return NULL;
 }
 
-void write_file_inode(struct inode ino, int blockn) 
+int bcache_sync(void)
 {
-	char filename[30];
-	int ino_num = blockn;
-	
-	FILE *fp;
-	sprintf(filename, "%s%d", fusedata, ino_num);
-	fp = fopen(filename, "r+");
-	
-	fprintf(fp, "{size:%d, uid:%d, gid:%d, mode:%d, linkcount:%d, atime:%d, ctime:%d, mtime:%d, 
-		        indirect:%d, location:%d", ino.size, ino.uid, ino.gid, ino.mode, ino.linkcount, 
-		        ino.atime, ino.ctime, ino.mtime, ino.indirect, ino.location);
-
-	fputs("}", fp);
-	fputs("00000000000000000000000000000", fp);
-	fclose(fp);
-}
+	// make everything written so far durable: commit the journal, which writes back
+	// what may go home and then fdatasyncs
+	unsigned long mine, want;
+	int res;
 
-void write_freeblock(int idxi)
-{
-	char filename[30];
-	int j;
-	
-	FILE *fp;
-	sprintf(filename, "%s%d", fusedata, idxi);
-	fp = fopen(filename, "w");
-	
-	idxi = idxi - 1;
-	for (j = 0; j < 400; j++) {
-		if (idxi != 0 || j > 25) {
-			fprintf(fp, "%d, ", freeblock[idxi][j]);
+	pthread_mutex_lock(&sync_lock);
+	want = sync_started + 1;
+	bstat.syncwaits++;
+	while (sync_done < want) {
+		if (syncing) {
+			pthread_cond_wait(&sync_cond, &sync_lock);
+			continue;
 		}
+		syncing = 1;
+		mine = ++sync_started;
+		pthread_mutex_unlock(&sync_lock);
+
+		res = log_commit();
+		pthread_mutex_lock(&block_lock);
+		bstat.syncs++;
+		pthread_mutex_unlock(&block_lock);
+
+		pthread_mutex_lock(&sync_lock);
+		syncing = 0;
+		sync_done = mine;
+		sync_res = res;
+		pthread_cond_broadcast(&sync_cond);
 	}
-	fclose(fp);
+	res = sync_res;
+	pthread_mutex_unlock(&sync_lock);
+	return res;
 }
 
-void restore_freeblock(int idxn)
+static double rate(unsigned long part, unsigned long whole)
 {
-	int i = idxn / 400;
-	int j = idxn % 400;
-	freeblock[i][j] = idxn;
-	write_freeblock(i+1);
-
-	char filename[30];
-	sprintf(filename, "%s%d", fusedata, idxn);
-	FILE *fp;
-	fp = fopen(filename, "w");
-	fprintf(fp, "%s", zero);
-	fclose(fp);
-
-	Superblock.freeblocks++;
+	return whole == 0 ? 0.0 : 100.0 * part / whole;
 }
 
-void empty_file(int filelocation)
+void bcache_report(void)
 {
-	char filename[30];
-	sprintf(filename, "%s%d", fusedata, filelocation);
-	FILE *fp;
-	fp = fopen(filename, "w");
-	fclose(fp);
+	unsigned long flushed = bstat.evictflush + bstat.timedflush + bstat.syncflush;
+	fprintf(stderr, "block cache: %d buffers\n", nbuf);
+	fprintf(stderr, "  reads  %lu, %.1f%% hit\n", bstat.reads, rate(bstat.readhits, bstat.reads));
+	fprintf(stderr, "  writes %lu, %.1f%% hit, %.1f%% absorbed by a dirty buffer\n", bstat.writes, 
+	        rate(bstat.writehits, bstat.writes), rate(bstat.absorbed, bstat.writes));
+	fprintf(stderr, "  write-backs %lu: %lu on eviction, %lu by the flusher, %lu on sync\n", flushed, 
+	        bstat.evictflush, bstat.timedflush, bstat.syncflush);
+	fprintf(stderr, "  fsyncs %lu, served by %lu commits\n", bstat.syncwaits, bstat.syncs);
+	fprintf(stderr, "journal: %lu commits of %.1f operations, %lu log blocks, %lu checkpoints, %lu overflows\n", 
+	        bstat.commits, bstat.commits == 0 ? 0.0 : (double) bstat.commitops / bstat.commits, 
+	        bstat.logblocks, bstat.checkpoints, bstat.overflows);
+	fprintf(stderr, "inode table: %d inodes in use, %d slabs of %d, %d pages\n", ilive, islabs, INODE_SLAB, ipages);
 }
 
-void remove_file(int filelocation)
+static void stats_release(void *p)
 {
-	int i, r;
-	if(block[filelocation].indirect == 1) {
-			char filename[30];
-			sprintf(filename, "%s%d", fusedata, block[filelocation].location);
-			FILE *fp;
-			char blocklist_info[1700];
-			for (i = 0; i < 1700; i++) {
-				blocklist_info[i] = '\0';
-			}
-			fp = fopen(filename, "r");
-			r = fread(blocklist_info, 1, 1700, fp);
-			fclose(fp);
-			r = blocklist(blocklist_info, 3);	
-	}
-
-	restore_freeblock(block[filelocation].location);
-	restore_freeblock(filelocation);
-	memset(&block[filelocation], 0, sizeof(block[filelocation]));
-
-	(void) r;
+	// the thread is exiting, its counts stay in the sums and its tstat goes to the next new thread
+	struct tstat *t = p;
+	pthread_mutex_lock(&stats_lock);
+	t->inuse = 0;
+	pthread_mutex_unlock(&stats_lock);
 }
 
-void write_file(int filelocation, char* content, int from, int to)
+static void stats_key_init(void)
 {
-	int i;
-	char filename[30];
-	sprintf(filename, "%s%d", fusedata, filelocation);
-	FILE *fp;
-	fp = fopen(filename, "w");
-	for (i = from; i <= to; i++) {
-		fprintf(fp, "%c", content[i]);
-	}
-	fclose(fp);
+	pthread_key_create(&stats_key, stats_release);
 }
 
-int blocklist(char* list, int mode)
+static struct counters *thread_stats(void)
 {
-	// mode == 1: return last block in filedata blocklist
-	// mode == 2: return block num taken
-	// mode == 3: loopup blocklist and empty
-	
-	int i, k;
-	char blocklist[4096];
-	char block[5];
-	int blockn[MAX_FILE_BLOCK];
-	strcpy(blocklist, list);
-	int j = 0, n = 0;
-	for (i = 0; i < strlen(blocklist); i++) {
-		if (blocklist[i] != ',') {
-			block[j++] = blocklist[i];
-		}
-
-		else {
-			blockn[n++] = atoi(block);
-			for (k = 0; k < 5; k++) {
-				block[k] = '\0';
-			}
-			j = 0;
-			if (mode == 3) {
-				restore_freeblock(blockn[n - 1]);
-			}
-		}
+	struct tstat *t;
+	if (mystats != NULL) {
+		return &mystats->c;
 	}
-	if (mode == 1) {
-		return blockn[--n];
+	pthread_once(&stats_once, stats_key_init);
+	pthread_mutex_lock(&stats_lock);
+	for (t = spare_stats.next; t != NULL && t->inuse; t = t->next);
+	if (t == NULL && (t = calloc(1, sizeof(struct tstat))) != NULL) {
+		t->next = spare_stats.next;
+		spare_stats.next = t;
 	}
-	else if (mode == 2) {
-		return --n;
+	if (t != NULL) {
+		t->inuse = 1;
 	}
-	else {
-		return 0;
+	pthread_mutex_unlock(&stats_lock);
+	if (t == NULL || pthread_setspecific(stats_key, t) != 0) {
+		t = &spare_stats;
 	}
+	mystats = t;
+	return &t->c;
 }
 
-static int vfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
-{	
-	int firstblock, fileblock;
-	firstblock = find_first_freeblock();
-	fileblock = find_first_freeblock();
-	if (firstblock == -1 || fileblock == -1) {
-		return -ENOSPC;
-	}
-	else {
-		Superblock.freeinodes -= 2;
-	}
-
-	mode = S_IFREG | 0664;
-
-	block[firstblock].size = 0;
-	block[firstblock].uid = 1;
-	block[firstblock].gid = 1;
-	block[firstblock].mode = mode;
-	block[firstblock].atime = (int) time(NULL);
-	block[firstblock].ctime = (int) time(NULL);
-	block[firstblock].mtime = (int) time(NULL);
-	block[firstblock].linkcount = 1;
-	block[firstblock].subn = 0;
-	block[firstblock].indirect = 0;
-	block[firstblock].location = fileblock;
-
-	write_file_inode(block[firstblock], firstblock);
+// every read, write and sync of the image goes through these, and is charged to the running handler
+static ssize_t image_read(void *buf, size_t len, off_t off)
+{
+	struct opstat *s = &thread_stats()->op[curop];
+	s->reads++;
+	s->readbytes += len;
+	return pread(fusefd, buf, len, off);
+}
 
-	// modify parent inode
-	int parent_inode = find_parent_inode(path);
-	
-	char *mkdirname = split_to_name(path);
-	strcpy(block[parent_inode].filename_to_inode_dict[block[parent_inode].subn].name, mkdirname);
-	block[parent_inode].filename_to_inode_dict[block[parent_inode].subn].type = 'f';
-	block[parent_inode].filename_to_inode_dict[block[parent_inode].subn].inode = firstblock;
-	block[parent_inode].subn++;
-	
-	write_dir_inode(block[parent_inode]);
+static ssize_t image_write(const void *buf, size_t len, off_t off)
+{
+	struct opstat *s = &thread_stats()->op[curop];
+	s->writes++;
+	s->writebytes += len;
+	return pwrite(fusefd, buf, len, off);
+}
 
-	char filename[30];
-	FILE *fp;
-	sprintf(filename, "%s%d", fusedata, block[firstblock].location);
-	fp = fopen(filename, "w");
-	fclose(fp);
+static int image_sync(void)
+{
+	thread_stats()->op[curop].syncs++;
+	return fdatasync(fusefd);
+}
 
-	(void) fi;
-	return 0;	            
+static int64_t op_begin(int op)
+{
+	struct timespec ts;
+	curop = op;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-static int vfs_mkdir(const char *path, mode_t mode)
+static int op_end(int op, int64_t start, int res, size_t bytes)
 {
-	int firstblock;
-	firstblock = find_first_freeblock();
-	if (firstblock == -1) {
-		return -ENOSPC;
+	// count a call of op that began at start and returns res, having moved bytes if it succeeded
+	struct opstat *s = &thread_stats()->op[op];
+	struct timespec ts;
+	uint64_t ns, us;
+	int b;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ns = (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec - start;
+	us = ns / 1000;
+	b = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+	s->calls++;
+	s->ns += ns;
+	s->lat[b < LAT_BUCKETS - 1 ? b : LAT_BUCKETS - 1]++;
+	if (res < 0) {
+		s->errors++;
 	}
 	else {
-		Superblock.freeinodes--;
+		s->bytes += bytes;
 	}
-
-	mode = 16877;
-
-	block[firstblock].size = 4096;
-	block[firstblock].uid = 1;
-	block[firstblock].gid = 1;
-	block[firstblock].mode = mode;
-	block[firstblock].atime = (int) time(NULL);
-	block[firstblock].ctime = (int) time(NULL);
-	block[firstblock].mtime = (int) time(NULL);
-	block[firstblock].linkcount = 2;
-	block[firstblock].subn = 2;
-	strcpy(block[firstblock].filename_to_inode_dict[0].name, ".");
-	block[firstblock].filename_to_inode_dict[0].type = 'd';
-	block[firstblock].filename_to_inode_dict[0].inode = firstblock;	
-	strcpy(block[firstblock].filename_to_inode_dict[1].name, "..");
-	block[firstblock].filename_to_inode_dict[1].type = 'd';
-	block[firstblock].filename_to_inode_dict[1].inode = find_parent_inode(path); 
-
-	write_dir_inode(block[firstblock]);
-
-	// modify parent inode
-	int parent_inode = find_parent_inode(path);
-	
-	char *mkdirname = split_to_name(path);
-	strcpy(block[parent_inode].filename_to_inode_dict[block[parent_inode].subn].name, mkdirname);
-	block[parent_inode].filename_to_inode_dict[block[parent_inode].subn].type = 'd';
-	block[parent_inode].filename_to_inode_dict[block[parent_inode].subn].inode = firstblock;
-	block[parent_inode].subn++;
-	block[parent_inode].linkcount++;
-
-	write_dir_inode(block[parent_inode]);
-
-	return 0;
+	curop = OP_NONE;
+	return res;
 }
 
-static int vfs_getattr(const char *path, struct stat *stbuf)
+ssize_t read_block(blkno_t blockn, void *buf, size_t len, off_t off)
 {
-	int res = 0;
-	
-	int block_num, parent_inode, i, hit = 0;
-	char name[MAX_NAME_LEN];
-	char* splitname = split_to_name(path);
-	struct inode p;
-	memset(stbuf, 0, sizeof(struct stat));
+	// copy len bytes at off within blockn out of the cache, the range may run into later blocks
+	struct buf *b;
+	size_t done, n;
+	for (done = 0; done < len; done += n, off = 0) {
+		blockn += off / BLOCK_SIZE;
+		off %= BLOCK_SIZE;
+		n = len - done < BLOCK_SIZE - off ? len - done : BLOCK_SIZE - off;
+		pthread_mutex_lock(&block_lock);
+		bstat.reads++;
+		b = bcache_get(blockn, 1, &bstat.readhits);
+		pthread_mutex_unlock(&block_lock);
+		if (b == NULL) {
+			return -1;
+		}
+		memcpy((char *) buf + done, b->data + off, n);
+		pthread_mutex_lock(&block_lock);
+		bcache_put(b, 0);
+		pthread_mutex_unlock(&block_lock);
+		blockn++;
+	}
+	return len;
+}
 
-	splitname = split_to_name(path);
-	strcpy(name, splitname);
-
-	if (strcmp(path, "/") == 0) {
-		p = block[26];
-	} 
-	else {	
-		parent_inode = find_parent_inode(path);
-		p = block[parent_inode];
-		for (i = 0; i < p.subn; i++) {
-			
-			if (strcmp(p.filename_to_inode_dict[i].name, name) == 0) {
-				block_num = p.filename_to_inode_dict[i].inode;
-				p = block[block_num];
-				hit = 1;
-				break;
-			}			
+static void log_append(blkno_t blockn, struct buf *b, int off, int len, const void *src);
+
+static ssize_t cache_write(blkno_t blockn, const void *buf, size_t len, off_t off, int logged)
+{
+	// copy into the cache and leave the buffer dirty, a whole-block write skips reading it first
+	struct buf *b;
+	size_t done, n;
+	for (done = 0; done < len; done += n, off = 0) {
+		blockn += off / BLOCK_SIZE;
+		off %= BLOCK_SIZE;
+		n = len - done < BLOCK_SIZE - off ? len - done : BLOCK_SIZE - off;
+		pthread_mutex_lock(&block_lock);
+		bstat.writes++;
+		b = bcache_get(blockn, n != BLOCK_SIZE, &bstat.writehits);
+		if (b != NULL) {
+			bstat.absorbed += b->dirty;
+			if (logged && (journal.handles > 0 || journal.committing)) {
+				log_append(blockn, b, off, n, (const char *) buf + done);
+			}
 		}
-		if (hit == 0){
-			return -ENOENT;
+		pthread_mutex_unlock(&block_lock);
+		if (b == NULL) {
+			return -1;
 		}
+		memcpy(b->data + off, (const char *) buf + done, n);
+		pthread_mutex_lock(&block_lock);
+		bcache_put(b, 1);
+		pthread_mutex_unlock(&block_lock);
+		blockn++;
 	}
-	
-	stbuf->st_mode = p.mode;
-	stbuf->st_nlink = p.linkcount;
-	stbuf->st_size = p.size;
-	stbuf->st_atime = p.atime;
-	stbuf->st_ctime = p.ctime;
-	stbuf->st_mtime = p.mtime;
+	return len;
+}
 
-	return res;	
+ssize_t write_block(blkno_t blockn, const void *buf, size_t len, off_t off)
+{
+	// metadata: inside an operation the change is journaled as well
+	return cache_write(blockn, buf, len, off, 1);
 }
 
-static int vfs_opendir(const char *path, struct fuse_file_info *fi)
+ssize_t write_data_block(blkno_t blockn, const void *buf, size_t len, off_t off)
 {
-	(void) fi;
-	if (strcmp(path, "/") == 0) {
-		return 0;
-	}
-	int parent_inode = find_parent_inode(path);
-	char* parent_name = split_to_name(path);
-	int isInparent = find_name_in_inode(block[parent_inode], parent_name);
+	// file contents are never journaled
+	return cache_write(blockn, buf, len, off, 0);
+}
 
-	if (isInparent == 0) {
-		return -ENOENT;
+static size_t blockmap_slot(struct blockmap *m, blkno_t blockn)
+{
+	// the slot holding blockn, or the empty one where it would go. cap is a power of 2
+	size_t i = ((uint64_t) blockn * 11400714819323198485ull >> 32) & (m->cap - 1);
+	while (m->ent[i].key != 0 && m->ent[i].key != blockn + 1) {
+		i = (i + 1) & (m->cap - 1);
 	}
+	return i;
+}
 
-	return 0;
+unsigned long blockmap_get(struct blockmap *m, blkno_t blockn)
+{
+	// the value for blockn, 0 if it has none
+	return m->cap == 0 ? 0 : m->ent[blockmap_slot(m, blockn)].val;
 }
 
-static int vfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-			 off_t offset, struct fuse_file_info *fi)
+int blockmap_set(struct blockmap *m, blkno_t blockn, unsigned long val)
 {
-	(void) offset;
-	(void) fi;
-	struct inode p;
-	int i, block_num;
-	if (strcmp(path, "/") == 0) {
-		p = block[26];	
-	}
-	else {
-		block_num = split_to_blockn(path, 0);
-		p = block[block_num];
+	// the table is kept at most half full, and doubles when it would pass that
+	struct blockmap bigger;
+	size_t i;
+	if (2 * (m->n + 1) > m->cap) {
+		bigger.cap = m->cap == 0 ? 256 : 2 * m->cap;
+		bigger.n = 0;
+		bigger.ent = calloc(bigger.cap, sizeof(struct blockent));
+		if (bigger.ent == NULL) {
+			return -ENOMEM;
+		}
+		for (i = 0; i < m->cap; i++) {
+			if (m->ent[i].key != 0) {
+				blockmap_set(&bigger, m->ent[i].key - 1, m->ent[i].val);
+			}
+		}
+		free(m->ent);
+		*m = bigger;
 	}
-
-	for (i = 0; i < p.subn; i++) {
-		filler(buf, p.filename_to_inode_dict[i].name, NULL, 0);
+	i = blockmap_slot(m, blockn);
+	if (m->ent[i].key == 0) {
+		m->ent[i].key = blockn + 1;
+		m->n++;
 	}
-	
+	m->ent[i].val = val;
 	return 0;
 }
 
-static int vfs_releasedir(const char *path, struct fuse_file_info *fi)
+void blockmap_clear(struct blockmap *m)
 {
-	(void) path;
-	(void) fi;
-	return 0;
+	free(m->ent);
+	m->ent = NULL;
+	m->cap = m->n = 0;
 }
 
-static int vfs_open(const char *path, struct fuse_file_info *fi)
+void log_init(void)
 {
-	(void) fi;
-	int parent_inode = find_parent_inode(path);
-	char* parent_name = split_to_name(path);
-	int isInparent = find_name_in_inode(block[parent_inode], parent_name);
+	// the free list blocks the bitmap leaves unused hold the header, then the ring
+	journal.start = Superblock.freeStart + (FREEMAP_WORDS * sizeof(uint64_t) + BLOCK_SIZE - 1) / BLOCK_SIZE + 1;
+	journal.nblocks = Superblock.freeEnd - journal.start + 1;
+}
 
-	if (isInparent == 0) {
-		return -ENOENT;
+static int log_write_head(void)
+{
+	// called with block_lock held, the header is written around the cache
+	struct disk_loghead h;
+	h.magic = htole32(LOG_MAGIC);
+	h.tail = htole32(journal.tail);
+	h.unsafe = htole32(journal.overflow || journal.damaged);
+	if (image_write(&h, sizeof(h), (off_t) (journal.start - 1) * BLOCK_SIZE) != sizeof(h)) {
+		return -EIO;
 	}
-
 	return 0;
 }
 
-static int vfs_release(const char *path, struct fuse_file_info *fi)
+static void log_overflow(void)
 {
-	(void) path;
-	(void) fi;
-	return 0;
+	// stop journaling the running transaction, its blocks may now go home at any time
+	journal.overflow = 1;
+	journal.len = 0;
+	bstat.overflows++;
+	if (log_write_head() == 0) {
+		image_sync();
+	}
 }
 
-static int vfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+static void log_append(blkno_t blockn, struct buf *b, int off, int len, const void *src)
 {
-	int i, r;
-	char filename[30];
-	int inoden = split_to_blockn(path, 0);
-	int datablockn = block[inoden].location;
+	// add a record for blockn to the running transaction, len 0 and no buffer revokes blockn.
+	// called with block_lock held
+	struct disk_logrec rec;
+	size_t reclen = sizeof(rec) + ((len + 3) & ~3);
+	char *p;
 
-	if (block[inoden].indirect == 0) {
-		sprintf(filename, "%s%d", fusedata, datablockn);
-		FILE *fp;
-		fp = fopen(filename, "r");
-		r = fread(buf, 1, 4096, fp);
-		fclose(fp);
+	if (journal.start == 0 || journal.overflow) {
+		return;
 	}
-	else {
-		char blocklist_info[1700];
-		for (i = 0; i < 1700; i++) {
-			blocklist_info[i] = '\0';
-		}
-		sprintf(filename, "%s%d", fusedata, datablockn);
-		FILE *fp;
-		fp = fopen(filename, "r");
-		r = fread(blocklist_info, 1, 1700, fp);
-		fclose(fp);
-
-		int i, k;
-		char buff[4096];
-		char blocklist[1700];
-		char block[5];
-		int blockn[MAX_FILE_BLOCK];
-		strcpy(blocklist, blocklist_info);
-		int j = 0, n = 0;
-		for (i = 0; i < strlen(blocklist); i++) {
-			if (blocklist[i] != ',') {
-				block[j++] = blocklist[i];
-			}
-			else {
-				blockn[n++] = atoi(block);
-				for (k = 0; k < 5; k++) {
-					block[k] = '\0';
-				}
-				j = 0;
-			}
-		}
-		for (i = 0; i < n; i++) {
-			sprintf(filename, "%s%d", fusedata, blockn[i]);
-			FILE *fp;
-			fp = fopen(filename, "r");
-			r = fread(buff, 1, 4096, fp);
-			strcat(buf, buff);
-			fclose(fp);
+	if (!journal.committing && (journal.len + reclen > LOG_MAX_TXN || journal.nbufs > nbuf / 2)) {
+		log_overflow();
+		return;
+	}
+	if (journal.len + reclen > journal.cap) {
+		p = realloc(journal.buf, journal.cap * 2 + reclen);
+		if (p == NULL) {
+			log_overflow();
+			return;
 		}
+		journal.buf = p;
+		journal.cap = journal.cap * 2 + reclen;
 	}
+	rec.blockn = htole32((uint32_t) blockn);
+	rec.blockn_hi = htole32((uint32_t) (blockn >> 32));
+	rec.off = htole16(off);
+	rec.len = htole16(len);
+	p = journal.buf + journal.len;
+	memcpy(p, &rec, sizeof(rec));
+	memcpy(p + sizeof(rec), src, len);
+	memset(p + sizeof(rec) + len, 0, reclen - sizeof(rec) - len);
+	journal.len += reclen;
 
-	(void) fi;
-	(void) r;
-	(void) offset;
-	return size;
+	if (b != NULL) {
+		if (b->lsn != journal.txn) {
+			b->lsn = journal.txn;
+			journal.nbufs++;
+		}
+		// a block new to the map has no records in the ring yet, so if it cannot be added
+		// the transaction stops logging and nothing will need revoking
+		if (blockmap_set(&journal.logged, blockn, journal.txn) != 0) {
+			log_overflow();
+		}
+	}
 }
 
-static int vfs_write(const char* path, const char* buf, size_t size, off_t offset, struct fuse_file_info* fi)
+void log_free(blkno_t start, blkno_t len)
 {
-	int i, r;
-	char filename[30];
-	int newblock[MAX_FILE_BLOCK];
-	int firstblock, lastfileblockn, blocktaken;
-	int inoden = split_to_blockn(path, 0);
+	// revoke blocks the ring may still hold records for, and keep them off the free list
+	// until the transaction that frees them commits
+	struct extent *p;
+	blkno_t i;
 
-	if (block[inoden].indirect == 0) {
-		lastfileblockn = block[inoden].location;
-		blocktaken = 1;
+	pthread_mutex_lock(&block_lock);
+	if (journal.handles == 0 && !journal.committing) {
+		pthread_mutex_unlock(&block_lock);
+		punch_blocks(start, len);
+		release_blocks(start, len);
+		write_freeblock();
+		return;
+	}
+	for (i = start; i < start + len; i++) {
+		if (journal.logged.n > 0 && blockmap_get(&journal.logged, i) >= journal.tailtxn) {
+			log_append(i, NULL, 0, 0, NULL);
+		}
+	}
+	if (journal.nfreed == journal.freedcap) {
+		p = realloc(journal.freed, (journal.freedcap * 2 + 16) * sizeof(struct extent));
+		if (p == NULL) {
+			// leak the blocks rather than reuse them early, --check gives them back
+			pthread_mutex_unlock(&block_lock);
+			return;
+		}
+		journal.freed = p;
+		journal.freedcap = journal.freedcap * 2 + 16;
+	}
+	journal.freed[journal.nfreed].lblk = 0;
+	journal.freed[journal.nfreed].start = start;
+	journal.freed[journal.nfreed].len = len;
+	journal.nfreed++;
+	journal.freedblocks += len;
+	pthread_mutex_unlock(&block_lock);
+}
+
+void log_begin(void)
+{
+	// join the running transaction, waiting out a commit in progress
+	pthread_mutex_lock(&block_lock);
+	while (journal.committing) {
+		pthread_cond_wait(&log_cond, &block_lock);
+	}
+	journal.handles++;
+	journal.ops++;
+	pthread_mutex_unlock(&block_lock);
+}
+
+void log_end(void)
+{
+	// leave the running transaction, and commit it early when it holds a good part of
+	// the ring or the cache, or when blocks it frees are needed
+	int commit;
+	pthread_mutex_lock(&block_lock);
+	journal.handles--;
+	if (journal.handles == 0) {
+		pthread_cond_broadcast(&log_cond);
+	}
+	commit = journal.handles == 0 && (journal.overflow || journal.nbufs > nbuf / 4 
+	         || journal.len > LOG_MAX_TXN / 2 
+	         || journal.freedblocks > Superblock.freeblocks 
+	         || journal.nifreed > Superblock.freeinodes);
+	pthread_mutex_unlock(&block_lock);
+	if (commit) {
+		log_commit();
+	}
+}
+
+static int checkpoint(void)
+{
+	// write every committed change home, then empty the ring. called with block_lock held
+	// and no operation running
+	int res = 0;
+	bcache_flush(0, -1, &bstat.syncflush);
+	if (image_sync() != 0) {
+		res = -errno;
+	}
+	journal.tail = journal.head;
+	journal.tailtxn = journal.txn;
+	blockmap_clear(&journal.logged);
+	if (journal.overflow) {
+		journal.overflow = 0;
+	}
+	if (log_write_head() != 0 || image_sync() != 0) {
+		res = -EIO;
+	}
+	bstat.checkpoints++;
+	return res;
+}
+
+static int log_write(void)
+{
+	// pack the running transaction into log blocks at the head, one write per contiguous stretch
+	// of the ring. called with block_lock held and no operation running
+	int i, n = (journal.len + LOG_PAYLOAD - 1) / LOG_PAYLOAD, slot, run;
+	char *blocks, *p;
+	struct disk_logblock *lb;
+	size_t used;
+	int res = 0;
+
+	blocks = calloc(n, BLOCK_SIZE);
+	if (blocks == NULL) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < n; i++) {
+		p = blocks + (size_t) i * BLOCK_SIZE;
+		lb = (struct disk_logblock *) p;
+		used = journal.len - (size_t) i * LOG_PAYLOAD;
+		if (used > LOG_PAYLOAD) {
+			used = LOG_PAYLOAD;
+		}
+		memcpy(p + sizeof(*lb), journal.buf + (size_t) i * LOG_PAYLOAD, used);
+		lb->magic = htole32(LOG_MAGIC);
+		lb->seq = htole32(journal.head + i);
+		lb->used = htole32(used);
+		lb->commit = htole32(i == n - 1);
+		lb->sum = htole32(hash_name(2166136261u ^ (journal.head + i), p + sizeof(*lb), used));
+	}
+	for (i = 0; res == 0 && i < n; i += run) {
+		slot = (journal.head + i) % journal.nblocks;
+		run = journal.nblocks - slot < n - i ? journal.nblocks - slot : n - i;
+		if (image_write(blocks + (size_t) i * BLOCK_SIZE, (size_t) run * BLOCK_SIZE, 
+		           (off_t) (journal.start + slot) * BLOCK_SIZE) != (ssize_t) run * BLOCK_SIZE) {
+			res = -EIO;
+		}
+	}
+	free(blocks);
+	if (res == 0) {
+		journal.head += n;
+		bstat.logblocks += n;
+	}
+	return res;
+}
+
+int log_commit(void)
+{
+	// make the running transaction durable: return what it freed to the free list, append its
+	// records to the ring, write back what may go home, and fdatasync once for all of it
+	struct extent *f;
+	blkno_t *fi;
+	int i, nfreed, nifreed, res = 0;
+
+	pthread_mutex_lock(&block_lock);
+	while (journal.committing) {
+		pthread_cond_wait(&log_cond, &block_lock);
+	}
+	journal.committing = 1;
+	while (journal.handles > 0) {
+		pthread_cond_wait(&log_cond, &block_lock);
+	}
+
+	for (i = 0; i < journal.nfreed; i++) {
+		release_blocks(journal.freed[i].start, journal.freed[i].len);
+	}
+	f = journal.freed;
+	nfreed = journal.nfreed;
+	journal.freed = NULL;
+	journal.nfreed = journal.freedcap = journal.freedblocks = 0;
+	fi = journal.ifreed;
+	nifreed = journal.nifreed;
+	journal.ifreed = NULL;
+	journal.nifreed = journal.ifreedcap = 0;
+	if (nfreed > 0 || nifreed > 0) {
+		pthread_mutex_unlock(&block_lock);
+		write_freeblock();
+		for (i = 0; i < nifreed; i++) {
+			imap_free(fi[i]);
+		}
+		pthread_mutex_lock(&block_lock);
+	}
+
+	// commits leave room for the largest transaction, this only happens if the
+	// free list records pushed it over
+	if (!journal.overflow && journal.head - journal.tail + (journal.len + LOG_PAYLOAD - 1) / LOG_PAYLOAD 
+	    > (uint32_t) journal.nblocks) {
+		log_overflow();
+	}
+	if (journal.overflow) {
+		journal.durable = journal.txn;
+		res = checkpoint();
+	}
+	else {
+		if (journal.len > 0) {
+			res = log_write();
+		}
+		bcache_flush(0, -1, &bstat.syncflush);
+		if (image_sync() != 0 && res == 0) {
+			res = -errno;
+		}
+		if (res == 0) {
+			journal.durable = journal.txn;
+		}
+		// checkpoint while nothing is running: every dirty buffer can go home now, where later
+		// a buffer changed by both the next transaction and an older one could not
+		if (res == 0 && journal.head - journal.tail + LOG_MAX_TXN / LOG_PAYLOAD + 2 > (uint32_t) journal.nblocks) {
+			res = checkpoint();
+		}
+	}
+	if (journal.len > 0 || journal.overflow || nfreed > 0 || nifreed > 0) {
+		bstat.commits++;
+		bstat.commitops += journal.ops;
+	}
+	journal.txn++;
+	journal.len = 0;
+	journal.nbufs = 0;
+	journal.ops = 0;
+	journal.overflow = 0;
+	pthread_mutex_unlock(&block_lock);
+
+	// the freed blocks are free on disk now, their old contents can go back to the host
+	for (i = 0; i < nfreed; i++) {
+		punch_blocks(f[i].start, f[i].len);
+	}
+	free(f);
+	free(fi);
+
+	pthread_mutex_lock(&block_lock);
+	journal.committing = 0;
+	pthread_cond_broadcast(&log_cond);
+	pthread_mutex_unlock(&block_lock);
+	return res;
+}
+
+int log_checkpoint(void)
+{
+	int res;
+	pthread_mutex_lock(&block_lock);
+	journal.committing = 1;
+	res = checkpoint();
+	journal.committing = 0;
+	pthread_mutex_unlock(&block_lock);
+	return res;
+}
+
+int log_replay(void)
+{
+	// apply every committed transaction in the ring, then empty it. blocks are written through
+	// the cache with no operation running, so nothing is logged again.
+	// return the number of transactions replayed, -1 if the journal is marked unsafe, or -EIO
+	// if its header cannot be read, and then nothing is touched
+	struct disk_loghead h;
+	struct disk_logblock lb;
+	struct disk_logrec rec;
+	struct blockmap revoked = { NULL, 0, 0 };
+	char *stream = NULL, *p;
+	size_t len = 0, committed = 0, pos;
+	size_t recsize = Superblock.version < 4 ? LOGREC_V3_SIZE : sizeof(rec);
+	uint32_t seq;
+	int ntx = 0;
+	blkno_t blockn;
+
+	log_init();
+	if (read_block(journal.start - 1, &h, sizeof(h), 0) != sizeof(h)) {
+		return -EIO;
+	}
+	if (le32toh(h.magic) != LOG_MAGIC) {
+		// an image from before the journal, its ring blocks have never been used
+		journal.head = journal.tail = 0;
+		return log_checkpoint() == 0 ? 0 : -1;
+	}
+	journal.damaged = le32toh(h.unsafe) != 0;
+	for (seq = le32toh(h.tail); ; seq++) {
+		blockn = journal.start + seq % journal.nblocks;
+		p = realloc(stream, len + LOG_PAYLOAD);
+		if (p == NULL) {
+			break;
+		}
+		stream = p;
+		if (image_read(&lb, sizeof(lb), (off_t) blockn * BLOCK_SIZE) != sizeof(lb)
+		    || le32toh(lb.magic) != LOG_MAGIC || le32toh(lb.seq) != seq || le32toh(lb.used) > LOG_PAYLOAD
+		    || image_read(stream + len, le32toh(lb.used), (off_t) blockn * BLOCK_SIZE + sizeof(lb)) 
+		       != le32toh(lb.used)
+		    || le32toh(lb.sum) != hash_name(2166136261u ^ seq, stream + len, le32toh(lb.used))) {
+			break;
+		}
+		len += le32toh(lb.used);
+		if (le32toh(lb.commit)) {
+			committed = len;
+			journal.head = seq + 1;
+			ntx++;
+		}
+	}
+	if (ntx == 0) {
+		journal.head = le32toh(h.tail);
+	}
+	// skip a whole turn of the ring, so no block left over from a torn write can ever
+	// carry a sequence number that is expected again
+	journal.head += journal.nblocks;
+
+	// a record is skipped if its block is revoked later in the stream.
+	// if the revocations cannot all be kept, nothing is replayed and the journal counts as unsafe
+	memset(&rec, 0, sizeof(rec));
+	for (pos = 0; pos + recsize <= committed; ) {
+		memcpy(&rec, stream + pos, recsize);
+		blockn = le32toh(rec.blockn) | (blkno_t) le32toh(rec.blockn_hi) << 32;
+		if (blockn >= Superblock.maxBlocks || le16toh(rec.off) + le16toh(rec.len) > BLOCK_SIZE) {
+			committed = pos;
+			break;
+		}
+		if (le16toh(rec.len) == 0 && blockmap_set(&revoked, blockn, pos + 1) != 0) {
+			committed = 0;
+			journal.damaged = 1;
+			break;
+		}
+		pos += recsize + ((le16toh(rec.len) + 3) & ~3);
+	}
+	for (pos = 0; pos + recsize <= committed; ) {
+		memcpy(&rec, stream + pos, recsize);
+		blockn = le32toh(rec.blockn) | (blkno_t) le32toh(rec.blockn_hi) << 32;
+		if (le16toh(rec.len) > 0 && blockmap_get(&revoked, blockn) < pos + 1) {
+			write_block(blockn, stream + pos + recsize, le16toh(rec.len), le16toh(rec.off));
+		}
+		pos += recsize + ((le16toh(rec.len) + 3) & ~3);
+	}
+	blockmap_clear(&revoked);
+	free(stream);
+
+	if (log_checkpoint() != 0) {
+		return -1;
+	}
+	return journal.damaged ? -1 : ntx;
+}
+
+int alloc_tables(void)
+{
+	// size the free space and inode bitmaps and the inode table's page directory from the superblock
+	free(freemap);
+	free(freesum);
+	free(freedirty);
+	free(freedirtysum);
+	free(imap);
+	free(itable);
+	freemap = calloc(FREEMAP_WORDS, sizeof(uint64_t));
+	freesum = calloc(FREESUM_WORDS, sizeof(uint64_t));
+	freedirty = calloc(FREESUM_WORDS, sizeof(uint64_t));
+	freedirtysum = calloc(ALLOC_GROUPS * GROUP_DIRTYSUM_WORDS, sizeof(uint64_t));
+	imap = BLOCK_INODES ? NULL : calloc(IMAP_WORDS, sizeof(uint64_t));
+	itable = calloc((INODE_LIMIT + ITABLE_PAGE - 1) / ITABLE_PAGE, sizeof(struct ipage *));
+	ihint = 0;
+	if (freemap == NULL || freesum == NULL || freedirty == NULL || freedirtysum == NULL || itable == NULL 
+	    || (imap == NULL && !BLOCK_INODES)) {
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+void initial_freeblock(void) 
+{
+	// everything below dataStart holds the superblock, the free list, the journal and the inode table
+	blkno_t i;
+	mark_run(Superblock.dataStart, Superblock.maxBlocks - Superblock.dataStart, 1);
+	for (i = 0; i < FREEMAP_WORDS; i++) {
+		dirty_word(i);
+	}
+
+	write_freeblock();
+}
+
+blkno_t split_to_blockn(const char *path, int parent) 
+{	
+	// parent == 1: find parent path inode
+	// parent == 0: find path inode
+	// returns -ENOENT if a component does not exist
+	int len = parent ? strrchr(path, '/') - path : strlen(path);
+	return lookup_path(path, len);
+}
+
+blkno_t find_parent_inode(const char *path)
+{
+	blkno_t inoden = split_to_blockn(path, 1);
+	if (inoden > 0 && !S_ISDIR(get_inode(inoden)->mode)) {
+		return -ENOTDIR;
+	}
+	return inoden;
+}
+
+char* split_to_name(const char *path) 
+{	
+	// the file name is the last component, it points into path
+	return strrchr(path, '/') + 1;
+}
+
+static uint32_t hash_name(uint32_t h, const char *name, int len)
+{
+	// FNV-1a
+	int i;
+	for (i = 0; i < len; i++) {
+		h = (h ^ (unsigned char) name[i]) * 16777619;
+	}
+	return h;
+}
+
+blkno_t dcache_get(blkno_t dir, const char *name, int len)
+{
+	// what the dcache knows of name in directory dir: its inode, -ENOENT if it does not exist,
+	// or 0 if nothing
+	unsigned i = hash_name(2166136261u ^ dir, name, len) % DCACHE_SIZE;
+	struct dentry *d = &dcache[i];
+	blkno_t inoden = 0;
+
+	if (len > MAX_NAME_LEN) {
+		return -ENOENT;
+	}
+	pthread_mutex_lock(&dcache_lock[i % CACHE_LOCKS]);
+	if (d->parent == dir && strncmp(d->name, name, len) == 0 && d->name[len] == '\0') {
+		inoden = d->inode != 0 ? d->inode : -ENOENT;
+	}
+	pthread_mutex_unlock(&dcache_lock[i % CACHE_LOCKS]);
+	thread_stats()->dlookups++;
+	thread_stats()->dhits += inoden != 0;
+	return inoden;
+}
+
+blkno_t lookup_name(blkno_t dir, const char *name, int len)
+{
+	// find name in directory dir, the dcache answers repeated and failed lookups.
+	// a miss reads the directory and fills the dcache under the directory's read lock,
+	// so the entry cannot undo a change made meanwhile
+	struct inode *ino;
+	blkno_t inoden = dcache_get(dir, name, len);
+
+	if (inoden != 0) {
+		return inoden;
+	}
+	if ((ino = lock_inode(dir, 0)) == NULL) {
+		return -ENOENT;
+	}
+	if (!S_ISDIR(ino->mode)) {
+		inoden = -ENOENT;
+	}
+	else {
+		inoden = dir_lookup(dir, name, len);
+		if (inoden != -EIO) {
+			dcache_set(dir, name, len, inoden > 0 ? inoden : 0);
+		}
+	}
+	unlock_inode(dir);
+	return inoden;
+}
+
+blkno_t lookup_path(const char *path, int len)
+{
+	// resolve the first len characters of path a name at a time, the dcache answers most of them
+	const char *name = path, *end = path + len, *next;
+	blkno_t inoden = Superblock.root;
+
+	while (name < end) {
+		if (*name == '/') {
+			name++;
+			continue;
+		}
+		for (next = name; next < end && *next != '/'; next++);
+		inoden = lookup_name(inoden, name, next - name);
+		if (inoden < 0) {
+			break;
+		}
+		name = next;
+	}
+	if (inoden > 0) {
+		get_inode(inoden);
+	}
+	return inoden;
+}
+
+void dcache_set(blkno_t dir, const char *name, int len, blkno_t inode)
+{
+	// called with dir locked
+	unsigned i = hash_name(2166136261u ^ dir, name, len) % DCACHE_SIZE;
+	struct dentry *d = &dcache[i];
+	if (len > MAX_NAME_LEN) {
+		return;
+	}
+	pthread_mutex_lock(&dcache_lock[i % CACHE_LOCKS]);
+	d->parent = dir;
+	d->inode = inode;
+	memcpy(d->name, name, len);
+	d->name[len] = '\0';
+	pthread_mutex_unlock(&dcache_lock[i % CACHE_LOCKS]);
+}
+
+void dcache_update(blkno_t parent, const char *name, blkno_t inode)
+{
+	// name in directory parent now names inode, inode 0 once it has been removed.
+	// called with parent locked
+	dcache_set(parent, name, strlen(name), inode);
+}
+
+static int dir_bucket(int nbuckets, uint32_t h)
+{
+	// linear hashing: buckets below the split point have been split and use one more bit
+	int b, level = 1;
+	while (level * 2 <= nbuckets) {
+		level *= 2;
+	}
+	b = h & (2 * level - 1);
+	return b < nbuckets ? b : (int) (h & (level - 1));
+}
+
+static int dir_find(char *blk, const char *name, int len)
+{
+	// offset of the entry for name in a bucket, or -1
+	struct disk_dirblock *hdr = (struct disk_dirblock *) blk;
+	struct disk_dirent *de;
+	int off = sizeof(*hdr), used = le32toh(hdr->used);
+
+	while (off < used) {
+		de = (struct disk_dirent *) (blk + off);
+		if (de->namelen == len && memcmp(de->name, name, len) == 0) {
+			return off;
+		}
+		off += DIRENT_LEN(de->namelen);
+	}
+	return -1;
+}
+
+static int dir_count(const char *blk)
+{
+	return le32toh(((const struct disk_dirblock *) blk)->count) & ~DIR_CHAINED;
+}
+
+static blkno_t dir_next(const char *blk)
+{
+	// the overflow block after this one, 0 at the end of the bucket
+	uint64_t next;
+	if (!(le32toh(((const struct disk_dirblock *) blk)->count) & DIR_CHAINED)) {
+		return 0;
+	}
+	memcpy(&next, blk + BLOCK_SIZE - DIR_NEXT, DIR_NEXT);
+	return (blkno_t) le64toh(next);
+}
+
+static int dir_room(const char *blk)
+{
+	// where the entries of a block have to end
+	return le32toh(((const struct disk_dirblock *) blk)->count) & DIR_CHAINED ? BLOCK_SIZE - DIR_NEXT : BLOCK_SIZE;
+}
+
+static int dir_read(struct inode *dir, blkno_t pb, int i, void *blk)
+{
+	// read block i of a bucket, 0 being the bucket itself. every overflow block holds a name,
+	// so a chain longer than the directory has names is damage, and is not followed round
+	if (i > 0 && (pb < Superblock.dataStart || pb >= Superblock.maxBlocks || i > dir->subn)) {
+		return -EIO;
+	}
+	return read_block(pb, blk, BLOCK_SIZE, 0) == BLOCK_SIZE ? 0 : -EIO;
+}
+
+static int dir_read_bucket(struct inode *dir, int b, char **bufp, blkno_t **blocksp)
+{
+	// bucket b and its overflow blocks, read one after another into a buffer, and their
+	// numbers, both for the caller to free. returns how many blocks or -errno
+	char *buf = NULL, *p;
+	blkno_t *blocks = NULL, *q, pb = bmap(dir, b);
+	int i, res = 0;
+
+	for (i = 0; pb != 0 && res == 0; i++) {
+		p = realloc(buf, (size_t) (i + 1) * BLOCK_SIZE);
+		buf = p != NULL ? p : buf;
+		q = realloc(blocks, (i + 1) * sizeof(blkno_t));
+		blocks = q != NULL ? q : blocks;
+		if (p == NULL || q == NULL) {
+			res = -ENOMEM;
+			break;
+		}
+		blocks[i] = pb;
+		res = dir_read(dir, pb, i, buf + (size_t) i * BLOCK_SIZE);
+		pb = dir_next(buf + (size_t) i * BLOCK_SIZE);
+	}
+	if (res != 0) {
+		free(buf);
+		free(blocks);
+		return res;
+	}
+	*bufp = buf;
+	*blocksp = blocks;
+	return i;
+}
+
+static int dir_pack(struct disk_dirent **de, int nde, blkno_t head, blkno_t *pool, int *npool)
+{
+	// write the nde entries at de as a bucket from block head on, chaining to blocks taken
+	// off the end of pool. returns how many blocks that takes, with head 0 it only counts them
+	uint32_t blk[BLOCK_SIZE / 4];
+	struct disk_dirblock *hdr = (struct disk_dirblock *) blk;
+	blkno_t pb = head;
+	uint64_t next;
+	int i = 0, n = 1, count, used, rec;
+
+	for (;;) {
+		memset(blk, 0, BLOCK_SIZE);
+		count = 0;
+		used = sizeof(*hdr);
+		// the last entry may take the bytes a chained block keeps for the next one's number
+		while (i < nde && used + (rec = DIRENT_LEN(de[i]->namelen)) <= BLOCK_SIZE - (i + 1 < nde ? DIR_NEXT : 0)) {
+			memcpy((char *) blk + used, de[i], rec);
+			used += rec;
+			count++;
+			i++;
+		}
+		if (i == nde) {
+			break;
+		}
+		n++;
+		if (head == 0) {
+			continue;
+		}
+		if (*npool == 0) {
+			return -ENOSPC;
+		}
+		next = htole64((uint64_t) pool[--*npool]);
+		hdr->count = htole32(count | DIR_CHAINED);
+		hdr->used = htole32(used);
+		memcpy((char *) blk + BLOCK_SIZE - DIR_NEXT, &next, DIR_NEXT);
+		write_block(pb, blk, BLOCK_SIZE, 0);
+		pb = (blkno_t) le64toh(next);
+	}
+	if (head != 0) {
+		hdr->count = htole32(count);
+		hdr->used = htole32(used);
+		write_block(pb, blk, used, 0);
+	}
+	return n;
+}
+
+static int dir_split(blkno_t dirn)
+{
+	// add bucket n and move over the entries of bucket n - level that now hash to it. both are
+	// packed afresh, into the old bucket's overflow blocks and as many more as they need
+	struct inode *dir = get_inode(dirn);
+	struct disk_dirent **keep, **moved, *de;
+	blkno_t *blocks, *pool;
+	char *old;
+	int n = file_blocks(dir), level = 1, nblk, nkeep = 0, nmoved = 0, npool, need, extra, i, off, used, res;
+
+	while (level * 2 <= n) {
+		level *= 2;
+	}
+	nblk = dir_read_bucket(dir, n - level, &old, &blocks);
+	if (nblk < 0) {
+		return nblk;
+	}
+	keep = malloc(2 * (size_t) nblk * DIR_BLOCK_ENTRIES * sizeof(*keep));
+	if (keep == NULL) {
+		free(old);
+		free(blocks);
+		return -ENOMEM;
+	}
+	moved = keep + (size_t) nblk * DIR_BLOCK_ENTRIES;
+	for (i = 0; i < nblk; i++) {
+		used = le32toh(((struct disk_dirblock *) (old + (size_t) i * BLOCK_SIZE))->used);
+		for (off = sizeof(struct disk_dirblock); off < used; off += DIRENT_LEN(de->namelen)) {
+			de = (struct disk_dirent *) (old + (size_t) i * BLOCK_SIZE + off);
+			if ((hash_name(2166136261u, de->name, de->namelen) & (2 * level - 1)) == (uint32_t) n) {
+				moved[nmoved++] = de;
+			}
+			else {
+				keep[nkeep++] = de;
+			}
+		}
+	}
+
+	// take any overflow blocks beyond the old ones before anything changes
+	npool = nblk - 1;
+	need = dir_pack(keep, nkeep, 0, NULL, NULL) + dir_pack(moved, nmoved, 0, NULL, NULL) - 2;
+	extra = need > npool ? need - npool : 0;
+	pool = malloc((size_t) (npool + extra + 1) * sizeof(blkno_t));
+	res = pool == NULL ? -ENOMEM : 0;
+	if (res == 0) {
+		memcpy(pool, blocks + 1, npool * sizeof(blkno_t));
+		if (extra > 0 && alloc_blocks(extra, pool + npool) != 0) {
+			res = -ENOSPC;
+		}
+	}
+	if (res == 0) {
+		res = grow_blocks(dir, 1);
+		if (res != 0) {
+			free_blocks(extra, pool + npool);
+		}
+	}
+	if (res == 0) {
+		npool += extra;
+		dir_pack(keep, nkeep, blocks[0], pool, &npool);
+		dir_pack(moved, nmoved, bmap(dir, n), pool, &npool);
+		free_blocks(npool, pool);
+		dir->size = (n + 1) * BLOCK_SIZE;
+		write_inode(dir, dirn);
+	}
+	free(pool);
+	free(keep);
+	free(old);
+	free(blocks);
+	return res;
+}
+
+static int dir_alike(struct inode *dir, int b, uint32_t h, uint32_t bit, int *parts)
+{
+	// how many names of bucket b hash to h, and in *parts whether any of them differs from h
+	// in bit, the one the bucket's next split goes by. -EIO if the bucket cannot be read
+	uint32_t blk[BLOCK_SIZE / 4], eh;
+	struct disk_dirent *de;
+	blkno_t pb = bmap(dir, b);
+	int i, off, used, same = 0;
+
+	*parts = 0;
+	for (i = 0; pb != 0; i++) {
+		if (dir_read(dir, pb, i, blk) != 0) {
+			return -EIO;
+		}
+		used = le32toh(((struct disk_dirblock *) blk)->used);
+		for (off = sizeof(struct disk_dirblock); off < used; off += DIRENT_LEN(de->namelen)) {
+			de = (struct disk_dirent *) ((char *) blk + off);
+			eh = hash_name(2166136261u, de->name, de->namelen);
+			same += eh == h;
+			*parts |= (eh & bit) != (h & bit);
+		}
+		pb = dir_next((char *) blk);
+	}
+	return same;
+}
+
+static int dir_overflow(blkno_t head, uint32_t *blk)
+{
+	// move the full first block of a bucket to a new overflow block and chain the emptied one
+	// to it, so the bucket's next names go in its first block again. blk is left holding it
+	struct disk_dirblock *hdr = (struct disk_dirblock *) blk;
+	blkno_t ob = find_first_freeblock();
+	uint64_t next;
+
+	if (ob < 0) {
+		return -ENOSPC;
+	}
+	if (read_block(head, blk, BLOCK_SIZE, 0) != BLOCK_SIZE) {
+		free_blocks(1, &ob);
+		return -EIO;
+	}
+	write_block(ob, blk, BLOCK_SIZE, 0);
+	hdr->count = htole32(DIR_CHAINED);
+	hdr->used = htole32(sizeof(*hdr));
+	next = htole64((uint64_t) ob);
+	memcpy((char *) blk + BLOCK_SIZE - DIR_NEXT, &next, DIR_NEXT);
+	write_block(head, hdr, sizeof(*hdr), 0);
+	write_block(head, &next, DIR_NEXT, BLOCK_SIZE - DIR_NEXT);
+	return 0;
+}
+
+void dir_init_block(blkno_t blockn)
+{
+	struct disk_dirblock hdr;
+	hdr.count = 0;
+	hdr.used = htole32(sizeof(hdr));
+	write_block(blockn, &hdr, sizeof(hdr), 0);
+}
+
+blkno_t dir_lookup(blkno_t dirn, const char *name, int len)
+{
+	// one block read, whatever the size of the directory, unless the name's bucket overflowed
+	struct inode *dir = get_inode(dirn);
+	uint32_t blk[BLOCK_SIZE / 4];
+	blkno_t pb = bmap(dir, dir_bucket(file_blocks(dir), hash_name(2166136261u, name, len)));
+	int i, off;
+
+	for (i = 0; pb != 0; i++) {
+		if (dir_read(dir, pb, i, blk) != 0) {
+			return -EIO;
+		}
+		off = dir_find((char *) blk, name, len);
+		if (off >= 0) {
+			return le32toh(((struct disk_dirent *) ((char *) blk + off))->inode);
+		}
+		pb = dir_next((char *) blk);
+	}
+	return -ENOENT;
+}
+
+int dir_add(blkno_t dirn, const char *name, int len, blkno_t inode, char type)
+{
+	// insert into the name's bucket. a full bucket is split, a few times at most and only while
+	// its own next split would part its names, and otherwise chains on to an overflow block
+	struct inode *dir = get_inode(dirn);
+	uint32_t blk[BLOCK_SIZE / 4];
+	struct disk_dirblock *hdr = (struct disk_dirblock *) blk;
+	struct disk_dirent *de;
+	uint32_t h = hash_name(2166136261u, name, len);
+	blkno_t pb, room, last = 0;
+	int b, i, n, level, parts, used, res, total, splits = 0, rec = DIRENT_LEN(len);
+
+	if (len > Superblock.maxName) {
+		return -ENAMETOOLONG;
+	}
+	for (;;) {
+		n = file_blocks(dir);
+		b = dir_bucket(n, h);
+		room = 0;
+		total = 0;
+		for (i = 0, pb = bmap(dir, b); pb != 0; i++, pb = dir_next((char *) blk)) {
+			if (dir_read(dir, pb, i, blk) != 0) {
+				return -EIO;
+			}
+			if (dir_find((char *) blk, name, len) >= 0) {
+				return -EEXIST;
+			}
+			if (room == 0 && (int) le32toh(hdr->used) + rec <= dir_room((char *) blk)) {
+				room = pb;
+			}
+			total += dir_count((char *) blk);
+			last = pb;
+		}
+		if (room != 0 && total < DIR_MAX_DUPS) {
+			break;
+		}
+		for (level = 1; level * 2 <= n; level *= 2) {
+		}
+		res = dir_alike(dir, b, h, b >= n - level && b < level ? level : 2 * level, &parts);
+		if (res < 0) {
+			return res;
+		}
+		if (res >= DIR_MAX_DUPS) {
+			return -ENOSPC;
+		}
+		if (room != 0) {
+			break;
+		}
+		if (splits == DIR_MAX_SPLITS || !parts) {
+			room = last = bmap(dir, b);
+			res = dir_overflow(room, blk);
+			if (res != 0) {
+				return res;
+			}
+			break;
+		}
+		res = dir_split(dirn);
+		if (res != 0) {
+			return res;
+		}
+		splits++;
+	}
+	if (room != last && read_block(room, blk, BLOCK_SIZE, 0) != BLOCK_SIZE) {
+		return -EIO;
+	}
+
+	used = le32toh(hdr->used);
+	de = (struct disk_dirent *) ((char *) blk + used);
+	de->inode = htole32((uint32_t) inode);
+	de->namelen = len;
+	de->type = type;
+	memcpy(de->name, name, len);
+	hdr->count = htole32(le32toh(hdr->count) + 1);
+	hdr->used = htole32(used + rec);
+	write_block(room, de, rec, used);
+	write_block(room, hdr, sizeof(*hdr), 0);
+
+	dir->subn++;
+	dir->mtime = (int) time(NULL);
+	write_inode(dir, dirn);
+	return 0;
+}
+
+blkno_t dir_remove(blkno_t dirn, const char *name, int len)
+{
+	// drop name from its bucket and close the gap, returns the inode it named. an overflow
+	// block that empties is unchained and freed
+	struct inode *dir = get_inode(dirn);
+	uint32_t blk[BLOCK_SIZE / 4], prevcount = 0;
+	struct disk_dirblock *hdr = (struct disk_dirblock *) blk;
+	struct disk_dirent *de;
+	blkno_t pb = bmap(dir, dir_bucket(file_blocks(dir), hash_name(2166136261u, name, len)));
+	blkno_t inode, prev = 0, next;
+	uint64_t link;
+	int i, off, rec, used;
+
+	for (i = 0; ; i++) {
+		if (dir_read(dir, pb, i, blk) != 0) {
+			return -EIO;
+		}
+		off = dir_find((char *) blk, name, len);
+		if (off >= 0) {
+			break;
+		}
+		next = dir_next((char *) blk);
+		if (next == 0) {
+			return -ENOENT;
+		}
+		prev = pb;
+		prevcount = le32toh(hdr->count);
+		pb = next;
+	}
+	de = (struct disk_dirent *) ((char *) blk + off);
+	inode = le32toh(de->inode);
+	rec = DIRENT_LEN(de->namelen);
+	used = le32toh(hdr->used);
+	memmove(de, (char *) de + rec, used - off - rec);
+	hdr->count = htole32(le32toh(hdr->count) - 1);
+	hdr->used = htole32(used - rec);
+	next = dir_next((char *) blk);
+
+	if (dir_count((char *) blk) > 0 || (prev == 0 && next == 0)) {
+		write_block(pb, blk, used - rec, 0);
+	}
+	else if (prev == 0) {
+		// the bucket's first block emptied, the overflow block after it moves in
+		if (dir_read(dir, next, 1, blk) != 0) {
+			return -EIO;
+		}
+		write_block(pb, blk, BLOCK_SIZE, 0);
+		free_blocks(1, &next);
+	}
+	else {
+		if (next == 0) {
+			prevcount = htole32(prevcount & ~DIR_CHAINED);
+			write_block(prev, &prevcount, sizeof(prevcount), offsetof(struct disk_dirblock, count));
+		}
+		else {
+			link = htole64((uint64_t) next);
+			write_block(prev, &link, DIR_NEXT, BLOCK_SIZE - DIR_NEXT);
+		}
+		free_blocks(1, &pb);
+	}
+
+	dir->subn--;
+	dir->mtime = (int) time(NULL);
+	write_inode(dir, dirn);
+	return inode;
+}
+
+blkno_t find_first_freeblock(void)
+{
+	blkno_t first_freeblock;
+	if (alloc_blocks(1, &first_freeblock) == -1) {
+		return -1;
+	}
+	return first_freeblock;
+}
+
+static void write_imap(blkno_t w)
+{
+	// persist imap word w, called with imap_lock held
+	uint64_t word = htole64(imap[w]);
+	write_block(Superblock.imapStart + w * sizeof(uint64_t) / BLOCK_SIZE, &word, sizeof(word), 
+	            w * sizeof(uint64_t) % BLOCK_SIZE);
+}
+
+blkno_t alloc_inode(void)
+{
+	// take the lowest free inode number, -1 if there is none.
+	// where inodes have blocks of their own, that is a free block
+	blkno_t w, n = -1;
+	if (BLOCK_INODES) {
+		if (alloc_blocks(1, &n) == -1) {
+			return -1;
+		}
+		__atomic_sub_fetch(&Superblock.freeinodes, 1, __ATOMIC_RELAXED);
+		return n;
+	}
+	pthread_mutex_lock(&imap_lock);
+	for (w = ihint; w < IMAP_WORDS && imap[w] == 0; w++) {
+	}
+	ihint = w;
+	if (w < IMAP_WORDS) {
+		n = w * 64 + __builtin_ctzll(imap[w]);
+		imap[w] &= imap[w] - 1;
+		write_imap(w);
+		__atomic_sub_fetch(&Superblock.freeinodes, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&imap_lock);
+	return n;
+}
+
+void release_inode(blkno_t n)
+{
+	// give an inode number back when the running transaction commits, like a block
+	blkno_t *p;
+	if (BLOCK_INODES) {
+		free_blocks(1, &n);
+		__atomic_add_fetch(&Superblock.freeinodes, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	pthread_mutex_lock(&block_lock);
+	if (journal.handles == 0 && !journal.committing) {
+		pthread_mutex_unlock(&block_lock);
+		imap_free(n);
+		return;
+	}
+	if (journal.nifreed == journal.ifreedcap) {
+		p = realloc(journal.ifreed, (journal.ifreedcap * 2 + 16) * sizeof(blkno_t));
+		if (p == NULL) {
+			// leak the inode rather than reuse it early, --check gives it back
+			pthread_mutex_unlock(&block_lock);
+			return;
+		}
+		journal.ifreed = p;
+		journal.ifreedcap = journal.ifreedcap * 2 + 16;
+	}
+	journal.ifreed[journal.nifreed++] = n;
+	pthread_mutex_unlock(&block_lock);
+}
+
+void imap_free(blkno_t n)
+{
+	// mark inode n free in the bitmap and on the image
+	pthread_mutex_lock(&imap_lock);
+	imap[n / 64] |= (uint64_t) 1 << (n % 64);
+	write_imap(n / 64);
+	if (n / 64 < ihint) {
+		ihint = n / 64;
+	}
+	__atomic_add_fetch(&Superblock.freeinodes, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&imap_lock);
+}
+
+static int alloc_home(void)
+{
+	// the group a thread allocates from first, threads are spread over them as they turn up
+	if (home == -1) {
+		home = __atomic_fetch_add(&next_home, 1, __ATOMIC_RELAXED) % ALLOC_GROUPS;
+	}
+	return home;
+}
+
+static void group_words(int g, blkno_t *lo, blkno_t *hi)
+{
+	// the freemap words [lo, hi) of group g
+	*lo = g * GROUP_WORDS;
+	*hi = *lo + GROUP_WORDS < FREEMAP_WORDS ? *lo + GROUP_WORDS : FREEMAP_WORDS;
+}
+
+static uint64_t group_sum(uint64_t *words, blkno_t i, blkno_t lo, blkno_t hi)
+{
+	// the bits of freesum or freedirty word i that belong to freemap words [lo, hi)
+	uint64_t sum = __atomic_load_n(&words[i], __ATOMIC_SEQ_CST);
+	if (lo >= hi) {
+		return 0;
+	}
+	if (lo > i * 64) {
+		sum &= ~(uint64_t) 0 << (lo - i * 64);
+	}
+	if (hi < i * 64 + 64) {
+		sum &= ((uint64_t) 1 << (hi - i * 64)) - 1;
+	}
+	return sum;
+}
+
+int alloc_blocks(int n, blkno_t *blocks)
+{
+	// take n free blocks in one pass, lowest numbers first within a group,
+	// from the thread's home group onwards. where they may become inodes, all lie below MAX_INODE_BLOCK
+	// return -1 and take nothing if there are not enough
+
+	int k, g, got = 0, touched = 0;
+	blkno_t i, lo, hi, w;
+	uint64_t sum;
+	struct counters *c = thread_stats();
+	c->allocs++;
+	if (n > Superblock.freeblocks) {
+		c->allocfails++;
+		return -1;
+	}
+
+	for (k = 0; k < ALLOC_GROUPS && got < n; k++) {
+		g = (alloc_home() + k) % ALLOC_GROUPS;
+		group_words(g, &lo, &hi);
+		if (BLOCK_INODES && hi > MAX_INODE_BLOCK / 64) {
+			hi = MAX_INODE_BLOCK / 64;
+		}
+		pthread_mutex_lock(&group_lock[g]);
+		for (i = lo / 64; i < FREESUM_WORDS && i * 64 < hi && got < n; i++) {
+			sum = group_sum(freesum, i, lo, hi);
+			while (sum != 0 && got < n) {
+				w = i * 64 + __builtin_ctzll(sum);
+				sum &= sum - 1;
+				while (freemap[w] != 0 && got < n) {
+					blocks[got] = w * 64 + __builtin_ctzll(freemap[w]);
+					mark_run(blocks[got++], 1, 0);
+					touched |= 1 << g;
+				}
+			}
+		}
+		pthread_mutex_unlock(&group_lock[g]);
+	}
+
+	if (got < n) {
+		__atomic_sub_fetch(&Superblock.freeblocks, got, __ATOMIC_RELAXED);
+		free_blocks(got, blocks);
+		c->allocfails++;
+		return -1;
+	}
+	__atomic_sub_fetch(&Superblock.freeblocks, n, __ATOMIC_RELAXED);
+	c->allocblocks += n;
+	for (g = 0; g < ALLOC_GROUPS; g++) {
+		if (touched & 1 << g) {
+			write_free_group(g);
+		}
+	}
+	return 0;
+}
+
+void free_blocks(int n, blkno_t *blocks)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		log_free(blocks[i], 1);
+	}
+}
+
+static int free_run(blkno_t start, int want)
+{
+	// length of the free run beginning at start, capped at want and at the end of its group
+	int b, n, len = 0;
+	blkno_t w, lo, hi, end;
+	uint64_t used;
+	group_words(start / 64 / GROUP_WORDS, &lo, &hi);
+	end = hi * 64 < Superblock.maxBlocks ? hi * 64 : Superblock.maxBlocks;
+	while (len < want && start + len < end) {
+		w = (start + len) / 64;
+		b = (start + len) % 64;
+		used = ~(freemap[w] >> b);
+		n = used == 0 ? 64 : __builtin_ctzll(used);
+		len += n;
+		if (n < 64 - b) {
+			break;
+		}
+	}
+	if (start + len > end) {
+		len = end - start;
+	}
+	return len < want ? len : want;
+}
+
+static void dirty_word(blkno_t w)
+{
+	// note that freemap word w must be written to the free list. the freedirty bit is set before
+	// the summary bit, and write_free_group clears the summary bit before it reads the
+	// freedirty word, so a word dirtied meanwhile is either seen or summarised again
+	int g = w / GROUP_WORDS;
+	blkno_t i = w / 64 - g * GROUP_WORDS / 64;
+	__atomic_or_fetch(&freedirty[w / 64], (uint64_t) 1 << (w % 64), __ATOMIC_SEQ_CST);
+	__atomic_or_fetch(&freedirtysum[g * GROUP_DIRTYSUM_WORDS + i / 64], (uint64_t) 1 << (i % 64), 
+	                  __ATOMIC_SEQ_CST);
+}
+
+static void mark_run(blkno_t start, blkno_t len, int isfree)
+{
+	// called with the group locks for the run held
+	blkno_t w, n;
+	int b;
+	uint64_t mask, bit;
+	while (len > 0) {
+		w = start / 64;
+		b = start % 64;
+		n = len < 64 - b ? len : 64 - b;
+		mask = (n == 64 ? ~(uint64_t) 0 : (((uint64_t) 1 << n) - 1)) << b;
+		bit = (uint64_t) 1 << (w % 64);
+		if (isfree) {
+			freemap[w] |= mask;
+		}
+		else {
+			freemap[w] &= ~mask;
+		}
+		if (freemap[w] != 0) {
+			__atomic_or_fetch(&freesum[w / 64], bit, __ATOMIC_SEQ_CST);
+		}
+		else {
+			__atomic_and_fetch(&freesum[w / 64], ~bit, __ATOMIC_SEQ_CST);
+		}
+		dirty_word(w);
+		start += n;
+		len -= n;
+	}
+}
+
+static int group_run(int g, blkno_t goal, int want, blkno_t *start)
+{
+	// the run alloc_extent would take from group g: at goal when that block is free,
+	// otherwise the first run that is long enough, or failing that the longest one.
+	// called with the group locked
+	blkno_t i, lo, hi, w, s;
+	int run, bestlen = 0;
+	uint64_t sum, bits;
+
+	group_words(g, &lo, &hi);
+	if (goal > 0 && goal < Superblock.maxBlocks && goal / 64 >= lo && goal / 64 < hi 
+	    && (freemap[goal / 64] >> (goal % 64) & 1)) {
+		*start = goal;
+		bestlen = free_run(goal, want);
+	}
+	for (i = lo / 64; i < FREESUM_WORDS && i * 64 < hi && bestlen < want; i++) {
+		sum = group_sum(freesum, i, lo, hi);
+		while (sum != 0 && bestlen < want) {
+			w = i * 64 + __builtin_ctzll(sum);
+			sum &= sum - 1;
+			bits = freemap[w];
+			while (bits != 0 && bestlen < want) {
+				s = w * 64 + __builtin_ctzll(bits);
+				run = free_run(s, want);
+				if (run > bestlen) {
+					*start = s;
+					bestlen = run;
+				}
+				// skip the rest of this run within the word
+				if (s % 64 + run >= 64) {
+					break;
+				}
+				bits &= ~((((uint64_t) 1 << run) - 1) << (s % 64));
+			}
+		}
+	}
+	return bestlen;
+}
+
+blkno_t alloc_extent(blkno_t goal, int want, int *len)
+{
+	// take a run of up to want contiguous blocks, starting at goal when that block is free,
+	// otherwise the first run that is long enough, or failing that the longest one.
+	// groups are searched one at a time, beginning with the goal's or the thread's home group
+	// return the first block of the run, or -1 if the device is full
+
+	int i, g, first, run, best, bestlen;
+	blkno_t start;
+	struct counters *c = thread_stats();
+	first = goal > 0 && goal < Superblock.maxBlocks ? goal / 64 / GROUP_WORDS : alloc_home();
+	for (;;) {
+		best = -1;
+		bestlen = run = 0;
+		for (i = 0; i < ALLOC_GROUPS && run < want; i++) {
+			g = (first + i) % ALLOC_GROUPS;
+			pthread_mutex_lock(&group_lock[g]);
+			run = group_run(g, goal, want, &start);
+			if (run == want) {
+				mark_run(start, run, 0);
+			}
+			pthread_mutex_unlock(&group_lock[g]);
+			if (run > bestlen) {
+				best = g;
+				bestlen = run;
+			}
+		}
+		if (best == -1 || run == want) {
+			break;
+		}
+		// no group has a long enough run: go back for the longest, unless it went meanwhile
+		pthread_mutex_lock(&group_lock[best]);
+		run = group_run(best, goal, want, &start);
+		if (run > 0) {
+			mark_run(start, run, 0);
+		}
+		pthread_mutex_unlock(&group_lock[best]);
+		if (run > 0) {
+			break;
+		}
+	}
+	c->allocs++;
+	if (best == -1) {
+		c->allocfails++;
+		return -1;
+	}
+
+	__atomic_sub_fetch(&Superblock.freeblocks, run, __ATOMIC_RELAXED);
+	c->allocblocks += run;
+	c->allocshort += run < want;
+	write_free_group(start / 64 / GROUP_WORDS);
+	*len = run;
+	return start;
+}
+
+void free_extent(blkno_t start, int len)
+{
+	log_free(start, len);
+}
+
+void release_blocks(blkno_t start, blkno_t len)
+{
+	// put a run back in the free bitmap a group at a time, the caller writes the free list
+	int g;
+	blkno_t lo, hi, n;
+	while (len > 0) {
+		g = start / 64 / GROUP_WORDS;
+		group_words(g, &lo, &hi);
+		n = hi * 64 - start < len ? hi * 64 - start : len;
+		pthread_mutex_lock(&group_lock[g]);
+		mark_run(start, n, 1);
+		pthread_mutex_unlock(&group_lock[g]);
+		__atomic_add_fetch(&Superblock.freeblocks, n, __ATOMIC_RELAXED);
+		thread_stats()->freedblocks += n;
+		start += n;
+		len -= n;
+	}
+}
+
+int punch_blocks(blkno_t start, blkno_t len)
+{
+	// make blocks [start, start + len) a hole in the image: it reads back as zeros and its
+	// space goes back to the host. free blocks are only tracked by the bitmap, so where the
+	// image's file system cannot punch holes they keep their old bytes and -1 is returned
+	if (nopunch || bcache_discard(start, len) != 0) {
+		return -1;
+	}
+	thread_stats()->op[curop].punches++;
+	if (fallocate(fusefd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) start * BLOCK_SIZE, 
+	              (off_t) len * BLOCK_SIZE) != 0) {
+		nopunch = errno == EOPNOTSUPP || errno == ENOSYS;
+		return -1;
+	}
+	return 0;
+}
+
+int add_extent(struct inode *ino, blkno_t start, int len)
+{
+	// append a run to the end of the file, merging it into the last extent when contiguous
+	// and the two fit in one
+	struct extent *last = ino->nextent > 0 ? &ino->ext[ino->nextent - 1] : NULL;
+	int lblk = last != NULL ? last->lblk + last->len : 0;
+
+	if (last != NULL && last->start + last->len == start && last->len + len <= EXTENT_MAX_LEN) {
+		last->len += len;
+		if (ino->extdirty > ino->nextent - 1) {
+			ino->extdirty = ino->nextent - 1;
+		}
+		return 0;
+	}
+	if (ino->nextent == ino->extcap) {
+		int cap = ino->extcap == 0 ? 4 : ino->extcap * 2;
+		struct extent *ext = realloc(ino->ext, cap * sizeof(struct extent));
+		if (ext == NULL) {
+			return -ENOMEM;
+		}
+		ino->ext = ext;
+		ino->extcap = cap;
+	}
+	ino->ext[ino->nextent].lblk = lblk;
+	ino->ext[ino->nextent].start = start;
+	ino->ext[ino->nextent].len = len;
+	if (ino->extdirty > ino->nextent) {
+		ino->extdirty = ino->nextent;
+	}
+	ino->nextent++;
+	return 0;
+}
+
+int extend_file(struct inode *ino, int n)
+{
+	// grow the file by n blocks, asking for runs that continue the last extent
+	blkno_t start, goal = last_file_block(ino) + 1;
+	int len;
+	while (n > 0) {
+		start = alloc_extent(goal, n < EXTENT_MAX_LEN ? n : EXTENT_MAX_LEN, &len);
+		if (start == -1) {
+			return -ENOSPC;
+		}
+		if (add_extent(ino, start, len) != 0) {
+			free_extent(start, len);
+			return -ENOMEM;
+		}
+		goal = start + len;
+		n -= len;
+	}
+	return 0;
+}
+
+int file_blocks(struct inode *ino)
+{
+	struct extent *last;
+	if (ino->nextent == 0) {
+		return 0;
+	}
+	last = &ino->ext[ino->nextent - 1];
+	return last->lblk + last->len;
+}
+
+blkno_t last_file_block(struct inode *ino)
+{
+	struct extent *last;
+	if (ino->nextent == 0) {
+		return -1;
+	}
+	last = &ino->ext[ino->nextent - 1];
+	return last->start + last->len - 1;
+}
+
+blkno_t bmap(struct inode *ino, int lblk)
+{
+	int run;
+	return bmap_run(ino, lblk, &run);
+}
+
+int find_extent(struct inode *ino, int lblk)
+{
+	// the index of the extent holding a logical block of the file, -1 for none
+	int lo = 0, hi = ino->nextent - 1, mid;
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (lblk < ino->ext[mid].lblk) {
+			hi = mid - 1;
+		}
+		else if (lblk >= ino->ext[mid].lblk + ino->ext[mid].len) {
+			lo = mid + 1;
+		}
+		else {
+			return mid;
+		}
+	}
+	return -1;
+}
+
+blkno_t bmap_run(struct inode *ino, int lblk, int *run)
+{
+	// map a logical block of the file to its physical block, -1 for none,
+	// run is set to the number of contiguous blocks from there to the end of the extent
+	int e = find_extent(ino, lblk);
+	if (e == -1) {
+		*run = 0;
+		return -1;
+	}
+	*run = ino->ext[e].lblk + ino->ext[e].len - lblk;
+	return ino->ext[e].start + lblk - ino->ext[e].lblk;
+}
+
+static int index_levels(int n, int *want)
+{
+	// want[l] is the number of nodes l levels above the extents, the root excluded,
+	// returns the depth of the root
+	int depth = 0, count = n > 0 ? (n + INDEX_EXTENTS - 1) / INDEX_EXTENTS : 1;
+	while (count > 1) {
+		if (depth == INDEX_DEPTH) {
+			return depth + 1;
+		}
+		want[depth++] = count;
+		count = (count + INDEX_EXTENTS - 1) / INDEX_EXTENTS;
+	}
+	return depth;
+}
+
+static int resize_level(struct inode *ino, int level, int want)
+{
+	// take or give back nodes at the end of a level
+	blkno_t *node, b;
+	if (want > ino->nnode[level]) {
+		node = realloc(ino->node[level], want * sizeof(blkno_t));
+		if (node == NULL) {
+			return -ENOMEM;
+		}
+		ino->node[level] = node;
+	}
+	while (ino->nnode[level] < want) {
+		b = find_first_freeblock();
+		if (b == -1) {
+			return -ENOSPC;
+		}
+		ino->node[level][ino->nnode[level]++] = b;
+	}
+	while (ino->nnode[level] > want) {
+		restore_freeblock(ino->node[level][--ino->nnode[level]]);
+	}
+	return 0;
+}
+
+static void put_extent(struct disk_extent *d, int lblk, blkno_t start, int len)
+{
+	d->lblk = htole32(lblk);
+	d->start = htole32((uint32_t) start);
+	d->start_hi = htole16((uint16_t) (start >> 32));
+	d->len = htole16(len);
+}
+
+static blkno_t extent_start(struct disk_extent *d)
+{
+	return le32toh(d->start) | (blkno_t) le16toh(d->start_hi) << 32;
+}
+
+static void write_node(blkno_t blockn, int depth, int count, struct disk_extent *ext)
+{
+	struct disk_index idx;
+	idx.count = htole32(count);
+	idx.depth = htole32(depth);
+	memcpy(idx.ext, ext, count * sizeof(struct disk_extent));
+	write_block(blockn, &idx, offsetof(struct disk_index, ext) + count * sizeof(struct disk_extent), 0);
+}
+
+int write_index(struct inode *ino)
+{
+	// rewrite the nodes over extents extdirty onwards and their ancestors,
+	// a change in depth rewrites the whole tree
+	struct disk_extent ext[INDEX_EXTENTS];
+	int want[INDEX_DEPTH], depth = index_levels(ino->nextent, want);
+	int l, i, j, n, first, count, res;
+	long long span;
+
+	if (depth > INDEX_DEPTH) {
+		return -EFBIG;
+	}
+	if (depth != ino->depth) {
+		for (l = 0; l < ino->depth; l++) {
+			resize_level(ino, l, 0);
+		}
+		ino->depth = depth;
+		ino->extdirty = 0;
+	}
+	for (l = 0; l < depth; l++) {
+		res = resize_level(ino, l, want[l]);
+		if (res != 0) {
+			return res;
+		}
+	}
+
+	// the extents
+	first = ino->extdirty / INDEX_EXTENTS;
+	n = depth > 0 ? want[0] : 1;
+	for (i = first; i < n; i++) {
+		count = ino->nextent - i * INDEX_EXTENTS;
+		count = count < INDEX_EXTENTS ? count : INDEX_EXTENTS;
+		for (j = 0; j < count; j++) {
+			put_extent(&ext[j], ino->ext[i * INDEX_EXTENTS + j].lblk, ino->ext[i * INDEX_EXTENTS + j].start, 
+			           ino->ext[i * INDEX_EXTENTS + j].len);
+		}
+		write_node(depth > 0 ? ino->node[0][i] : ino->location, 0, count, ext);
+	}
+
+	// each level above points at the nodes below it, span is the number of extents under one of those
+	span = INDEX_EXTENTS;
+	for (l = 1; l <= depth; l++, span *= INDEX_EXTENTS) {
+		first /= INDEX_EXTENTS;
+		n = l < depth ? want[l] : 1;
+		for (i = first; i < n; i++) {
+			count = want[l - 1] - i * INDEX_EXTENTS;
+			count = count < INDEX_EXTENTS ? count : INDEX_EXTENTS;
+			for (j = 0; j < count; j++) {
+				put_extent(&ext[j], ino->ext[(i * INDEX_EXTENTS + j) * span].lblk, 
+				           ino->node[l - 1][i * INDEX_EXTENTS + j], 0);
+			}
+			write_node(l < depth ? ino->node[l][i] : ino->location, l, count, ext);
+		}
+	}
+	ino->extdirty = ino->nextent;
+	return 0;
+}
+
+void free_index(struct inode *ino)
+{
+	// give back every index block, the root included
+	int l;
+	for (l = 0; l < INDEX_DEPTH; l++) {
+		resize_level(ino, l, 0);
+		free(ino->node[l]);
+		ino->node[l] = NULL;
+	}
+	if (ino->indirect == 1) {
+		restore_freeblock(ino->location);
+		ino->indirect = 0;
+	}
+	ino->depth = 0;
+}
+
+static int read_index(struct inode *ino, blkno_t blockn, int depth)
+{
+	// append the extents under node blockn, noting where the nodes below the root are
+	struct disk_index idx;
+	struct extent *ext;
+	blkno_t *node, child;
+	int i, n, res;
+
+	if (read_block(blockn, &idx, sizeof(idx), 0) != sizeof(idx)) {
+		return -EIO;
+	}
+	n = le32toh(idx.count);
+	if (le32toh(idx.depth) != depth || n < 1 || n > INDEX_EXTENTS) {
+		return -EIO;
+	}
+	for (i = 0; i < n; i++) {
+		if (depth > 0) {
+			child = extent_start(&idx.ext[i]);
+			node = realloc(ino->node[depth - 1], (ino->nnode[depth - 1] + 1) * sizeof(blkno_t));
+			if (node == NULL) {
+				return -ENOMEM;
+			}
+			ino->node[depth - 1] = node;
+			ino->node[depth - 1][ino->nnode[depth - 1]++] = child;
+			res = read_index(ino, child, depth - 1);
+			if (res != 0) {
+				return res;
+			}
+			continue;
+		}
+		// stored extents are only contiguous with each other when the first is full, so add them as they are
+		if (ino->nextent == ino->extcap) {
+			ext = realloc(ino->ext, (ino->extcap == 0 ? 4 : ino->extcap * 2) * sizeof(struct extent));
+			if (ext == NULL) {
+				return -ENOMEM;
+			}
+			ino->ext = ext;
+			ino->extcap = ino->extcap == 0 ? 4 : ino->extcap * 2;
+		}
+		ino->ext[ino->nextent].lblk = le32toh(idx.ext[i].lblk);
+		ino->ext[ino->nextent].start = extent_start(&idx.ext[i]);
+		ino->ext[ino->nextent].len = le16toh(idx.ext[i].len);
+		ino->nextent++;
+	}
+	return 0;
+}
+
+int grow_blocks(struct inode *ino, int n)
+{
+	// add n blocks at the end, a second block brings in the root index block
+	int res = 0, blocktaken = file_blocks(ino);
+	blkno_t root;
+
+	res = extend_file(ino, n);
+	if (res == 0 && ino->indirect == 0 && file_blocks(ino) == 1) {
+		ino->location = bmap(ino, 0);
+	}
+	else if (res == 0 && ino->indirect == 0) {
+		root = find_first_freeblock();
+		if (root == -1) {
+			res = -ENOSPC;
+		}
+		else {
+			ino->indirect = 1;
+			ino->location = root;
+			ino->depth = 0;
+			ino->extdirty = 0;
+		}
+	}
+	if (res == 0 && ino->indirect == 1) {
+		res = write_index(ino);
+	}
+	if (res != 0) {
+		shrink_blocks(ino, blocktaken);
+		return res;
+	}
+	return 0;
+}
+
+void shrink_blocks(struct inode *ino, int nblocks)
+{
+	// drop the blocks from nblocks on, a file left with one block needs no index
+	// and one left with none has no location
+	truncate_blocks(ino, nblocks);
+	if (file_blocks(ino) <= 1) {
+		free_index(ino);
+		ino->location = file_blocks(ino) == 1 ? bmap(ino, 0) : 0;
+	}
+	else if (ino->indirect == 1) {
+		write_index(ino);
+	}
+}
+
+void truncate_blocks(struct inode *ino, int nblocks)
+{
+	// free every block of the file from logical block nblocks onwards
+	struct extent *last;
+	while (ino->nextent > 0) {
+		last = &ino->ext[ino->nextent - 1];
+		if (last->lblk >= nblocks) {
+			free_extent(last->start, last->len);
+			ino->nextent--;
+		}
+		else {
+			if (last->lblk + last->len > nblocks) {
+				free_extent(last->start + nblocks - last->lblk, last->lblk + last->len - nblocks);
+				last->len = nblocks - last->lblk;
+			}
+			break;
+		}
+	}
+	if (ino->extdirty > ino->nextent - 1) {
+		ino->extdirty = ino->nextent > 0 ? ino->nextent - 1 : 0;
+	}
+}
+
+void write_superblock(void)
+{
+	struct disk_superblock sb;
+	memset(&sb, 0, sizeof(sb));
+	sb.magic = htole32(VFS_MAGIC);
+	sb.version = htole32(VFS_VERSION);
+	sb.creationTime = htole32(Superblock.creationTime);
+	sb.mounted = htole32(Superblock.mounted);
+	sb.devId = htole32(Superblock.devId);
+	sb.freeStart = htole32(Superblock.freeStart);
+	sb.freeEnd = htole32(Superblock.freeEnd);
+	sb.root = htole32(Superblock.root);
+	sb.maxBlocks = htole32((uint32_t) Superblock.maxBlocks);
+	sb.maxBlocks_hi = htole32((uint32_t) (Superblock.maxBlocks >> 32));
+	sb.freeblocks = htole32((uint32_t) Superblock.freeblocks);
+	sb.freeblocks_hi = htole32((uint32_t) (Superblock.freeblocks >> 32));
+	sb.maxInodes = htole32((uint32_t) Superblock.maxInodes);
+	sb.maxInodes_hi = htole32((uint32_t) (Superblock.maxInodes >> 32));
+	sb.freeinodes = htole32((uint32_t) Superblock.freeinodes);
+	sb.freeinodes_hi = htole32((uint32_t) (Superblock.freeinodes >> 32));
+	sb.blockSize = htole32(BLOCK_SIZE);
+	sb.maxName = htole32(Superblock.maxName);
+	sb.clean = htole32(Superblock.clean);
+	sb.imapStart = htole32(Superblock.imapStart);
+	sb.itableStart = htole32(Superblock.itableStart);
+	sb.dataStart = htole32(Superblock.dataStart);
+	sb.inodeSize = htole32(Superblock.inodeSize);
+	write_block(0, &sb, sizeof(sb), 0);
+}
+
+int load_superblock(void)
+{
+	// mounting reads only the superblock and the free lists, inodes are faulted in by get_inode
+	struct disk_superblock sb;
+	struct stat st;
+	blkno_t i, freeblocks = 0, freeinodes = 0;
+	int replayed;
+
+	if (read_block(0, &sb, sizeof(sb), 0) != sizeof(sb) || le32toh(sb.magic) != VFS_MAGIC) {
+		fprintf(stderr, "%s: no file system found, create one with --mkfs\n", fuseimage);
+		return -1;
+	}
+	// version 2 is version 3 without the journal, its journal blocks were never used.
+	// version 4 added the geometry and the high words of block numbers, which are zero in older
+	// images, and longer journal records. version 5 added inline files, older images have none.
+	// version 6 added the inode table, an older image keeps an inode in each inode block and
+	// is read as a table of block-sized records from block 0. version 7 added overflow blocks
+	// to directory buckets, older images have none.
+	// the rest is the same, so mounting upgrades them in place
+	Superblock.version = le32toh(sb.version);
+	if (Superblock.version < 2 || Superblock.version > VFS_VERSION) {
+		fprintf(stderr, "%s: unsupported format version %u\n", fuseimage, le32toh(sb.version));
+		return -1;
+	}
+	Superblock.creationTime = le32toh(sb.creationTime);
+	Superblock.mounted = le32toh(sb.mounted);
+	Superblock.devId = le32toh(sb.devId);
+	Superblock.freeStart = le32toh(sb.freeStart);
+	Superblock.freeEnd = le32toh(sb.freeEnd);
+	Superblock.root = le32toh(sb.root);
+	Superblock.maxBlocks = le32toh(sb.maxBlocks);
+	Superblock.freeblocks = le32toh(sb.freeblocks);
+	Superblock.freeinodes = le32toh(sb.freeinodes);
+	Superblock.clean = le32toh(sb.clean);
+	Superblock.maxInodes = DEFAULT_BLOCKS / BLOCKS_PER_INODE;
+	Superblock.maxName = MAX_NAME_LEN;
+	Superblock.imapStart = 0;
+	Superblock.itableStart = 0;
+	Superblock.dataStart = Superblock.root + 1;
+	Superblock.inodeSize = BLOCK_SIZE;
+	if (Superblock.version >= 4) {
+		if (le32toh(sb.blockSize) != BLOCK_SIZE) {
+			fprintf(stderr, "%s: made with %u byte blocks, this build uses %d\n", fuseimage, 
+			        le32toh(sb.blockSize), BLOCK_SIZE);
+			return -1;
+		}
+		Superblock.maxBlocks |= (blkno_t) le32toh(sb.maxBlocks_hi) << 32;
+		Superblock.freeblocks |= (blkno_t) le32toh(sb.freeblocks_hi) << 32;
+		Superblock.maxInodes = le32toh(sb.maxInodes) | (blkno_t) le32toh(sb.maxInodes_hi) << 32;
+		Superblock.freeinodes |= (blkno_t) le32toh(sb.freeinodes_hi) << 32;
+		Superblock.maxName = le32toh(sb.maxName);
+	}
+	if (Superblock.version >= 6) {
+		Superblock.imapStart = le32toh(sb.imapStart);
+		Superblock.itableStart = le32toh(sb.itableStart);
+		Superblock.dataStart = le32toh(sb.dataStart);
+		Superblock.inodeSize = le32toh(sb.inodeSize);
+		if (Superblock.inodeSize < (int) sizeof(struct disk_inode) || Superblock.inodeSize > BLOCK_SIZE 
+		    || BLOCK_SIZE % Superblock.inodeSize != 0 || Superblock.maxInodes > MAX_INODES) {
+			fprintf(stderr, "%s: bad inode table geometry\n", fuseimage);
+			return -1;
+		}
+	}
+	if (fstat(fusefd, &st) != 0 || st.st_size < (off_t) Superblock.maxBlocks * BLOCK_SIZE) {
+		fprintf(stderr, "%s: image is smaller than its file system\n", fuseimage);
+		return -1;
+	}
+	if (alloc_tables() != 0) {
+		perror(fuseimage);
+		return -1;
+	}
+
+	// bring the metadata up to date before anything reads it
+	replayed = log_replay();
+	if (replayed == -EIO) {
+		fprintf(stderr, "%s: cannot read the journal header\n", fuseimage);
+		return -1;
+	}
+	Superblock.version = VFS_VERSION;
+
+	if (read_block(Superblock.freeStart, freemap, FREEMAP_WORDS * sizeof(uint64_t), 0) 
+	    != FREEMAP_WORDS * sizeof(uint64_t)) {
+		fprintf(stderr, "%s: cannot read the free block map\n", fuseimage);
+		return -1;
+	}
+	for (i = 0; i < FREEMAP_WORDS; i++) {
+		freemap[i] = le64toh(freemap[i]);
+		if (freemap[i] != 0) {
+			freesum[i / 64] |= (uint64_t) 1 << (i % 64);
+		}
+		freeblocks += __builtin_popcountll(freemap[i]);
+	}
+	if (!BLOCK_INODES) {
+		if (read_block(Superblock.imapStart, imap, IMAP_WORDS * sizeof(uint64_t), 0) 
+		    != IMAP_WORDS * sizeof(uint64_t)) {
+			fprintf(stderr, "%s: cannot read the inode map\n", fuseimage);
+			return -1;
+		}
+		for (i = 0; i < IMAP_WORDS; i++) {
+			imap[i] = le64toh(imap[i]);
+			freeinodes += __builtin_popcountll(imap[i]);
+		}
+	}
+
+	// the counters are only written back at unmount, recount what we can after a crash.
+	// the journal makes the rest consistent, unless it was unsafe when the crash came
+	if (!Superblock.clean) {
+		if (replayed < 0) {
+			fprintf(stderr, "%s: file system was not cleanly unmounted, run vfs --check\n", fuseimage);
+		}
+		else {
+			fprintf(stderr, "%s: file system was not cleanly unmounted, replayed %d transactions\n", 
+			        fuseimage, replayed);
+		}
+		Superblock.freeblocks = freeblocks;
+		if (!BLOCK_INODES) {
+			Superblock.freeinodes = freeinodes;
+		}
+	}
+	return 0;
+}
+
+static struct ipage *inode_page(blkno_t inoden)
+{
+	// the table page holding inode number inoden, allocated on first use. NULL if memory is short
+	struct ipage *pg = __atomic_load_n(&itable[inoden / ITABLE_PAGE], __ATOMIC_ACQUIRE);
+	int i;
+	if (pg != NULL) {
+		return pg;
+	}
+	pthread_mutex_lock(&load_lock);
+	pg = itable[inoden / ITABLE_PAGE];
+	if (pg == NULL) {
+		pg = calloc(1, sizeof(*pg));
+		if (pg != NULL) {
+			for (i = 0; i < ITABLE_PAGE; i++) {
+				pthread_rwlock_init(&pg->lock[i], NULL);
+			}
+			ipages++;
+			__atomic_store_n(&itable[inoden / ITABLE_PAGE], pg, __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&load_lock);
+	return pg;
+}
+
+static struct inode *inode_alloc(void)
+{
+	// a zeroed inode from the first slab with room, a new slab if none has any.
+	// called with load_lock held
+	struct islab *sl = ifree;
+	struct inode *ino;
+	int i;
+	if (sl == NULL) {
+		sl = malloc(sizeof(struct islab));
+		if (sl == NULL) {
+			return NULL;
+		}
+		sl->free = NULL;
+		for (i = 0; i < INODE_SLAB; i++) {
+			sl->ino[i].nextfree = sl->free;
+			sl->free = &sl->ino[i];
+		}
+		sl->nfree = INODE_SLAB;
+		sl->prev = NULL;
+		sl->next = NULL;
+		ifree = sl;
+		islabs++;
+	}
+	ino = sl->free;
+	sl->free = ino->nextfree;
+	if (--sl->nfree == 0) {
+		ifree = sl->next;
+		if (ifree != NULL) {
+			ifree->prev = NULL;
+		}
+	}
+	memset(ino, 0, sizeof(*ino));
+	ino->slab = sl;
+	ilive++;
+	return ino;
+}
+
+static void inode_release(struct inode *ino)
+{
+	// put an inode back in its slab, called with load_lock held
+	struct islab *sl = ino->slab;
+	ino->nextfree = sl->free;
+	sl->free = ino;
+	ilive--;
+	if (sl->nfree++ == 0) {
+		sl->prev = NULL;
+		sl->next = ifree;
+		if (ifree != NULL) {
+			ifree->prev = sl;
+		}
+		ifree = sl;
+	}
+	if (sl->nfree == INODE_SLAB && (sl->prev != NULL || sl->next != NULL)) {
+		if (sl->prev != NULL) {
+			sl->prev->next = sl->next;
+		}
+		else {
+			ifree = sl->next;
+		}
+		if (sl->next != NULL) {
+			sl->next->prev = sl->prev;
+		}
+		free(sl);
+		islabs--;
+	}
+}
+
+int load_index(struct inode *ino)
+{
+	// read the extents of an indirect inode from the tree at its location
+	struct disk_index idx;
+	int i;
+	ino->nextent = 0;
+	for (i = 0; i < INDEX_DEPTH; i++) {
+		ino->nnode[i] = 0;
+	}
+	if (read_block(ino->location, &idx, offsetof(struct disk_index, ext), 0) != offsetof(struct disk_index, ext)) {
+		return -EIO;
+	}
+	ino->depth = le32toh(idx.depth);
+	if (ino->depth > INDEX_DEPTH) {
+		return -EIO;
+	}
+	return read_index(ino, ino->location, ino->depth);
+}
+
+int read_inode(blkno_t inoden, struct inode *ino)
+{
+	// fill ino from its record, and its extents from the index. -EIO if the record cannot be
+	// read, ino is then left as it was. 1 if the index is not a tree, what was read of it is
+	// left in place
+	struct disk_inode d;
+
+	if (read_block(INODE_BLOCK(inoden), &d, sizeof(d), INODE_POS(inoden)) != sizeof(d)) {
+		return -EIO;
+	}
+	ino->size = le32toh(d.size) | (off_t) le32toh(d.size_hi) << 32;
+	ino->uid = le32toh(d.uid);
+	ino->gid = le32toh(d.gid);
+	ino->mode = le32toh(d.mode);
+	ino->atime = le32toh(d.atime);
+	ino->ctime = le32toh(d.ctime);
+	ino->mtime = le32toh(d.mtime);
+	ino->linkcount = le32toh(d.linkcount);
+	ino->subn = le32toh(d.subn);
+	ino->indirect = le32toh(d.indirect);
+	ino->location = le32toh(d.location) | (blkno_t) le32toh(d.location_hi) << 32;
+	ino->parent = le32toh(d.parent);
+	ino->inlined = S_ISREG(ino->mode) && (le32toh(d.flags) & INODE_INLINE);
+	ino->nextent = 0;
+	if (ino->inlined) {
+		return 0;
+	}
+	if (ino->indirect == 0) {
+		return add_extent(ino, ino->location, 1) != 0;
+	}
+	return load_index(ino) != 0;
+}
+
+struct inode *get_inode(blkno_t inoden)
+{
+	// read an inode and its extents on first use, threads after the same one take turns.
+	// if memory runs out or the record cannot be read the inode reads as removed, until a
+	// later use reads it again
+	struct ipage *pg = inode_page(inoden);
+	struct inode *ino, **slot;
+	int res;
+
+	if (pg == NULL) {
+		return &dead_inode;
+	}
+	slot = &pg->ino[inoden % ITABLE_PAGE];
+	ino = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if (ino != NULL) {
+		return ino;
+	}
+	pthread_mutex_lock(&load_lock);
+	ino = *slot != NULL ? *slot : inode_alloc();
+	if (ino == NULL || *slot != NULL) {
+		pthread_mutex_unlock(&load_lock);
+		return ino != NULL ? ino : &dead_inode;
+	}
+	res = read_inode(inoden, ino);
+	if (res < 0) {
+		free(ino->ext);
+		inode_release(ino);
+		pthread_mutex_unlock(&load_lock);
+		return &dead_inode;
+	}
+	if (res != 0) {
+		fprintf(stderr, "inode %lld: bad index, run vfs --check\n", (long long) inoden);
+	}
+	ino->extdirty = ino->nextent;
+	__atomic_store_n(slot, ino, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&load_lock);
+	return ino;
+}
+
+struct inode *new_inode(blkno_t inoden)
+{
+	// a zeroed inode for a number just allocated, NULL if memory is short
+	struct ipage *pg = inode_page(inoden);
+	struct inode *ino = NULL;
+	if (pg == NULL) {
+		return NULL;
+	}
+	pthread_mutex_lock(&load_lock);
+	ino = inode_alloc();
+	if (ino != NULL) {
+		__atomic_store_n(&pg->ino[inoden % ITABLE_PAGE], ino, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&load_lock);
+	return ino;
+}
+
+void free_inode(blkno_t inoden)
+{
+	// give the inode back to the slabs. its entry reads as removed from now on, so a thread that
+	// looked it up just before sees it is gone rather than whatever the number holds next
+	struct ipage *pg = itable[inoden / ITABLE_PAGE];
+	struct inode *ino;
+	pthread_mutex_lock(&load_lock);
+	ino = pg->ino[inoden % ITABLE_PAGE];
+	__atomic_store_n(&pg->ino[inoden % ITABLE_PAGE], &dead_inode, __ATOMIC_RELEASE);
+	if (ino != NULL && ino != &dead_inode) {
+		inode_release(ino);
+	}
+	pthread_mutex_unlock(&load_lock);
+}
+
+static void evict_inode(blkno_t inoden, struct inode *ino)
+{
+	// drop an inode nobody holds from memory, called with it locked exclusive. everything in it
+	// is on the image, so its entry goes back to NULL and the next use reads it again
+	int l;
+	free(ino->ext);
+	for (l = 0; l < INDEX_DEPTH; l++) {
+		free(ino->node[l]);
+	}
+	pthread_mutex_lock(&load_lock);
+	__atomic_store_n(&itable[inoden / ITABLE_PAGE]->ino[inoden % ITABLE_PAGE], NULL, __ATOMIC_RELEASE);
+	inode_release(ino);
+	pthread_mutex_unlock(&load_lock);
+}
+
+struct inode *lock_inode(blkno_t inoden, int write)
+{
+	// lock an inode a lookup returned, shared or exclusive. it may have been removed since,
+	// then nothing is locked and NULL is returned. an orphan is still there to lock
+	struct ipage *pg;
+	struct inode *ino;
+	for (;;) {
+		if (get_inode(inoden) == &dead_inode) {
+			return NULL;
+		}
+		pg = __atomic_load_n(&itable[inoden / ITABLE_PAGE], __ATOMIC_ACQUIRE);
+		if (write) {
+			pthread_rwlock_wrlock(&pg->lock[inoden % ITABLE_PAGE]);
+		}
+		else {
+			pthread_rwlock_rdlock(&pg->lock[inoden % ITABLE_PAGE]);
+		}
+		// only read the entry with the lock held: until then the inode may be freed and reused.
+		// NULL means it was evicted in between, and is read in again
+		ino = __atomic_load_n(&pg->ino[inoden % ITABLE_PAGE], __ATOMIC_ACQUIRE);
+		if (ino != NULL) {
+			break;
+		}
+		pthread_rwlock_unlock(&pg->lock[inoden % ITABLE_PAGE]);
+	}
+	if (ino == &dead_inode) {
+		pthread_rwlock_unlock(&pg->lock[inoden % ITABLE_PAGE]);
+		return NULL;
+	}
+	return ino;
+}
+
+struct inode *lock_dir(blkno_t dirn)
+{
+	// lock a directory exclusive to change its entries, NULL if it is no longer a directory
+	// or has been removed
+	struct inode *dir = lock_inode(dirn, 1);
+	if (dir != NULL && (!S_ISDIR(dir->mode) || dir->linkcount == 0)) {
+		unlock_inode(dirn);
+		return NULL;
+	}
+	return dir;
+}
+
+void unlock_inode(blkno_t inoden)
+{
+	pthread_rwlock_unlock(&itable[inoden / ITABLE_PAGE]->lock[inoden % ITABLE_PAGE]);
+}
+
+void write_inode(struct inode *ino, blkno_t inoden)
+{
+	// rewrite only the disk_inode at the start of the inode's record
+	struct disk_inode d;
+	memset(&d, 0, sizeof(d));
+	d.size = htole32((uint32_t) ino->size);
+	d.size_hi = htole32((uint32_t) (ino->size >> 32));
+	d.uid = htole32(ino->uid);
+	d.gid = htole32(ino->gid);
+	d.mode = htole32(ino->mode);
+	d.atime = htole32(ino->atime);
+	d.ctime = htole32(ino->ctime);
+	d.mtime = htole32(ino->mtime);
+	d.linkcount = htole32(ino->linkcount);
+	d.subn = htole32(ino->subn);
+	d.indirect = htole32(ino->indirect);
+	d.location = htole32((uint32_t) ino->location);
+	d.location_hi = htole32((uint32_t) (ino->location >> 32));
+	d.parent = htole32(ino->parent);
+	d.flags = htole32(ino->inlined ? INODE_INLINE : 0);
+	write_block(INODE_BLOCK(inoden), &d, sizeof(d), INODE_POS(inoden));
+}
+
+void write_free_group(int g)
+{
+	// persist only the freemap words of group g changed since the last call,
+	// a run of neighbouring dirty words goes out in one write.
+	// writers of a group take turns, and a dirty bit is cleared before its word is read, so a
+	// change made meanwhile is either in what goes out or left dirty for the next call
+	blkno_t i, j, w, start, lo, hi;
+	uint64_t run[64], *sump, sum, dirty, bit;
+	group_words(g, &lo, &hi);
+	pthread_mutex_lock(&free_lock[g]);
+	for (j = 0; j < GROUP_DIRTYSUM_WORDS; j++) {
+		sump = &freedirtysum[g * GROUP_DIRTYSUM_WORDS + j];
+		while ((sum = __atomic_load_n(sump, __ATOMIC_SEQ_CST)) != 0) {
+			bit = sum & -sum;
+			__atomic_and_fetch(sump, ~bit, __ATOMIC_SEQ_CST);
+			i = lo / 64 + j * 64 + __builtin_ctzll(sum);
+			while ((dirty = group_sum(freedirty, i, lo, hi)) != 0) {
+				start = w = i * 64 + __builtin_ctzll(dirty);
+				while (w < hi && w / 64 == i && (dirty >> (w % 64) & 1)) {
+					__atomic_and_fetch(&freedirty[i], ~((uint64_t) 1 << (w % 64)), __ATOMIC_SEQ_CST);
+					run[w - start] = htole64(__atomic_load_n(&freemap[w], __ATOMIC_SEQ_CST));
+					w++;
+				}
+				write_block(Superblock.freeStart, run, (w - start) * sizeof(uint64_t), 
+				            start * sizeof(uint64_t));
+			}
+		}
+	}
+	pthread_mutex_unlock(&free_lock[g]);
+}
+
+void write_freeblock(void)
+{
+	// persist the changed freemap words of every group
+	int g;
+	for (g = 0; g < ALLOC_GROUPS; g++) {
+		write_free_group(g);
+	}
+}
+
+void restore_freeblock(blkno_t idxn)
+{
+	free_blocks(1, &idxn);
+}
+
+void remove_file(blkno_t filelocation)
+{
+	struct inode *ino = get_inode(filelocation);
+	truncate_blocks(ino, 0);
+	free_index(ino);
+	release_inode(filelocation);
+	free(ino->ext);
+	free_inode(filelocation);
+}
+
+static int stat_inode(blkno_t inoden, struct stat *stbuf, int ref)
+{
+	// fill stbuf, and with ref count a reference to the inode while it is locked,
+	// so it cannot be evicted before the reference is taken
+	struct inode *p;
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = FUSE_INO(inoden);
+
+	if (inoden == STATS_INODE) {
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		stbuf->st_atime = stbuf->st_ctime = stbuf->st_mtime = time(NULL);
+		return 0;
+	}
+	p = lock_inode(inoden, 0);
+	if (p == NULL) {
+		return -ENOENT;
+	}
+	
+	stbuf->st_mode = p->mode;
+	stbuf->st_nlink = p->linkcount;
+	stbuf->st_size = p->size;
+	stbuf->st_atime = p->atime;
+	stbuf->st_ctime = p->ctime;
+	stbuf->st_mtime = p->mtime;
+	if (ref) {
+		__atomic_add_fetch(&p->nlookup, 1, __ATOMIC_SEQ_CST);
+	}
+	unlock_inode(inoden);
+
+	return 0;	
+}
+
+static int entry_ref(blkno_t inoden, struct stat *entry)
+{
+	// fill in the entry the kernel asked for, if it did, and count its reference to inoden.
+	// called with a directory holding a name for inoden locked, so the name cannot go meanwhile
+	if (entry == NULL) {
+		return 0;
+	}
+	return stat_inode(inoden, entry, 1);
+}
+
+static int is_stats_name(blkno_t parent, const char *name)
+{
+	return parent == Superblock.root && strcmp(name, STATS_PATH + 1) == 0;
+}
+
+static blkno_t make_file(blkno_t parent_inode, const char *name, struct stat *entry)
+{	
+	// a new file is empty and inline, it takes an inode and no blocks.
+	// return its number, and the kernel's entry for it if it asked
+	int res;
+	blkno_t firstblock;
+	struct inode *ino;
+	if (is_stats_name(parent_inode, name)) {
+		return -EEXIST;
+	}
+	if (strlen(name) > Superblock.maxName) {
+		return -ENAMETOOLONG;
+	}
+	if (lock_dir(parent_inode) == NULL) {
+		return -ENOENT;
+	}
+	if ((firstblock = alloc_inode()) == -1) {
+		unlock_inode(parent_inode);
+		return -ENOSPC;
+	}
+
+	if ((ino = new_inode(firstblock)) == NULL) {
+		release_inode(firstblock);
+		unlock_inode(parent_inode);
+		return -ENOMEM;
+	}
+	ino->mode = S_IFREG | 0664;
+	ino->linkcount = 1;
+	ino->uid = 1;
+	ino->gid = 1;
+	ino->atime = (int) time(NULL);
+	ino->ctime = (int) time(NULL);
+	ino->mtime = (int) time(NULL);
+	ino->inlined = 1;
+
+	write_inode(ino, firstblock);
+
+	// modify parent inode
+	res = dir_add(parent_inode, name, strlen(name), firstblock, 'f');
+	if (res != 0) {
+		remove_file(firstblock);
+	}
+	else {
+		dcache_update(parent_inode, name, firstblock);
+		entry_ref(firstblock, entry);
+	}
+	unlock_inode(parent_inode);
+	return res != 0 ? res : firstblock;
+}
+
+static int do_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	blkno_t parent_inode = find_parent_inode(path);
+	blkno_t res = parent_inode < 0 ? parent_inode : make_file(parent_inode, split_to_name(path), NULL);
+	(void) mode;
+	return res < 0 ? res : open_file(res, fi);
+}
+
+static blkno_t make_dir(blkno_t parent_inode, const char *name, struct stat *entry)
+{
+	int res;
+	blkno_t firstblock, dirblock;
+	struct inode *ino, *parent;
+	if (is_stats_name(parent_inode, name)) {
+		return -EEXIST;
+	}
+	if (strlen(name) > Superblock.maxName) {
+		return -ENAMETOOLONG;
+	}
+	if ((parent = lock_dir(parent_inode)) == NULL) {
+		return -ENOENT;
+	}
+	if ((firstblock = alloc_inode()) == -1) {
+		unlock_inode(parent_inode);
+		return -ENOSPC;
+	}
+	if (alloc_blocks(1, &dirblock) == -1) {
+		release_inode(firstblock);
+		unlock_inode(parent_inode);
+		return -ENOSPC;
+	}
+
+	if ((ino = new_inode(firstblock)) == NULL || add_extent(ino, dirblock, 1) != 0) {
+		free_blocks(1, &dirblock);
+		release_inode(firstblock);
+		if (ino != NULL) {
+			free_inode(firstblock);
+		}
+		unlock_inode(parent_inode);
+		return -ENOMEM;
+	}
+	ino->mode = 16877;
+	ino->linkcount = 2;
+	ino->size = BLOCK_SIZE;
+	ino->uid = 1;
+	ino->gid = 1;
+	ino->atime = (int) time(NULL);
+	ino->ctime = (int) time(NULL);
+	ino->mtime = (int) time(NULL);
+	ino->location = dirblock;
+	ino->parent = parent_inode;
+
+	dir_init_block(dirblock);
+	write_inode(ino, firstblock);
+
+	// modify parent inode
+	parent->linkcount++;
+	res = dir_add(parent_inode, name, strlen(name), firstblock, 'd');
+	if (res != 0) {
+		parent->linkcount--;
+		remove_file(firstblock);
+	}
+	else {
+		dcache_update(parent_inode, name, firstblock);
+		entry_ref(firstblock, entry);
+	}
+	unlock_inode(parent_inode);
+	return res != 0 ? res : firstblock;
+}
+
+static int do_mkdir(const char *path, mode_t mode)
+{
+	blkno_t parent_inode = find_parent_inode(path);
+	blkno_t res = parent_inode < 0 ? parent_inode : make_dir(parent_inode, split_to_name(path), NULL);
+	(void) mode;
+	return res < 0 ? res : 0;
+}
+
+// the text of /.vfsstats, in the Prometheus exposition format
+struct textbuf {
+	char *data;
+	size_t len;
+	size_t cap;
+	int failed;
+};
+
+static const char *op_names[OP_COUNT] = {
+	"none", "getattr", "opendir", "readdir", "releasedir", "open", "read", "read_buf", "create",
+	"mkdir", "rmdir", "rename", "release", "flush", "fsync", "fsyncdir", "write", "write_buf",
+	"link", "unlink", "statfs", "chmod", "chown", "utimens", "truncate", "lookup", "forget", "setattr"
+};
+
+// a counter and where it is kept in its struct
+struct statfield {
+	const char *name;
+	size_t off;
+};
+
+static const struct statfield op_fields[] = {
+	{ "vfs_op_calls_total", offsetof(struct opstat, calls) },
+	{ "vfs_op_errors_total", offsetof(struct opstat, errors) },
+	{ "vfs_op_bytes_total", offsetof(struct opstat, bytes) },
+	{ "vfs_op_image_reads_total", offsetof(struct opstat, reads) },
+	{ "vfs_op_image_read_bytes_total", offsetof(struct opstat, readbytes) },
+	{ "vfs_op_image_writes_total", offsetof(struct opstat, writes) },
+	{ "vfs_op_image_write_bytes_total", offsetof(struct opstat, writebytes) },
+	{ "vfs_op_image_syncs_total", offsetof(struct opstat, syncs) },
+	{ "vfs_op_image_punches_total", offsetof(struct opstat, punches) },
+};
+
+static const struct statfield counter_fields[] = {
+	{ "vfs_alloc_calls_total", offsetof(struct counters, allocs) },
+	{ "vfs_alloc_blocks_total", offsetof(struct counters, allocblocks) },
+	{ "vfs_alloc_short_total", offsetof(struct counters, allocshort) },
+	{ "vfs_alloc_failures_total", offsetof(struct counters, allocfails) },
+	{ "vfs_freed_blocks_total", offsetof(struct counters, freedblocks) },
+	{ "vfs_dcache_lookups_total", offsetof(struct counters, dlookups) },
+	{ "vfs_dcache_hits_total", offsetof(struct counters, dhits) },
+};
+
+static const struct statfield bstat_fields[] = {
+	{ "vfs_bcache_reads_total", offsetof(struct bstat, reads) },
+	{ "vfs_bcache_read_hits_total", offsetof(struct bstat, readhits) },
+	{ "vfs_bcache_writes_total", offsetof(struct bstat, writes) },
+	{ "vfs_bcache_write_hits_total", offsetof(struct bstat, writehits) },
+	{ "vfs_bcache_absorbed_total", offsetof(struct bstat, absorbed) },
+	{ "vfs_bcache_evict_writebacks_total", offsetof(struct bstat, evictflush) },
+	{ "vfs_bcache_flusher_writebacks_total", offsetof(struct bstat, timedflush) },
+	{ "vfs_bcache_sync_writebacks_total", offsetof(struct bstat, syncflush) },
+	{ "vfs_fsync_commits_total", offsetof(struct bstat, syncs) },
+	{ "vfs_fsync_calls_total", offsetof(struct bstat, syncwaits) },
+	{ "vfs_journal_commits_total", offsetof(struct bstat, commits) },
+	{ "vfs_journal_ops_total", offsetof(struct bstat, commitops) },
+	{ "vfs_journal_blocks_total", offsetof(struct bstat, logblocks) },
+	{ "vfs_journal_checkpoints_total", offsetof(struct bstat, checkpoints) },
+	{ "vfs_journal_overflows_total", offsetof(struct bstat, overflows) },
+};
+
+#define NFIELDS(f) ((int) (sizeof(f) / sizeof((f)[0])))
+#define FIELD(p, off) (*(const unsigned long *) ((const char *) (p) + (off)))
+
+static void text_printf(struct textbuf *t, const char *fmt, ...)
+{
+	va_list ap;
+	char *p;
+	int n;
+	while (!t->failed) {
+		va_start(ap, fmt);
+		n = vsnprintf(t->data + t->len, t->cap - t->len, fmt, ap);
+		va_end(ap);
+		if (n >= 0 && (size_t) n < t->cap - t->len) {
+			t->len += n;
+			return;
+		}
+		p = n < 0 ? NULL : realloc(t->data, t->cap * 2 + n);
+		if (p == NULL) {
+			t->failed = 1;
+			return;
+		}
+		t->data = p;
+		t->cap = t->cap * 2 + n;
+	}
+}
+
+static void stats_gauge(struct textbuf *t, const char *name, long long val)
+{
+	text_printf(t, "# TYPE %s gauge\n%s %lld\n", name, name, val);
+}
+
+static void stats_counters(struct textbuf *t, const struct statfield *f, int n, const void *base)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		text_printf(t, "# TYPE %s counter\n%s %lu\n", f[i].name, f[i].name, FIELD(base, f[i].off));
+	}
+}
+
+static int stats_text(struct textbuf *t)
+{
+	// add up every thread's counters and print them with the cache's and the allocator's
+	struct counters sum;
+	struct bstat b;
+	struct tstat *ts;
+	struct opstat *s;
+	unsigned long *v, *p, cum;
+	size_t i;
+	int op, k, live, slabs, pages;
+
+	t->cap = 16384;
+	t->len = 0;
+	t->failed = 0;
+	t->data = malloc(t->cap);
+	if (t->data == NULL) {
+		return -ENOMEM;
+	}
+	memset(&sum, 0, sizeof(sum));
+	v = (unsigned long *) &sum;
+	pthread_mutex_lock(&stats_lock);
+	for (ts = &spare_stats; ts != NULL; ts = ts->next) {
+		p = (unsigned long *) &ts->c;
+		for (i = 0; i < sizeof(sum) / sizeof(unsigned long); i++) {
+			v[i] += __atomic_load_n(&p[i], __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&stats_lock);
+	pthread_mutex_lock(&block_lock);
+	b = bstat;
+	pthread_mutex_unlock(&block_lock);
+	pthread_mutex_lock(&load_lock);
+	live = ilive;
+	slabs = islabs;
+	pages = ipages;
+	pthread_mutex_unlock(&load_lock);
+
+	// per handler, those never called are left out. image I/O outside a handler is op "none"
+	for (k = 0; k < NFIELDS(op_fields); k++) {
+		text_printf(t, "# TYPE %s counter\n", op_fields[k].name);
+		for (op = 0; op < OP_COUNT; op++) {
+			if (op == OP_NONE || sum.op[op].calls > 0) {
+				text_printf(t, "%s{op=\"%s\"} %lu\n", op_fields[k].name, op_names[op], 
+				            FIELD(&sum.op[op], op_fields[k].off));
+			}
+		}
+	}
+	text_printf(t, "# TYPE vfs_op_seconds histogram\n");
+	for (op = 1; op < OP_COUNT; op++) {
+		s = &sum.op[op];
+		if (s->calls == 0) {
+			continue;
+		}
+		for (k = 0, cum = 0; k < LAT_BUCKETS - 1; k++) {
+			cum += s->lat[k];
+			text_printf(t, "vfs_op_seconds_bucket{op=\"%s\",le=\"%.6f\"} %lu\n", op_names[op], 
+			            (double) (1UL << k) / 1e6, cum);
+		}
+		text_printf(t, "vfs_op_seconds_bucket{op=\"%s\",le=\"+Inf\"} %lu\n", op_names[op], s->calls);
+		text_printf(t, "vfs_op_seconds_sum{op=\"%s\"} %.9f\n", op_names[op], s->ns / 1e9);
+		text_printf(t, "vfs_op_seconds_count{op=\"%s\"} %lu\n", op_names[op], s->calls);
+	}
+
+	stats_counters(t, counter_fields, NFIELDS(counter_fields), &sum);
+	stats_counters(t, bstat_fields, NFIELDS(bstat_fields), &b);
+	stats_gauge(t, "vfs_bcache_buffers", nbuf);
+	stats_gauge(t, "vfs_blocks", Superblock.maxBlocks);
+	stats_gauge(t, "vfs_free_blocks", __atomic_load_n(&Superblock.freeblocks, __ATOMIC_RELAXED));
+	stats_gauge(t, "vfs_inodes", Superblock.maxInodes);
+	stats_gauge(t, "vfs_free_inodes", __atomic_load_n(&Superblock.freeinodes, __ATOMIC_RELAXED));
+	stats_gauge(t, "vfs_inodes_cached", live);
+	stats_gauge(t, "vfs_inode_slabs", slabs);
+	stats_gauge(t, "vfs_inode_pages", pages);
+	if (t->failed) {
+		free(t->data);
+		t->data = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static int is_stats_file(const char *path)
+{
+	return path != NULL && strcmp(path, STATS_PATH) == 0;
+}
+
+// an open file, kept in fi->fh from open to release. it holds a reference on the inode like
+// a lookup does, so a file unlinked while open stays readable until it is closed.
+// ext is the extent the last read or write through it ended in, where the next one looks first,
+// and stats the stats file's text, made at open
+struct handle {
+	blkno_t inoden;
+	int ext;
+	struct textbuf *stats;
+};
+
+static struct handle *file_handle(struct fuse_file_info *fi)
+{
+	return fi == NULL ? NULL : (struct handle *) (uintptr_t) fi->fh;
+}
+
+static int *file_cursor(struct fuse_file_info *fi)
+{
+	// where next_run starts looking for the extents of an access through fi, NULL for none
+	struct handle *h = file_handle(fi);
+	return h == NULL ? NULL : &h->ext;
+}
+
+static int stats_open(struct handle *h, struct fuse_file_info *fi)
+{
+	// the text is made once at open, so reads at any offset see one consistent copy.
+	// its length is not known before then, so the kernel is told not to go by the size
+	struct textbuf *t;
+	int res;
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		return -EACCES;
+	}
+	t = malloc(sizeof(struct textbuf));
+	if (t == NULL) {
+		return -ENOMEM;
+	}
+	res = stats_text(t);
+	if (res != 0) {
+		free(t);
+		return res;
+	}
+	h->stats = t;
+	fi->direct_io = 1;
+	return 0;
+}
+
+static size_t stats_range(struct fuse_file_info *fi, size_t size, off_t offset, const char **data)
+{
+	// the part of the open copy a read at offset gets
+	struct handle *h = file_handle(fi);
+	struct textbuf *t = h == NULL ? NULL : h->stats;
+	*data = "";
+	if (t == NULL || offset >= (off_t) t->len) {
+		return 0;
+	}
+	*data = t->data + offset;
+	return t->len - offset < size ? t->len - offset : size;
+}
+
+static void stats_close(struct handle *h)
+{
+	if (h->stats != NULL) {
+		free(h->stats->data);
+		free(h->stats);
+		h->stats = NULL;
+	}
+}
+
+static blkno_t path_inode(const char *path)
+{
+	return is_stats_file(path) ? STATS_INODE : split_to_blockn(path, 0);
+}
+
+static int lookup_entry(blkno_t parent, const char *name, struct stat *entry)
+{
+	// the kernel's lookup of name in directory parent. the directory stays locked while the
+	// reference is counted, so a removal of the name cannot free the inode in between
+	struct inode *dir;
+	int len = strlen(name), res;
+	blkno_t inoden;
+	if (is_stats_name(parent, name)) {
+		return entry_ref(STATS_INODE, entry);
+	}
+	if ((dir = lock_inode(parent, 0)) == NULL) {
+		return -ENOENT;
+	}
+	if (!S_ISDIR(dir->mode)) {
+		unlock_inode(parent);
+		return -ENOTDIR;
+	}
+	inoden = dcache_get(parent, name, len);
+	if (inoden == 0) {
+		inoden = dir_lookup(parent, name, len);
+		if (inoden != -EIO) {
+			dcache_set(parent, name, len, inoden > 0 ? inoden : 0);
+		}
+	}
+	res = inoden < 0 ? inoden : entry_ref(inoden, entry);
+	unlock_inode(parent);
+	return res;
+}
+
+static void forget_inode(blkno_t inoden, unsigned long n)
+{
+	// the kernel dropped n references. an orphan goes with the last one, and unlink and rmdir
+	// check for references with the inode locked, so between them one of the two removes it.
+	// an inode with links is evicted with the last one, unless its index is not written yet
+	struct inode *ino;
+	int orphan;
+	if (inoden == STATS_INODE || __atomic_sub_fetch(&get_inode(inoden)->nlookup, n, __ATOMIC_SEQ_CST) != 0) {
+		return;
+	}
+	if ((ino = lock_inode(inoden, 1)) == NULL) {
+		return;
+	}
+	orphan = ino->linkcount == 0;
+	if (!orphan && inoden != Superblock.root && __atomic_load_n(&ino->nlookup, __ATOMIC_SEQ_CST) == 0 
+	    && (ino->indirect == 0 || ino->extdirty == ino->nextent)) {
+		evict_inode(inoden, ino);
+	}
+	unlock_inode(inoden);
+	if (!orphan) {
+		return;
+	}
+	log_begin();
+	ino = lock_inode(inoden, 1);
+	if (ino != NULL) {
+		if (ino->linkcount == 0 && __atomic_load_n(&ino->nlookup, __ATOMIC_SEQ_CST) == 0) {
+			remove_file(inoden);
+		}
+		unlock_inode(inoden);
+	}
+	log_end();
+}
+
+// a listing resumes at a cookie made from the hash of the next name, not from where it sits:
+// buckets split and entries close up behind removals. reversed, the hash orders the names by
+// bucket and each bucket covers one range of that order, so a scan from any cookie visits each
+// name that stays put exactly once. "." and ".." are cookies 0 and 1, names start at 3.
+// names that hash alike go on by dup, which comes from the name alone
+#define DIR_COOKIE(rev, dup) ((((off_t) (rev) << DIR_DUP_BITS) | (dup)) + 3)
+
+// an entry of a bucket in cookie order: its reversed hash, its dup and where it is
+struct dirkey {
+	uint32_t rev;
+	uint32_t dup;
+	uint32_t pos;
+};
+
+static uint32_t reverse_bits(uint32_t h)
+{
+	h = (h >> 1 & 0x55555555) | (h & 0x55555555) << 1;
+	h = (h >> 2 & 0x33333333) | (h & 0x33333333) << 2;
+	h = (h >> 4 & 0x0f0f0f0f) | (h & 0x0f0f0f0f) << 4;
+	h = (h >> 8 & 0x00ff00ff) | (h & 0x00ff00ff) << 8;
+	return h >> 16 | h << 16;
+}
+
+static int key_before(const char *blk, const struct dirkey *a, const struct dirkey *b)
+{
+	// entries of a bucket go by reversed hash, those whose names hash alike by dup, then name
+	const struct disk_dirent *x = (const void *) (blk + a->pos), *y = (const void *) (blk + b->pos);
+	int c;
+	if (a->rev != b->rev) {
+		return a->rev < b->rev;
+	}
+	if (a->dup != b->dup) {
+		return a->dup < b->dup;
+	}
+	c = memcmp(x->name, y->name, x->namelen < y->namelen ? x->namelen : y->namelen);
+	return c != 0 ? c < 0 : x->namelen < y->namelen;
+}
+
+static void sort_keys(const char *blk, struct dirkey *key, int n)
+{
+	// a shell sort: a bucket holds a few hundred entries, and inline comparisons beat qsort's
+	static const int gaps[] = { 132, 57, 23, 10, 4, 1 };
+	struct dirkey k;
+	int g, i, j, gap;
+	for (g = 0; g < (int) NFIELDS(gaps); g++) {
+		gap = gaps[g];
+		for (i = gap; i < n; i++) {
+			for (j = i, k = key[i]; j >= gap && key_before(blk, &k, &key[j - gap]); j -= gap) {
+				key[j] = key[j - gap];
+			}
+			key[j] = k;
+		}
+	}
+}
+
+static int fill_entry(void *buf, fuse_fill_dir_t filler, blkno_t inoden, const char *name, int type, 
+                      off_t next)
+{
+	// hand one name to filler with what the kernel's readdir keeps, its inode number and type.
+	// libfuse 2.9 has no readdirplus, so there is nowhere to put the rest of its attributes
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	st.st_ino = FUSE_INO(inoden);
+	st.st_mode = type == 'd' ? S_IFDIR : S_IFREG;
+	return filler(buf, name, &st, next);
+}
+
+// the sorted keys of one bucket, over all its blocks. an open directory keeps the last bucket
+// it sorted, so a listing that reads a bucket in pieces hashes and sorts it once
+struct dirscan {
+	int b;
+	int nblk;
+	int nkey;
+	char *blk;
+	struct dirkey *key;
+};
+
+static int scan_bucket(blkno_t dirn, int b, off_t off, struct dirscan *ds, void *buf, 
+                       fuse_fill_dir_t filler)
+{
+	// the names of bucket b from cookie off on, in cookie order. they go into the name cache
+	// on the way, as a listing is usually followed by a lookup of each name.
+	// returns 1 once filler is full, -errno if the bucket cannot be read
+	struct disk_dirent *de;
+	char name[MAX_NAME_LEN + 1], *blk;
+	blkno_t *blocks;
+	struct dirkey *key;
+	int i, k, pos, used, nblk;
+
+	nblk = dir_read_bucket(get_inode(dirn), b, &blk, &blocks);
+	if (nblk < 0) {
+		return nblk;
+	}
+	free(blocks);
+	// only the entries are compared, not what is left past them
+	for (k = 0; k < nblk; k++) {
+		used = le32toh(((struct disk_dirblock *) (blk + (size_t) k * BLOCK_SIZE))->used);
+		if (used < BLOCK_SIZE) {
+			memset(blk + (size_t) k * BLOCK_SIZE + used, 0, BLOCK_SIZE - used);
+		}
+	}
+	if (ds->b != b || ds->nblk != nblk || memcmp(ds->blk, blk, (size_t) nblk * BLOCK_SIZE) != 0) {
+		// each key is the reversed hash and the dup of the entry's name, neither of which
+		// depends on the other names, so each keeps its cookie when others come and go
+		key = malloc((size_t) nblk * DIR_BLOCK_ENTRIES * sizeof(struct dirkey));
+		if (key == NULL) {
+			free(blk);
+			return -ENOMEM;
+		}
+		free(ds->blk);
+		free(ds->key);
+		ds->blk = blk;
+		ds->key = key;
+		ds->b = b;
+		ds->nblk = nblk;
+		ds->nkey = 0;
+		for (k = 0; k < nblk; k++) {
+			used = le32toh(((struct disk_dirblock *) (blk + (size_t) k * BLOCK_SIZE))->used);
+			for (pos = sizeof(struct disk_dirblock); pos < used; pos += DIRENT_LEN(de->namelen)) {
+				de = (struct disk_dirent *) (blk + (size_t) k * BLOCK_SIZE + pos);
+				ds->key[ds->nkey].rev = reverse_bits(hash_name(2166136261u, de->name, de->namelen));
+				ds->key[ds->nkey].dup = hash_name(DIR_DUP_SEED, de->name, de->namelen) & (DIR_MAX_DUPS - 1);
+				ds->key[ds->nkey++].pos = k * BLOCK_SIZE + pos;
+			}
+		}
+		sort_keys(ds->blk, ds->key, ds->nkey);
+		// names alike in both hashes take the next dup free, the only cookies that can move
+		for (i = 1; i < ds->nkey; i++) {
+			if (ds->key[i].rev == ds->key[i - 1].rev && ds->key[i].dup <= ds->key[i - 1].dup 
+			    && ds->key[i - 1].dup < DIR_MAX_DUPS - 1) {
+				ds->key[i].dup = ds->key[i - 1].dup + 1;
+			}
+		}
+	}
+	else {
+		free(blk);
+	}
+	for (i = 0; i < ds->nkey; i++) {
+		if (DIR_COOKIE(ds->key[i].rev, ds->key[i].dup) < off) {
+			continue;
+		}
+		de = (struct disk_dirent *) (ds->blk + ds->key[i].pos);
+		memcpy(name, de->name, de->namelen);
+		name[de->namelen] = '\0';
+		dcache_set(dirn, name, de->namelen, le32toh(de->inode));
+		if (fill_entry(buf, filler, le32toh(de->inode), name, de->type, 
+		               DIR_COOKIE(ds->key[i].rev, ds->key[i].dup) + 1) != 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int list_dir(blkno_t inoden, off_t off, struct dirscan *ds, void *buf, 
+                    fuse_fill_dir_t filler)
+{
+	// hand filler the names of the directory from cookie off on until it is full,
+	// ds is the open directory's, NULL for none
+	struct dirscan mine;
+	struct inode *p;
+	blkno_t parent;
+	uint64_t rev;
+	int b, bits, full = 0, level = 1, n;
+	p = lock_inode(inoden, 0);
+	if (p == NULL) {
+		return -ENOENT;
+	}
+	if (!S_ISDIR(p->mode)) {
+		unlock_inode(inoden);
+		return -ENOTDIR;
+	}
+	parent = p->parent;
+	unlock_inode(inoden);
+
+	// the parent is never locked after its child, so "." and ".." go in with neither held
+	if (off == 0) {
+		full = fill_entry(buf, filler, inoden, ".", 'd', 1);
+	}
+	if (!full && off <= 1) {
+		full = fill_entry(buf, filler, parent, "..", 'd', 2);
+	}
+	if (full || (p = lock_inode(inoden, 0)) == NULL) {
+		return 0;
+	}
+	if (ds == NULL) {
+		memset(&mine, 0, sizeof(mine));
+		mine.b = -1;
+		ds = &mine;
+	}
+	n = file_blocks(p);
+	while (level * 2 <= n) {
+		level *= 2;
+	}
+	// walk the buckets in the order of the ranges they cover, from the one holding off
+	rev = off < 3 ? 0 : (uint64_t) (off - 3) >> DIR_DUP_BITS;
+	while (full == 0 && rev < 1ULL << 32) {
+		b = dir_bucket(n, reverse_bits((uint32_t) rev));
+		bits = __builtin_ctz(level) + (b < n - level || b >= level);
+		full = scan_bucket(inoden, b, off, ds, buf, filler);
+		rev = reverse_bits(b) + (1ULL << (32 - bits));
+	}
+	unlock_inode(inoden);
+	if (ds == &mine) {
+		free(mine.blk);
+		free(mine.key);
+	}
+	return full < 0 ? full : 0;
+}
+
+// the mount's readdir fills the kernel's buffer in its format, each entry carrying the cookie
+// the next read resumes at
+struct dirfill {
+	fuse_req_t req;
+	char *buf;
+	size_t size;
+	size_t len;
+};
+
+static int fill_dirbuf(void *buf, const char *name, const struct stat *st, off_t off)
+{
+	// append one entry, 1 once it does not fit
+	struct dirfill *d = buf;
+	size_t n = fuse_add_direntry(d->req, NULL, 0, name, NULL, 0);
+	if (d->len + n > d->size) {
+		return 1;
+	}
+	fuse_add_direntry(d->req, d->buf + d->len, n, name, st, off);
+	d->len += n;
+	return 0;
+}
+
+static int open_dir(blkno_t inoden, struct fuse_file_info *fi)
+{
+	struct dirscan *ds;
+	struct inode *ino = lock_inode(inoden, 0);
+	int isdir = ino != NULL && S_ISDIR(ino->mode);
+	if (ino == NULL) {
+		return -ENOENT;
+	}
+	unlock_inode(inoden);
+	if (!isdir) {
+		return -ENOTDIR;
+	}
+	ds = calloc(1, sizeof(struct dirscan));
+	if (ds == NULL) {
+		return -ENOMEM;
+	}
+	ds->b = -1;
+	fi->fh = (uintptr_t) ds;
+	return 0;
+}
+
+static int read_dir(fuse_req_t req, blkno_t inoden, size_t size, off_t off, struct fuse_file_info *fi, 
+                    char *buf)
+{
+	// the entries from cookie off on that fit in size bytes of buf, returns the bytes used.
+	// the kernel keeps only the inode number and type of each, so no attributes are looked up
+	struct dirfill d = { req, buf, size, 0 };
+	int res = list_dir(inoden, off, (struct dirscan *) (uintptr_t) fi->fh, &d, fill_dirbuf);
+	return res != 0 ? res : (int) d.len;
+}
+
+static void release_dir(struct fuse_file_info *fi)
+{
+	struct dirscan *ds = (struct dirscan *) (uintptr_t) fi->fh;
+	free(ds->blk);
+	free(ds->key);
+	free(ds);
+	fi->fh = 0;
+}
+
+static int open_file(blkno_t inoden, struct fuse_file_info *fi)
+{
+	// make the handle the reads and writes through fi use
+	struct handle *h = calloc(1, sizeof(struct handle));
+	struct inode *ino;
+	int res = 0;
+	if (h == NULL) {
+		return -ENOMEM;
+	}
+	h->inoden = inoden;
+	if (inoden == STATS_INODE) {
+		res = stats_open(h, fi);
+	}
+	else if ((ino = lock_inode(inoden, 0)) == NULL) {
+		res = -ENOENT;
+	}
+	else {
+		// taken under the lock unlink checks it under, so the inode cannot go in between
+		__atomic_add_fetch(&ino->nlookup, 1, __ATOMIC_SEQ_CST);
+		unlock_inode(inoden);
+	}
+	if (res != 0) {
+		free(h);
+		return res;
+	}
+	fi->fh = (uintptr_t) h;
+	return 0;
+}
+
+static int release_file(struct fuse_file_info *fi)
+{
+	// drop the handle and its reference, the last one of a file unlinked while open removes it
+	struct handle *h = file_handle(fi);
+	if (h == NULL) {
+		return 0;
+	}
+	if (h->inoden == STATS_INODE) {
+		stats_close(h);
+	}
+	else {
+		forget_inode(h->inoden, 1);
+	}
+	free(h);
+	fi->fh = 0;
+	return 0;
+}
+
+static int do_release(const char *path, struct fuse_file_info *fi)
+{
+	(void) path;
+	return release_file(fi);
+}
+
+static blkno_t file_inode(const char *path, struct fuse_file_info *fi)
+{
+	// the inode a path handler works on: the open file's when there is one, so no path is walked
+	struct handle *h = file_handle(fi);
+	return h != NULL ? h->inoden : path_inode(path);
+}
+
+static int do_flush(const char *path, struct fuse_file_info *fi)
+{
+	// close is not a durability point, dirty blocks stay cached until fsync, the flusher or unmount
+	(void) path;
+	(void) fi;
+	return 0;
+}
+
+static int do_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	// the file's inode, its directory entry and the free list share blocks with other files,
+	// so rather than picking blocks out the whole cache goes, in a sync shared with other callers
+	(void) path;
+	(void) datasync;
+	(void) fi;
+	return bcache_sync();
+}
+
+static int do_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	(void) path;
+	(void) datasync;
+	(void) fi;
+	return bcache_sync();
+}
+
+static int file_range(blkno_t inoden, size_t *size, off_t offset)
+{
+	// clip [offset, offset + size) to the end of the file, which is left locked shared
+	struct inode *ino = lock_inode(inoden, 0);
+	if (ino == NULL) {
+		return -ENOENT;
+	}
+	if (offset >= ino->size) {
+		*size = 0;
+	}
+	else if (offset + *size > ino->size) {
+		*size = ino->size - offset;
+	}
+	return 0;
+}
+
+static int in_extent(struct inode *ino, int e, int lblk)
+{
+	return e >= 0 && e < ino->nextent && lblk >= ino->ext[e].lblk 
+	       && lblk < ino->ext[e].lblk + ino->ext[e].len;
+}
+
+static int next_run(struct inode *ino, off_t pos, size_t left, off_t *diskpos, size_t *len, int *cursor)
+{
+	// the bytes from pos that sit contiguously on disk, at most left of them.
+	// a cursor names the extent the last run of an open file was in: a sequential access
+	// finds its run there or in the next one, and only a seek searches the map
+	int lblk = pos / BLOCK_SIZE, e = cursor == NULL ? -1 : __atomic_load_n(cursor, __ATOMIC_RELAXED);
+	struct extent *x;
+	if (!in_extent(ino, e, lblk)) {
+		e = in_extent(ino, e + 1, lblk) ? e + 1 : find_extent(ino, lblk);
+	}
+	if (e == -1) {
+		return -EIO;
+	}
+	if (cursor != NULL) {
+		__atomic_store_n(cursor, e, __ATOMIC_RELAXED);
+	}
+	x = &ino->ext[e];
+	*diskpos = (off_t) (x->start + lblk - x->lblk) * BLOCK_SIZE + pos % BLOCK_SIZE;
+	*len = (size_t) (x->lblk + x->len - lblk) * BLOCK_SIZE - pos % BLOCK_SIZE;
+	if (*len > left) {
+		*len = left;
+	}
+	return 0;
+}
+
+static struct fuse_bufvec *mem_bufvec(size_t size)
+{
+	// a vector of one buffer of size bytes of memory. libfuse frees both after the reply
+	struct fuse_bufvec *bv = malloc(sizeof(struct fuse_bufvec));
+	if (bv == NULL) {
+		return NULL;
+	}
+	*bv = FUSE_BUFVEC_INIT(size);
+	bv->buf[0].mem = malloc(size > 0 ? size : 1);
+	if (bv->buf[0].mem == NULL) {
+		free(bv);
+		return NULL;
+	}
+	return bv;
+}
+
+static void free_bufvec(struct fuse_bufvec *bv)
+{
+	if (bv != NULL) {
+		free(bv->buf[0].mem);
+		free(bv);
+	}
+}
+
+static int read_file_buf(blkno_t inoden, struct fuse_bufvec **bufp, size_t size, off_t offset, 
+                         struct fuse_file_info *fi)
+{
+	// describe the runs as fd-backed buffers so libfuse can splice them from the image,
+	// after writing back any dirty cached blocks they cover. the buffers only name where the
+	// bytes are, so the file is left locked shared until put_file_buf: until the reply is sent
+	// no truncate or punch can free those blocks or zero them, and they hold this file's bytes
+	struct inode *ino;
+	struct fuse_bufvec *bv;
+	size_t done, len, n = 0;
+	off_t diskpos;
+	const char *text;
+	int res, *cursor = file_cursor(fi), walk;
+
+	if (inoden == STATS_INODE) {
+		size = stats_range(fi, size, offset, &text);
+		if ((bv = mem_bufvec(size)) == NULL) {
+			return -ENOMEM;
+		}
+		memcpy(bv->buf[0].mem, text, size);
+		*bufp = bv;
+		return 0;
+	}
+	res = file_range(inoden, &size, offset);
+	if (res != 0) {
+		return res;
+	}
+	ino = get_inode(inoden);
+	if (ino->inlined) {
+		// inline bytes live in a journaled inode table block, so they are copied out of the cache
+		bv = mem_bufvec(size);
+		res = bv == NULL ? -ENOMEM : 0;
+		if (res == 0 && read_block(INODE_BLOCK(inoden), bv->buf[0].mem, size, INLINE_POS(inoden) + offset) != size) {
+			res = -EIO;
+		}
+		if (res != 0) {
+			unlock_inode(inoden);
+			free_bufvec(bv);
+			return res;
+		}
+		*bufp = bv;
+		return 0;
+	}
+	// the second walk over the runs starts from where the first did
+	walk = cursor == NULL ? -1 : __atomic_load_n(cursor, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&block_lock);
+	for (done = 0; res == 0 && done < size; done += len, n++) {
+		res = next_run(ino, offset + done, size - done, &diskpos, &len, cursor);
+		if (res == 0) {
+			bcache_flush(diskpos / BLOCK_SIZE, (diskpos % BLOCK_SIZE + len + BLOCK_SIZE - 1) / BLOCK_SIZE, 
+			             &bstat.syncflush);
+		}
+	}
+	pthread_mutex_unlock(&block_lock);
+	bv = res == 0 ? malloc(sizeof(struct fuse_bufvec) + (n > 0 ? n - 1 : 0) * sizeof(struct fuse_buf)) : NULL;
+	if (bv == NULL) {
+		unlock_inode(inoden);
+		return res != 0 ? res : -ENOMEM;
+	}
+	*bv = FUSE_BUFVEC_INIT(0);
+	bv->count = n > 0 ? n : 1;
+	for (done = 0, n = 0; done < size; done += len, n++) {
+		next_run(ino, offset + done, size - done, &diskpos, &len, &walk);
+		bv->buf[n].size = len;
+		bv->buf[n].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		bv->buf[n].mem = NULL;
+		bv->buf[n].fd = fusefd;
+		bv->buf[n].pos = diskpos;
+	}
+	*bufp = bv;
+	return 0;
+}
+
+static void put_file_buf(blkno_t inoden, struct fuse_bufvec *bv)
+{
+	// the reply is out, the file's blocks may change again
+	if (inoden != STATS_INODE) {
+		unlock_inode(inoden);
+	}
+	free_bufvec(bv);
+}
+
+static int zero_range(struct inode *ino, off_t pos, off_t len)
+{
+	// bytes past the end of a file are undefined on disk, clear them before the end moves over them.
+	// whole blocks are punched out rather than written
+	char cont[BLOCK_SIZE];
+	off_t diskpos;
+	size_t n;
+	int res = 0, cursor = -1;
+	memset(cont, '\0', sizeof(cont));
+	for (; res == 0 && len > 0; pos += n, len -= n) {
+		res = next_run(ino, pos, len, &diskpos, &n, &cursor);
+		if (res != 0) {
+			break;
+		}
+		if (diskpos % BLOCK_SIZE == 0 && n >= BLOCK_SIZE 
+		    && punch_blocks(diskpos / BLOCK_SIZE, n / BLOCK_SIZE) == 0) {
+			n -= n % BLOCK_SIZE;
+			continue;
+		}
+		if (n > BLOCK_SIZE - diskpos % BLOCK_SIZE) {
+			n = BLOCK_SIZE - diskpos % BLOCK_SIZE;
+		}
+		if (write_data_block(diskpos / BLOCK_SIZE, cont, n, diskpos % BLOCK_SIZE) != n) {
+			res = -EIO;
+		}
+	}
+	return res;
+}
+
+static int zero_inline(blkno_t inoden, off_t pos, off_t len)
+{
+	// the same for an inline file, whose bytes past the end are in its inode record
+	char cont[INLINE_BUF];
+	memset(cont, '\0', len);
+	return write_block(INODE_BLOCK(inoden), cont, len, INLINE_POS(inoden) + pos) == len ? 0 : -EIO;
+}
+
+static int inline_to_blocks(struct inode *ino, blkno_t inoden, int n)
+{
+	// give an inline file n data blocks and move its bytes out to the first of them
+	char data[INLINE_BUF];
+	size_t len = ino->size;
+	int res;
+	if (read_block(INODE_BLOCK(inoden), data, len, INLINE_POS(inoden)) != len) {
+		return -EIO;
+	}
+	res = grow_blocks(ino, n);
+	if (res != 0) {
+		return res;
+	}
+	if (write_data_block(bmap(ino, 0), data, len, 0) != len) {
+		shrink_blocks(ino, 0);
+		return -EIO;
+	}
+	ino->inlined = 0;
+	write_inode(ino, inoden);
+	return 0;
+}
+
+static int blocks_to_inline(struct inode *ino, blkno_t inoden, off_t size)
+{
+	// bring what is kept of a file cut down to size back into its inode record, and free its blocks
+	char data[INLINE_BUF];
+	size_t len = size < ino->size ? size : ino->size;
+	if (len > 0 && (read_block(bmap(ino, 0), data, len, 0) != len 
+	                || write_block(INODE_BLOCK(inoden), data, len, INLINE_POS(inoden)) != len)) {
+		return -EIO;
+	}
+	shrink_blocks(ino, 0);
+	ino->inlined = 1;
+	ino->size = len;
+	return 0;
+}
+
+static int prepare_write(blkno_t inoden, size_t size, off_t offset)
+{
+	// allocate the blocks under [offset, offset + size) and clear any gap after the old end.
+	// on success the file is left locked exclusive
+	int res = 0, need;
+	struct inode *ino;
+
+	if (inoden == STATS_INODE) {
+		return -EACCES;
+	}
+	if (offset + size > MAX_FILE_SIZE) {
+		return -EFBIG;
+	}
+	ino = lock_inode(inoden, 1);
+	if (ino == NULL) {
+		return -ENOENT;
+	}
+	need = (offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (ino->inlined && offset + size > INLINE_MAX) {
+		res = inline_to_blocks(ino, inoden, need);
+	}
+	else if (!ino->inlined && need > file_blocks(ino)) {
+		// new data blocks continue the last extent where the free space allows
+		res = grow_blocks(ino, need - file_blocks(ino));
+	}
+	if (res == 0 && offset > ino->size) {
+		res = ino->inlined ? zero_inline(inoden, ino->size, offset - ino->size)
+		                   : zero_range(ino, ino->size, offset - ino->size);
+	}
+	if (res != 0) {
+		unlock_inode(inoden);
+	}
+	return res;
+}
+
+static int finish_write(blkno_t inoden, size_t size, off_t offset, int res)
+{
+	// record the new size and drop the lock prepare_write took
+	struct inode *ino = get_inode(inoden);
+	if (res == 0) {
+		if (offset + size > ino->size) {
+			ino->size = offset + size;
+		}
+		ino->mtime = (int) time(NULL);
+		write_inode(ino, inoden);
+	}
+	unlock_inode(inoden);
+	return res != 0 ? res : (int) size;
+}
+
+static int write_file(blkno_t inoden, const char* buf, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+	// copy each contiguous run into the block cache, it is written back later
+	size_t done, len;
+	off_t diskpos;
+	int res = prepare_write(inoden, size, offset);
+
+	if (res != 0) {
+		return res;
+	}
+	if (get_inode(inoden)->inlined) {
+		// inline bytes are part of the inode record, and journaled with it
+		res = write_block(INODE_BLOCK(inoden), buf, size, INLINE_POS(inoden) + offset) == size ? 0 : -EIO;
+		return finish_write(inoden, size, offset, res);
+	}
+	for (done = 0; res == 0 && done < size; done += len) {
+		res = next_run(get_inode(inoden), offset + done, size - done, &diskpos, &len, file_cursor(fi));
+		if (res == 0 && write_data_block(diskpos / BLOCK_SIZE, buf + done, len, diskpos % BLOCK_SIZE) != len) {
+			res = -EIO;
+		}
+	}
+	return finish_write(inoden, size, offset, res);	
+}            
+
+static int do_write(const char* path, const char* buf, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+	blkno_t inoden = file_inode(path, fi);
+	return inoden < 0 ? inoden : write_file(inoden, buf, size, offset, fi);
+}
+
+static int write_file_buf(blkno_t inoden, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi)
+{
+	// copy from the kernel's buffers straight into the image, libfuse splices when it can.
+	// bulk data goes around the block cache, so cached copies of the target blocks are dropped;
+	// a run with one that stays cached is copied in memory and written through the cache
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(0), mem = FUSE_BUFVEC_INIT(0);
+	size_t done, len, size = fuse_buf_size(buf);
+	ssize_t n;
+	off_t diskpos;
+	char data[INLINE_BUF];
+	int res = prepare_write(inoden, size, offset);
+
+	if (res != 0) {
+		return res;
+	}
+	if (get_inode(inoden)->inlined) {
+		// an inline file still fits in its inode record, which goes through the cache
+		dst.buf[0].size = size;
+		dst.buf[0].mem = data;
+		n = fuse_buf_copy(&dst, buf, 0);
+		if (n < 0) {
+			res = n;
+		}
+		else if (n != size || write_block(INODE_BLOCK(inoden), data, size, INLINE_POS(inoden) + offset) != size) {
+			res = -EIO;
+		}
+		return finish_write(inoden, size, offset, res);
+	}
+	dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	dst.buf[0].fd = fusefd;
+	for (done = 0; res == 0 && done < size; done += len) {
+		res = next_run(get_inode(inoden), offset + done, size - done, &diskpos, &len, file_cursor(fi));
+		if (res != 0) {
+			break;
+		}
+		if (bcache_drop(diskpos / BLOCK_SIZE, (diskpos % BLOCK_SIZE + len + BLOCK_SIZE - 1) / BLOCK_SIZE) != 0) {
+			mem.idx = 0;
+			mem.off = 0;
+			mem.buf[0].size = len;
+			mem.buf[0].mem = malloc(len);
+			if (mem.buf[0].mem == NULL) {
+				res = -ENOMEM;
+				break;
+			}
+			n = fuse_buf_copy(&mem, buf, 0);
+			if (n < 0) {
+				res = n;
+			}
+			else if (n != len || write_data_block(diskpos / BLOCK_SIZE, mem.buf[0].mem, len, 
+			                                      diskpos % BLOCK_SIZE) != len) {
+				res = -EIO;
+			}
+			free(mem.buf[0].mem);
+			continue;
+		}
+		dst.idx = 0;
+		dst.off = 0;
+		dst.buf[0].size = len;
+		dst.buf[0].pos = diskpos;
+		n = fuse_buf_copy(&dst, buf, 0);
+		if (n < 0) {
+			res = n;
+		}
+		else if (n != len) {
+			res = -EIO;
+		}
+	}
+	return finish_write(inoden, size, offset, res);
+}
+
+int mkfs(blkno_t nblocks, blkno_t ninodes, int maxname)
+{	
+	// format the image: superblock, free list, inode table and an empty root directory.
+	// block 1 on holds the free list bitmap, then the journal, sized to the device, then the
+	// inode bitmap and the inode table, sized to ninodes. the root is inode 1
+	struct inode *root;
+	blkno_t mapblocks = ((nblocks + 63) / 64 * sizeof(uint64_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	blkno_t logblocks = nblocks / 1024;
+	blkno_t imapblocks = ((ninodes + 1 + 63) / 64 * sizeof(uint64_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	blkno_t tableblocks = (ninodes + 1 + BLOCK_SIZE / INODE_SIZE - 1) / (BLOCK_SIZE / INODE_SIZE);
+	blkno_t i;
+
+	if (logblocks < LOG_MIN_BLOCKS) {
+		logblocks = LOG_MIN_BLOCKS;
+	}
+	if (logblocks > LOG_MAX_BLOCKS) {
+		logblocks = LOG_MAX_BLOCKS;
+	}
+	if (nblocks < MIN_BLOCKS || ninodes < 1 || ninodes > MAX_INODES 
+	    || nblocks < mapblocks + logblocks + imapblocks + tableblocks + MIN_BLOCKS 
+	    || maxname < 1 || maxname > MAX_NAME_LEN) {
+		errno = EINVAL;
+		return -1;
+	}
+	// init Superblock
+	Superblock.version = VFS_VERSION;
+	Superblock.creationTime = (int) time(NULL);
+	Superblock.mounted = 50;
+	Superblock.devId = 20;
+	Superblock.freeStart = 1;
+	Superblock.freeEnd = mapblocks + logblocks + 1;
+	Superblock.imapStart = Superblock.freeEnd + 1;
+	Superblock.itableStart = Superblock.imapStart + imapblocks;
+	Superblock.dataStart = Superblock.itableStart + tableblocks;
+	Superblock.inodeSize = INODE_SIZE;
+	Superblock.root = 1;
+	Superblock.maxBlocks = nblocks;
+	Superblock.freeblocks = nblocks - Superblock.dataStart;
+	Superblock.maxInodes = ninodes;
+	Superblock.freeinodes = ninodes;
+	Superblock.maxName = maxname;
+	Superblock.clean = 1;
+	if (alloc_tables() != 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+	// the image starts out as one hole, blocks nobody wrote read back as zeros
+	if (ftruncate(fusefd, 0) != 0 || ftruncate(fusefd, (off_t) nblocks * BLOCK_SIZE) != 0) {
+		return -1;
+	}
+	initial_freeblock();
+
+	// inodes 1 to ninodes are free, the table itself is left a hole of zeros
+	for (i = 1; i <= ninodes; i++) {
+		imap[i / 64] |= (uint64_t) 1 << (i % 64);
+	}
+	for (i = 0; i < IMAP_WORDS; i++) {
+		write_imap(i);
+	}
+	
+	// init root inode, its first bucket is the first free block
+	if (alloc_inode() != Superblock.root) {
+		errno = EIO;
+		return -1;
+	}
+	root = new_inode(Superblock.root);
+	if (root == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	root->size = BLOCK_SIZE;
+	root->uid = 1;
+	root->gid = 1;
+	root->mode = 16877;
+	root->atime = (int) time(NULL);
+	root->ctime = (int) time(NULL);
+	root->mtime = (int) time(NULL);
+	root->linkcount = 2;
+	root->location = find_first_freeblock();
+	root->parent = Superblock.root;
+	add_extent(root, root->location, 1);
+	dir_init_block(root->location);
+	write_inode(root, Superblock.root);
+	write_superblock();
+
+	// start with an empty journal
+	log_init();
+	journal.head = journal.tail = 0;
+	journal.damaged = 0;
+	return log_checkpoint();
+}
+
+static void* vfs_init(struct fuse_conn_info *conn)
+{	
+	// the superblock stays marked dirty until a clean unmount, and that has to reach the image now
+	Superblock.clean = 0;
+	write_superblock();
+	pthread_mutex_lock(&block_lock);
+	bcache_flush(0, 1, &bstat.syncflush);
+	pthread_mutex_unlock(&block_lock);
+
+	// threads started before the mount daemonizes would not survive the fork, so start it here
+	flusher_running = pthread_create(&flusher, NULL, bcache_flusher, NULL) == 0;
+
+	(void) conn;
+	return 0;
+}
+
+static int is_ancestor(blkno_t a, blkno_t d)
+{
+	// whether directory a is d or one above it. the walk gives up at a directory removed
+	// meanwhile, the caller finds that out when it locks it
+	blkno_t p;
+	for (p = d; p > 0 && p < INODE_LIMIT && p != Superblock.root && get_inode(p)->linkcount > 0; 
+	     p = get_inode(p)->parent) {
+		if (p == a) {
+			return 1;
+		}
+	}
+	return a == Superblock.root;
+}
+
+static blkno_t move_entry(blkno_t from_parent_inode, const char *from_name, blkno_t to_parent_inode, 
+                          const char *to_name)
+{
+	// the rename itself, called with both parents locked. returns the inode moved
+	int res, isFile = 1;
+	struct inode *ino;
+	blkno_t from_inode = dir_lookup(from_parent_inode, from_name, strlen(from_name));
+
+	if (from_inode < 0) {
+		return from_inode;
+	}
+	// a name always leads to a live inode, so one that reads as removed could not be read
+	if (get_inode(from_inode) == &dead_inode) {
+		return -EIO;
+	}
+	if (S_ISDIR(get_inode(from_inode)->mode)) {
+		isFile = 0;
+		// a directory cannot move below itself
+		if (is_ancestor(from_inode, to_parent_inode)) {
+			return -EINVAL;
+		}
+		lock_inode(from_inode, 1);
+	}
+
+	// add the new name first, it fails if the target exists
+	if (isFile == 0) {
+		get_inode(to_parent_inode)->linkcount++;
+	}
+	res = dir_add(to_parent_inode, to_name, strlen(to_name), from_inode, isFile ? 'f' : 'd');
+	if (res != 0) {
+		if (isFile == 0) {
+			get_inode(to_parent_inode)->linkcount--;
+			unlock_inode(from_inode);
+		}
+		return res;
+	}
+	
+	// modify from inode if it is a directory
+	if (isFile == 0) {
+		ino = get_inode(from_inode);
+		ino->parent = to_parent_inode;
+		write_inode(ino, from_inode);
+		get_inode(from_parent_inode)->linkcount--;
+	}
+	// an old name that cannot be read back out keeps the file where it was
+	res = dir_remove(from_parent_inode, from_name, strlen(from_name));
+	if (res < 0) {
+		if (isFile == 0) {
+			ino->parent = from_parent_inode;
+			write_inode(ino, from_inode);
+			get_inode(from_parent_inode)->linkcount++;
+			get_inode(to_parent_inode)->linkcount--;
+			unlock_inode(from_inode);
+		}
+		dir_remove(to_parent_inode, to_name, strlen(to_name));
+		return res;
 	}
-	else {
-		int idxblockn = block[inoden].location;
-		FILE *fp;
-		sprintf(filename, "%s%d", fusedata, idxblockn);
-		fp = fopen(filename, "r");
-		char blocklist_info[1700];
-		memset(blocklist_info, '\0', sizeof(blocklist_info));
-		r = fread(blocklist_info, 1, 1700, fp);
-		fclose(fp);
-
-		lastfileblockn = blocklist(blocklist_info, 1);
-		blocktaken = blocklist(blocklist_info, 2);
-	}
-
-	sprintf(filename, "%s%d", fusedata, lastfileblockn);
-	FILE *fp;
-	fp = fopen(filename, "r");
-	char lastfile_cont[4097];
-	memset(lastfile_cont, '\0', sizeof(lastfile_cont));
-
-	r = fread(lastfile_cont, 1, 4096, fp);
-	fclose(fp);
-	
-	char filecontent[100000];
-	char buff[100000];
-	strcpy(buff, buf);
-	buff[size] = '\0';
 
-	strcpy(filecontent, lastfile_cont);
-	strcat(filecontent, buff);
-	
-	int content_len = strlen(filecontent);
-	
-	int newblock_num = (content_len + (BLOCK_SIZE - 1)) / BLOCK_SIZE - 1;
+	if (isFile == 0) {
+		unlock_inode(from_inode);
+	}
+	dcache_update(from_parent_inode, from_name, 0);
+	dcache_update(to_parent_inode, to_name, from_inode);
+	return from_inode;
+}
+
+static int rename_entry(blkno_t from_parent_inode, const char *from_name, blkno_t to_parent_inode, 
+                        const char *to_name)
+{
+	blkno_t res, first, second;
+
+	if (is_stats_name(from_parent_inode, from_name) || is_stats_name(to_parent_inode, to_name)) {
+		return -EPERM;
+	}
+
+	// two parents are locked the ancestor first, otherwise the lower inode first. a move between
+	// directories holds rename_lock throughout, so no other move reshapes the tree meanwhile
+	first = from_parent_inode;
+	second = to_parent_inode;
+	if (first != second) {
+		pthread_mutex_lock(&rename_lock);
+		if (is_ancestor(second, first) || (!is_ancestor(first, second) && second < first)) {
+			first = to_parent_inode;
+			second = from_parent_inode;
+		}
+	}
+	if (lock_dir(first) == NULL) {
+		res = -ENOENT;
+	}
+	else if (second != first && lock_dir(second) == NULL) {
+		unlock_inode(first);
+		res = -ENOENT;
+	}
+	else {
+		res = move_entry(from_parent_inode, from_name, to_parent_inode, to_name);
+		if (second != first) {
+			unlock_inode(second);
+		}
+		unlock_inode(first);
+	}
+	if (second != first) {
+		pthread_mutex_unlock(&rename_lock);
+	}
+	return res < 0 ? res : 0;
+}
+
+static int link_entry(blkno_t from_inode, blkno_t to_parent_inode, const char *to_name, struct stat *entry)
+{
+	// a new name for from_inode, and the kernel's entry for it if it asked
+	int res;
+	struct inode *ino;
+	if (from_inode == STATS_INODE) {
+		return -EPERM;
+	}
+	if (is_stats_name(to_parent_inode, to_name)) {
+		return -EEXIST;
+	}
+	// checked before locking too: a directory may sit above the parent
+	if (S_ISDIR(get_inode(from_inode)->mode)) {
+		return -EPERM;
+	}
+
+	if (lock_dir(to_parent_inode) == NULL) {
+		return -ENOENT;
+	}
+	ino = lock_inode(from_inode, 1);
+	if (ino == NULL || ino->linkcount == 0) {
+		res = -ENOENT;
+	}
+	else if (S_ISDIR(ino->mode)) {
+		res = -EPERM;
+	}
+	else {
+		res = dir_add(to_parent_inode, to_name, strlen(to_name), from_inode, 'f');
+	}
+	if (res == 0) {
+		ino->linkcount++;
+		write_inode(ino, from_inode);
+		dcache_update(to_parent_inode, to_name, from_inode);
+	}
+	if (ino != NULL) {
+		unlock_inode(from_inode);
+	}
+	if (res == 0) {
+		entry_ref(from_inode, entry);
+	}
+	unlock_inode(to_parent_inode);
+
+	return res;	
+}
+
+static int do_link(const char* from, const char* to)
+{
+	blkno_t to_parent_inode = find_parent_inode(to);
+	blkno_t from_inode = path_inode(from);
+	if (from_inode < 0) {
+		return from_inode;
+	}
+	if (to_parent_inode < 0) {
+		return to_parent_inode;
+	}
+	return link_entry(from_inode, to_parent_inode, split_to_name(to), NULL);
+}
+
+static int unlink_entry(blkno_t parent_inoden, const char *name)
+{
+	// a file whose last name goes is removed, unless the kernel still holds it
+	struct inode *ino;
+	blkno_t inoden, res;
+
+	if (is_stats_name(parent_inoden, name)) {
+		return -EPERM;
+	}
+	if (lock_dir(parent_inoden) == NULL) {
+		return -ENOENT;
+	}
+	// the file is locked before its name goes, so one that cannot be read keeps it
+	inoden = dir_lookup(parent_inoden, name, strlen(name));
+	if (inoden < 0 || (ino = lock_inode(inoden, 1)) == NULL) {
+		unlock_inode(parent_inoden);
+		return inoden < 0 ? inoden : -ENOENT;
+	}
+	res = dir_remove(parent_inoden, name, strlen(name));
+	if (res >= 0) {
+		ino->linkcount--;
+		if (ino->linkcount == 0 && __atomic_load_n(&ino->nlookup, __ATOMIC_SEQ_CST) == 0) {
+			remove_file(inoden);	
+		}
+		else {
+			write_inode(ino, inoden);
+		}
+		dcache_update(parent_inoden, name, 0);
+	}
+	unlock_inode(inoden);
+	unlock_inode(parent_inoden);
+
+	return res < 0 ? res : 0;
+}
+
+static int rmdir_entry(blkno_t parent_inoden, const char *name)
+{
+	int res = 0;
+	blkno_t inode;
+	struct inode *ino, *parent;
+
+	if (is_stats_name(parent_inoden, name)) {
+		return -ENOTDIR;
+	}
+	if ((parent = lock_dir(parent_inoden)) == NULL) {
+		return -ENOENT;
+	}
+	inode = dir_lookup(parent_inoden, name, strlen(name));
+	if (inode < 0 || (ino = lock_inode(inode, 1)) == NULL) {
+		unlock_inode(parent_inoden);
+		return inode < 0 ? inode : -ENOENT;
+	}
+	// only an empty directory goes, so no cached name below it can be positive
+	if (!S_ISDIR(ino->mode)) {
+		res = -ENOTDIR;
+	}
+	else if (ino->subn > 0) {
+		res = -ENOTEMPTY;
+	}
+	else {
+		// the parent's count goes down first, dir_remove writes the parent out
+		parent->linkcount--;
+		res = dir_remove(parent_inoden, name, strlen(name));
+		if (res < 0) {
+			parent->linkcount++;
+		}
+		else {
+			res = 0;
+			ino->linkcount = 0;
+			if (__atomic_load_n(&ino->nlookup, __ATOMIC_SEQ_CST) == 0) {
+				remove_file(inode);
+			}
+			else {
+				write_inode(ino, inode);
+			}
+			dcache_update(parent_inoden, name, 0);
+		}
+	}
+	unlock_inode(inode);
+	unlock_inode(parent_inoden);
+	return res;
+}
+
+static int do_statfs(const char* path, struct statvfs* stbuf)
+{
+	stbuf->f_bsize = BLOCK_SIZE;
+	stbuf->f_frsize = BLOCK_SIZE;
+	stbuf->f_blocks = Superblock.maxBlocks;
+	stbuf->f_bfree = Superblock.freeblocks;
+	stbuf->f_bavail = Superblock.freeblocks;
+	stbuf->f_files = Superblock.maxInodes;
+	stbuf->f_ffree = Superblock.freeinodes;
+	stbuf->f_favail = Superblock.freeinodes;
+	stbuf->f_fsid = 2970;
+	stbuf->f_flag = 0;
+	stbuf->f_namemax = Superblock.maxName;
+
+	(void) path;
+	return 0;
+}
+
+static void reap_orphans(void)
+{
+	// the kernel need not forget every inode before unmount, orphans it still held go now
+	blkno_t n;
+	struct inode *ino;
+	log_begin();
+	for (n = 0; n < INODE_LIMIT; n++) {
+		if (itable[n / ITABLE_PAGE] == NULL) {
+			n += ITABLE_PAGE - 1 - n % ITABLE_PAGE;
+			continue;
+		}
+		ino = itable[n / ITABLE_PAGE]->ino[n % ITABLE_PAGE];
+		if (ino != NULL && ino != &dead_inode && ino->linkcount == 0) {
+			remove_file(n);
+		}
+	}
+	log_end();
+}
 
-	if (newblock_num + blocktaken > MAX_FILE_BLOCK) {
+static void vfs_destroy(void * fs_data)
+{
+	(void) fs_data;
+	if (flusher_running == 1) {
+		pthread_mutex_lock(&block_lock);
+		flusher_running = 0;
+		pthread_cond_signal(&flush_cond);
+		pthread_mutex_unlock(&block_lock);
+		pthread_join(flusher, NULL);
+	}
+	reap_orphans();
+	// commit what is left, then checkpoint so the next mount finds an empty journal
+	log_commit();
+	Superblock.clean = 1;
+	write_superblock();
+	log_checkpoint();
+	bcache_report();
+	fsync(fusefd);
+	close(fusefd);
+}
+
+static int truncate_file(blkno_t inoden, off_t size)
+{
+	// keep the blocks under [0, size). a file cut to INLINE_MAX bytes or less moves back
+	// into its inode record, one grown past it moves out
+	int res = 0, nblocks;
+	struct inode *ino;
+
+	if (inoden == STATS_INODE) {
+		return -EACCES;
+	}
+	if (size > MAX_FILE_SIZE) {
 		return -EFBIG;
 	}
+	ino = lock_inode(inoden, 1);
+	if (ino == NULL) {
+		return -ENOENT;
+	}
+	nblocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (!ino->inlined && size <= INLINE_MAX) {
+		res = blocks_to_inline(ino, inoden, size);
+	}
+	else if (ino->inlined && size > INLINE_MAX) {
+		res = inline_to_blocks(ino, inoden, nblocks);
+	}
+	else if (!ino->inlined && nblocks < file_blocks(ino)) {
+		shrink_blocks(ino, nblocks);
+	}
+	else if (!ino->inlined && nblocks > file_blocks(ino)) {
+		res = grow_blocks(ino, nblocks - file_blocks(ino));
+	}
+	if (res == 0 && size > ino->size) {
+		res = ino->inlined ? zero_inline(inoden, ino->size, size - ino->size)
+		                   : zero_range(ino, ino->size, size - ino->size);
+	}
+	
+	if (res == 0) {
+		ino->size = size;
+		ino->mtime = (int) time(NULL);
+		write_inode(ino, inoden);
+	}
+	unlock_inode(inoden);
+	return res;
+}
+
+static int setattr_inode(blkno_t inoden, struct stat *attr, int to_set, struct stat *stbuf)
+{
+	// only a new size is kept, as chmod, chown and utimens keep nothing
+	int res = 0;
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		res = truncate_file(inoden, attr->st_size);
+	}
+	return res != 0 ? res : stat_inode(inoden, stbuf, 0);
+}
+
+
+// every handler is counted and timed for /.vfsstats, op_begin also charges the image I/O
+// done until op_end to it.
+// each operation that changes metadata is one handle on the running journal transaction
+
+static int vfs_release(const char *path, struct fuse_file_info *fi)
+{
+	int64_t start = op_begin(OP_RELEASE);
+	return op_end(OP_RELEASE, start, do_release(path, fi), 0);
+}
+
+
+static int vfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	int64_t start = op_begin(OP_CREATE);
+	int res;
+	log_begin();
+	res = do_create(path, mode, fi);
+	log_end();
+	return op_end(OP_CREATE, start, res, 0);
+}
+
+
+static int vfs_mkdir(const char *path, mode_t mode)
+{
+	int64_t start = op_begin(OP_MKDIR);
+	int res;
+	log_begin();
+	res = do_mkdir(path, mode);
+	log_end();
+	return op_end(OP_MKDIR, start, res, 0);
+}
+
+
+static int vfs_link(const char* from, const char* to)
+{
+	int64_t start = op_begin(OP_LINK);
+	int res;
+	log_begin();
+	res = do_link(from, to);
+	log_end();
+	return op_end(OP_LINK, start, res, 0);
+}
+
+
+static int vfs_write(const char* path, const char* buf, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+	int64_t start = op_begin(OP_WRITE);
+	int res;
+	log_begin();
+	res = do_write(path, buf, size, offset, fi);
+	log_end();
+	return op_end(OP_WRITE, start, res, res > 0 ? res : 0);
+}
+
+
+// the mount is served through libfuse's low-level API: the kernel names inodes by number and
+// looks names up one directory at a time, so no handler walks a path and repeated lookups never
+// get here. every entry it is given is counted until it forgets it
+
+static void entry_param(struct fuse_entry_param *e, const struct stat *st)
+{
+	// the kernel's entry for st, or a negative one for a name that does not exist
+	double timeout = st != NULL && st->st_ino == FUSE_INO(STATS_INODE) ? 0 : ENTRY_TIMEOUT;
+	memset(e, 0, sizeof(*e));
+	if (st != NULL) {
+		e->ino = st->st_ino;
+		e->attr = *st;
+		e->attr_timeout = timeout == 0 ? 0 : ATTR_TIMEOUT;
+	}
+	e->entry_timeout = timeout;
+}
+
+static void reply_entry(fuse_req_t req, int res, const struct stat *st)
+{
+	struct fuse_entry_param e;
+	if (res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	entry_param(&e, st);
+	fuse_reply_entry(req, &e);
+}
+
+static void reply_attr(fuse_req_t req, int res, const struct stat *st)
+{
+	if (res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	fuse_reply_attr(req, st, st->st_ino == FUSE_INO(STATS_INODE) ? 0 : ATTR_TIMEOUT);
+}
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	(void) userdata;
+	vfs_init(conn);
+}
+
+static void ll_destroy(void *userdata)
+{
+	vfs_destroy(userdata);
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	int64_t start = op_begin(OP_LOOKUP);
+	struct stat st;
+	int res = op_end(OP_LOOKUP, start, lookup_entry(INODE_NUM(parent), name, &st), 0);
+	if (res == -ENOENT) {
+		reply_entry(req, 0, NULL);
+		return;
+	}
+	reply_entry(req, res, &st);
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	int64_t start = op_begin(OP_FORGET);
+	forget_inode(INODE_NUM(ino), nlookup);
+	op_end(OP_FORGET, start, 0, 0);
+	fuse_reply_none(req);
+}
+
+static void ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	int64_t start = op_begin(OP_FORGET);
+	size_t i;
+	for (i = 0; i < count; i++) {
+		forget_inode(INODE_NUM(forgets[i].ino), forgets[i].nlookup);
+	}
+	op_end(OP_FORGET, start, 0, 0);
+	fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	int64_t start = op_begin(OP_GETATTR);
+	struct stat st;
+	(void) fi;
+	reply_attr(req, op_end(OP_GETATTR, start, stat_inode(INODE_NUM(ino), &st, 0), 0), &st);
+}
+
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, 
+                       struct fuse_file_info *fi)
+{
+	int64_t start = op_begin(OP_SETATTR);
+	struct stat st;
+	int res;
+	(void) fi;
+	log_begin();
+	res = setattr_inode(INODE_NUM(ino), attr, to_set, &st);
+	log_end();
+	reply_attr(req, op_end(OP_SETATTR, start, res, 0), &st);
+}
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	int64_t start = op_begin(OP_OPENDIR);
+	int res = op_end(OP_OPENDIR, start, open_dir(INODE_NUM(ino), fi), 0);
+	if (res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	fuse_reply_open(req, fi);
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	int64_t start = op_begin(OP_READDIR);
+	char *buf = malloc(size);
+	int res = buf == NULL ? -ENOMEM : read_dir(req, INODE_NUM(ino), size, off, fi, buf);
+	res = op_end(OP_READDIR, start, res, 0);
+	if (res < 0) {
+		fuse_reply_err(req, -res);
+	}
+	else {
+		fuse_reply_buf(req, buf, res);
+	}
+	free(buf);
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	int64_t start = op_begin(OP_RELEASEDIR);
+	(void) ino;
+	release_dir(fi);
+	fuse_reply_err(req, -op_end(OP_RELEASEDIR, start, 0, 0));
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	int64_t start = op_begin(OP_OPEN);
+	int res = op_end(OP_OPEN, start, open_file(INODE_NUM(ino), fi), 0);
+	if (res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	fuse_reply_open(req, fi);
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	int64_t start = op_begin(OP_RELEASE);
+	fuse_reply_err(req, -op_end(OP_RELEASE, start, release_file(fi), 0));
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	int64_t start = op_begin(OP_FLUSH);
+	(void) ino;
+	fuse_reply_err(req, -op_end(OP_FLUSH, start, do_flush(NULL, fi), 0));
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+	int64_t start = op_begin(OP_FSYNC);
+	(void) ino;
+	fuse_reply_err(req, -op_end(OP_FSYNC, start, do_fsync(NULL, datasync, fi), 0));
+}
+
+static void ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+	int64_t start = op_begin(OP_FSYNCDIR);
+	(void) ino;
+	fuse_reply_err(req, -op_end(OP_FSYNCDIR, start, do_fsyncdir(NULL, datasync, fi), 0));
+}
+
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	int64_t start = op_begin(OP_STATFS);
+	struct statvfs st;
+	(void) ino;
+	op_end(OP_STATFS, start, do_statfs(NULL, &st), 0);
+	fuse_reply_statfs(req, &st);
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	int64_t start = op_begin(OP_READ_BUF);
+	struct fuse_bufvec *bv = NULL;
+	int res = read_file_buf(INODE_NUM(ino), &bv, size, off, fi);
+	op_end(OP_READ_BUF, start, res, res == 0 ? fuse_buf_size(bv) : 0);
+	if (res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	fuse_reply_data(req, bv, FUSE_BUF_SPLICE_MOVE);
+	put_file_buf(INODE_NUM(ino), bv);
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, 
+                      struct fuse_file_info *fi)
+{
+	int64_t start = op_begin(OP_CREATE);
+	struct fuse_entry_param e;
+	struct stat st;
+	blkno_t res;
+	int ret;
+	(void) mode;
+	log_begin();
+	res = make_file(INODE_NUM(parent), name, &st);
+	if (res >= 0 && (ret = open_file(res, fi)) != 0) {
+		// the kernel never hears of the file, so it drops the reference lookup would have
+		forget_inode(res, 1);
+		res = ret;
+	}
+	log_end();
+	if (op_end(OP_CREATE, start, res < 0 ? res : 0, 0) < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	entry_param(&e, &st);
+	fuse_reply_create(req, &e, fi);
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	int64_t start = op_begin(OP_MKDIR);
+	struct stat st;
+	blkno_t res;
+	(void) mode;
+	log_begin();
+	res = make_dir(INODE_NUM(parent), name, &st);
+	log_end();
+	reply_entry(req, op_end(OP_MKDIR, start, res < 0 ? res : 0, 0), &st);
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	int64_t start = op_begin(OP_RMDIR);
+	int res;
+	log_begin();
+	res = rmdir_entry(INODE_NUM(parent), name);
+	log_end();
+	fuse_reply_err(req, -op_end(OP_RMDIR, start, res, 0));
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	int64_t start = op_begin(OP_UNLINK);
+	int res;
+	log_begin();
+	res = unlink_entry(INODE_NUM(parent), name);
+	log_end();
+	fuse_reply_err(req, -op_end(OP_UNLINK, start, res, 0));
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, 
+                      const char *newname)
+{
+	int64_t start = op_begin(OP_RENAME);
+	int res;
+	log_begin();
+	res = rename_entry(INODE_NUM(parent), name, INODE_NUM(newparent), newname);
+	log_end();
+	fuse_reply_err(req, -op_end(OP_RENAME, start, res, 0));
+}
+
+static void ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname)
+{
+	int64_t start = op_begin(OP_LINK);
+	struct stat st;
+	int res;
+	log_begin();
+	res = link_entry(INODE_NUM(ino), INODE_NUM(newparent), newname, &st);
+	log_end();
+	reply_entry(req, op_end(OP_LINK, start, res, 0), &st);
+}
+
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, 
+                     struct fuse_file_info *fi)
+{
+	int64_t start = op_begin(OP_WRITE);
+	int res;
+	log_begin();
+	res = write_file(INODE_NUM(ino), buf, size, off, fi);
+	log_end();
+	res = op_end(OP_WRITE, start, res, res > 0 ? res : 0);
+	if (res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	fuse_reply_write(req, res);
+}
+
+static void ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, 
+                         struct fuse_file_info *fi)
+{
+	int64_t start = op_begin(OP_WRITE_BUF);
+	int res;
+	log_begin();
+	res = write_file_buf(INODE_NUM(ino), bufv, off, fi);
+	log_end();
+	res = op_end(OP_WRITE_BUF, start, res, res > 0 ? res : 0);
+	if (res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	fuse_reply_write(req, res);
+}
+
+static struct fuse_lowlevel_ops vfs_ll_oper = {
+	.init         = ll_init,
+	.destroy      = ll_destroy,
+	.lookup       = ll_lookup,
+	.forget       = ll_forget,
+	.forget_multi = ll_forget_multi,
+	.getattr      = ll_getattr,
+	.setattr      = ll_setattr,
+	.opendir      = ll_opendir,
+	.readdir      = ll_readdir,
+	.releasedir   = ll_releasedir,
+	.open         = ll_open,
+	.read         = ll_read,
+	.release      = ll_release,
+	.flush        = ll_flush,
+	.fsync        = ll_fsync,
+	.fsyncdir     = ll_fsyncdir,
+	.statfs       = ll_statfs,
+	.create       = ll_create,
+	.mkdir        = ll_mkdir,
+	.rmdir        = ll_rmdir,
+	.unlink       = ll_unlink,
+	.rename       = ll_rename,
+	.link         = ll_link,
+	.write        = ll_write,
+	.write_buf    = ll_write_buf,
+};
+
+// one-shot conversion from the original text format, see convert_text_image.
+// text images had a fixed geometry
+#define TEXT_BLOCK_NUM 10000
+#define TEXT_FILE_BLOCK 400
+static char *oldimage;
+static char *oldpath[TEXT_BLOCK_NUM];
+
+static int convert_file(int oldblock, const char *path)
+{
+	int i, n, res, off = 0, len;
+	int size, uid, gid, mode, linkcount, atime, ctime, mtime, indirect, location;
+	blkno_t blockn;
+	int blocks[TEXT_FILE_BLOCK];
+	int nblocks = 0;
+	struct inode *ino;
+	struct fuse_file_info fi;
+	char chunk[BLOCK_SIZE + 1];
+	char *p = oldimage + (size_t) oldblock * BLOCK_SIZE;
 
-	if (content_len < 4096) {
-		write_file(lastfileblockn, filecontent, 0, content_len - 1);
+	// a second name for an inode already converted is a hard link
+	if (oldpath[oldblock] != NULL) {
+		return vfs_link(oldpath[oldblock], path);
+	}
+	if (sscanf(p, "{size:%d, uid:%d, gid:%d, mode:%d, linkcount:%d, atime:%d, ctime:%d, mtime:%d, "
+	           "indirect:%d location:%d}", &size, &uid, &gid, &mode, &linkcount, &atime, &ctime, &mtime, 
+	           &indirect, &location) != 10) {
+		fprintf(stderr, "block %d: not a text file inode\n", oldblock);
+		return -EIO;
+	}
+	// written through an open handle, as a copy through the mount would be
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = O_WRONLY;
+	res = vfs_create(path, mode, &fi);
+	if (res != 0) {
+		return res;
+	}
+	oldpath[oldblock] = strdup(path);
 
+	if (indirect == 0) {
+		blocks[nblocks++] = location;
 	}
 	else {
-		write_file(lastfileblockn, filecontent, 0, 4095);
+		p = oldimage + (size_t) location * BLOCK_SIZE;
+		while (nblocks < TEXT_FILE_BLOCK && sscanf(p, " %d,%n", &blocks[nblocks], &n) == 1) {
+			nblocks++;
+			p += n;
+		}
+	}
+	for (i = 0; res >= 0 && i < nblocks && off < size; i++) {
+		len = size - off < BLOCK_SIZE ? size - off : BLOCK_SIZE;
+		memcpy(chunk, oldimage + (size_t) blocks[i] * BLOCK_SIZE, len);
+		chunk[len] = '\0';
+		res = vfs_write(path, chunk, len, off, &fi);
+		off += len;
+	}
+	vfs_release(path, &fi);
+	if (res < 0) {
+		return res;
 	}
 
-	if (newblock_num > 0) {
-		for (i = 1; i <= newblock_num; i++) {
-			firstblock = find_first_freeblock();
-			if (firstblock == -1) {
-				return -ENOSPC;
-			}
-			newblock[i - 1] = firstblock;
-			empty_file(firstblock);
-			if (4096 * (i + 1) - 1 > content_len) {
-				write_file(firstblock, filecontent, 4096 * i, content_len - 1);
+	blockn = split_to_blockn(path, 0);
+	ino = get_inode(blockn);
+	ino->uid = uid;
+	ino->gid = gid;
+	ino->atime = atime;
+	ino->ctime = ctime;
+	ino->mtime = mtime;
+	write_inode(ino, blockn);
+	return 0;
+}
+
+static int convert_dir(int oldblock, const char *path)
+{
+	int n, res, child;
+	int size, uid, gid, mode, atime, ctime, mtime, linkcount;
+	blkno_t blockn;
+	char type, name[MAX_NAME_LEN], childpath[MAX_PATH_LEN];
+	struct inode *ino;
+	char *p = oldimage + (size_t) oldblock * BLOCK_SIZE;
+
+	if (sscanf(p, "{size:%d, uid:%d, gid:%d, mode:%d, atime:%d, ctime:%d, mtime:%d, linkcount:%d, "
+	           "filename_to_inode_dict: {%n", &size, &uid, &gid, &mode, &atime, &ctime, &mtime, 
+	           &linkcount, &n) != 8) {
+		fprintf(stderr, "block %d: not a text directory inode\n", oldblock);
+		return -EIO;
+	}
+	p += n;
+	while (sscanf(p, "%c:%49[^:]:%d%n", &type, name, &child, &n) == 3) {
+		p += n;
+		if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+			snprintf(childpath, sizeof(childpath), "%s/%s", path, name);
+			if (type == 'd') {
+				res = vfs_mkdir(childpath, 0);
+				if (res == 0) {
+					res = convert_dir(child, childpath);
+				}
 			}
 			else {
-			write_file(firstblock, filecontent, 4096 * i, 4096 * (i + 1) - 1);
-			}
-		}
-		if (block[inoden].indirect == 0) {
-			firstblock = find_first_freeblock();
-			if (firstblock == -1) {
-				return -ENOSPC;
+				res = convert_file(child, childpath);
 			}
-			block[inoden].indirect = 1;
-			int originalocation = block[inoden].location;
-			block[inoden].location = firstblock;			
-			empty_file(block[inoden].location);
-			sprintf(filename, "%s%d", fusedata, block[inoden].location);
-			FILE *fp2;
-			fp2 = fopen(filename, "a+");
-			fprintf(fp2, "%d,", originalocation);
-			for (i = 0; i < newblock_num; i++) {
-				fprintf(fp2, " %d,", newblock[i]);
+			if (res != 0) {
+				fprintf(stderr, "%s: %s\n", childpath, strerror(-res));
+				return res;
 			}
-			fclose(fp2);
 		}
-		else {
-			sprintf(filename, "%s%d", fusedata, block[inoden].location);
-			FILE *fp2;
-			fp2 = fopen(filename, "a+");
-			for (i = 0; i < newblock_num; i++) {
-				fprintf(fp2, " %d,", newblock[i]);
-			}
-			fclose(fp2);
+		if (strncmp(p, ", ", 2) != 0) {
+			break;
 		}
+		p += 2;
 	}
 
-	block[inoden].size += size;
-	int parent_inode = find_parent_inode(path);
-	char *name = split_to_name(path);
-	int idxinparentino = find_name_in_inode(block[parent_inode], name);
-	int blockn = block[parent_inode].filename_to_inode_dict[idxinparentino].inode;
-	write_file_inode(block[inoden], blockn);
+	blockn = path[0] == '\0' ? Superblock.root : split_to_blockn(path, 0);
+	ino = get_inode(blockn);
+	ino->uid = uid;
+	ino->gid = gid;
+	ino->atime = atime;
+	ino->ctime = ctime;
+	ino->mtime = mtime;
+	write_inode(ino, blockn);
+	return 0;
+}
 
-	(void) fi;
-	(void) r;
-	(void) offset;
-	return size;	
-}            
+static int convert_text_image(void)
+{
+	// rebuild a text-format image in place: read it all, format, then recreate the tree
+	int creation, res;
+	size_t imagesize = (size_t) TEXT_BLOCK_NUM * BLOCK_SIZE;
+	oldimage = calloc(1, imagesize + 1);
+	if (oldimage == NULL || pread(fusefd, oldimage, imagesize, 0) != imagesize) {
+		fprintf(stderr, "%s: cannot read image\n", fuseimage);
+		return 1;
+	}
+	if (sscanf(oldimage, "{creationTime:%d,", &creation) != 1) {
+		fprintf(stderr, "%s: not a text-format image\n", fuseimage);
+		return 1;
+	}
 
-static void* vfs_init(struct fuse_conn_info *conn)
-{	
-	int i, r;
-	char filename[50];
-	memset(zero, '0', (size_t) BLOCK_SIZE);
-	
-	for (i = 0; i < MAX_BLOCK_NUM; i++) {
-	    FILE *fp;
-	    sprintf(filename, "%s%d", fusedata, i);
-	    fp = fopen(filename, "w");
-            fprintf(fp, "%s", zero);
-	    fclose(fp);
+	// every text file took an inode block and a data block, so it had at most one inode per two blocks
+	if (mkfs(TEXT_BLOCK_NUM, TEXT_BLOCK_NUM / 2, MAX_NAME_LEN) != 0) {
+		perror(fuseimage);
+		return 1;
 	}
-	initial_freeblock();
+	Superblock.creationTime = creation;
+	// block 26 was the root of a text image
+	res = convert_dir(26, "");
+	write_superblock();
+	free(oldimage);
+	return res == 0 ? 0 : 1;
+}
 
-	// init Superblock
-	Superblock.creationTime = (int) time(NULL);
-	Superblock.mounted = 50;
-	Superblock.devId = 20;
-	Superblock.freeStart = 1;
-	Superblock.freeEnd = 25;
-	Superblock.root = 26;
-	Superblock.maxBlocks = MAX_BLOCK_NUM;
-	Superblock.freeblocks = MAX_BLOCK_NUM - 27;
-	Superblock.freeinodes = MAX_INODE_NUM;
-
-	FILE *fp;
-	sprintf(filename, "%s0", fusedata);
-	fp = fopen(filename, "r+");
-	
-	fprintf(fp, "{creationTime:%d, mounted:%d, devId:%d, freeStart:%d, freeEnd:%d, root:%d, maxBlocks:%d", 
-		    Superblock.creationTime, Superblock.mounted, Superblock.devId, Superblock.freeStart, 
-		    Superblock.freeEnd, Superblock.root, Superblock.maxBlocks);
-	
-	fputs("}", fp);
-	fclose(fp);
-	
-	// init root inode
-	block[26].size = 4096;
-	block[26].uid = 1;
-	block[26].gid = 1;
-	block[26].mode = 16877;
-	block[26].atime = (int) time(NULL);
-	block[26].ctime = (int) time(NULL);
-	block[26].mtime = (int) time(NULL);
-	block[26].linkcount = 2;
-	block[26].subn = 2;
-	strcpy(block[26].filename_to_inode_dict[0].name, ".");
-	block[26].filename_to_inode_dict[0].type = 'd';
-	block[26].filename_to_inode_dict[0].inode = 26;
-	strcpy(block[26].filename_to_inode_dict[1].name, "..");
-	block[26].filename_to_inode_dict[1].type = 'd';
-	block[26].filename_to_inode_dict[1].inode = 26;
-	write_dir_inode(block[26]);
+// --check walks the tree from the root, repairing what each inode says about itself and marking
+// every block it reaches, then rebuilds the free list from the marks a word at a time.
+// the walk only reads metadata, and directories can be shared out between threads
+struct checkdir {
+	blkno_t inode;
+	blkno_t parent;
+};
 
-	
-	(void) conn;
-	(void) r;
-	return 0;
+static struct check {
+	uint64_t *reached;
+	uint64_t *ireached;
+	struct blockmap links;
+	struct checkdir *queue;
+	size_t nqueue;
+	size_t queuecap;
+	int busy;
+	int unsure;
+	int res;
+	int fixed;
+	blkno_t ndirs;
+	blkno_t nfiles;
+	blkno_t runstart;
+	blkno_t runend;
+	const char *runwhat;
+	const char *rununit;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+}check = { .runstart = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static int check_reach(blkno_t start, blkno_t len)
+{
+	// mark blocks [start, start + len) in use a word at a time, return whether the first already was
+	uint64_t bits, old;
+	int n, was = -1;
+	while (len > 0) {
+		n = 64 - start % 64 < len ? 64 - start % 64 : len;
+		bits = (n == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << n) - 1) << (start % 64);
+		old = __atomic_fetch_or(&check.reached[start / 64], bits, __ATOMIC_RELAXED);
+		if (was == -1) {
+			was = old >> (start % 64) & 1;
+		}
+		start += n;
+		len -= n;
+	}
+	return was == 1;
+}
+
+static int check_reach_inode(blkno_t n)
+{
+	// mark inode n in use, return whether it already was. an inode with a block of its own
+	// marks that block
+	uint64_t old;
+	if (BLOCK_INODES) {
+		return check_reach(n, 1);
+	}
+	old = __atomic_fetch_or(&check.ireached[n / 64], (uint64_t) 1 << (n % 64), __ATOMIC_RELAXED);
+	return old >> (n % 64) & 1;
 }
 
-static int vfs_rename(const char* from, const char* to)
+static void check_fix(blkno_t n, const char *what, long long to)
 {
-	int i, j, isFile = 1;
-	int from_parent_inode = find_parent_inode(from);
-	int to_parent_inode = find_parent_inode(to);
-	int from_inode = split_to_blockn(from, 0);
+	printf("inode %lld: %s is wrong, correct it to %lld\n", (long long) n, what, to);
+	__atomic_add_fetch(&check.fixed, 1, __ATOMIC_RELAXED);
+}
 
-	char from_name[MAX_NAME_LEN];
-	char to_name[MAX_NAME_LEN];
-	
-	strcpy(from_name, split_to_name(from));
-	strcpy(to_name, split_to_name(to));
-	
-	int to_name_idx = find_name_in_inode(block[to_parent_inode], to_name);
-	int from_name_idx = find_name_in_inode(block[from_parent_inode], from_name);
-	
-	if (to_name_idx != 0) {
-		return -EEXIST;
+static int check_times(struct inode *ino, blkno_t n)
+{
+	// times in the future are set to now
+	int now = (int) time(NULL), wrong = 0;
+	if (ino->atime > now) {
+		ino->atime = now;
+		check_fix(n, "atime", now);
+		wrong = 1;
 	}
-	if (from_name_idx == 0) {
-		return -ENOENT;
+	if (ino->ctime > now) {
+		ino->ctime = now;
+		check_fix(n, "ctime", now);
+		wrong = 1;
 	}
-	if (block[from_parent_inode].filename_to_inode_dict[from_name_idx].type == 'd') {
-		isFile = 0;
+	if (ino->mtime > now) {
+		ino->mtime = now;
+		check_fix(n, "mtime", now);
+		wrong = 1;
 	}
+	return wrong;
+}
 
-	if (to_name_idx == 0) {
-		j = block[to_parent_inode].subn;
-		block[to_parent_inode].filename_to_inode_dict[j] 
-			= block[from_parent_inode].filename_to_inode_dict[from_name_idx];
-		strcpy(block[to_parent_inode].filename_to_inode_dict[j].name, to_name); 
-		block[to_parent_inode].subn++;
-		if (isFile == 0) {
-			block[to_parent_inode].linkcount++;
+static int check_extents(struct inode *ino)
+{
+	// whether the extents and index nodes read for ino are a tree the file system could have made
+	blkno_t lblk = 0;
+	int i, l;
+	if (ino->nextent == 0) {
+		return -EIO;
+	}
+	for (i = 0; i < ino->nextent; i++) {
+		if (ino->ext[i].lblk != lblk || ino->ext[i].len <= 0 || ino->ext[i].start < Superblock.dataStart 
+		    || ino->ext[i].start + ino->ext[i].len > Superblock.maxBlocks) {
+			return -EIO;
 		}
-		write_dir_inode(block[to_parent_inode]);
+		lblk += ino->ext[i].len;
 	}
-	
-	// modify from inode if it is a directory
-	if (isFile == 0) {
-		block[from_inode].filename_to_inode_dict[1].inode 
-			= block[to_parent_inode].filename_to_inode_dict[0].inode;
-		write_dir_inode(block[from_inode]); 
+	if (ino->indirect == 0) {
+		return 0;
 	}
-	
-	// modify from_parent inode	
-	if (from_name_idx != 0) {
-		if (isFile == 0) {
-			block[from_parent_inode].linkcount--;
-		}
-
-		if (from_name_idx == block[from_parent_inode].subn - 1) {
-			block[from_parent_inode].filename_to_inode_dict[from_name_idx] 
-				= block[from_parent_inode].filename_to_inode_dict[block[from_parent_inode].subn];
-		}
-		else {
-			for(i = from_name_idx; i < MAX_FILE_NUM; i++) {
-				block[from_parent_inode].filename_to_inode_dict[i] 
-					= block[from_parent_inode].filename_to_inode_dict[i + 1];
+	if (ino->location < Superblock.dataStart || ino->location >= Superblock.maxBlocks) {
+		return -EIO;
+	}
+	for (l = 0; l < INDEX_DEPTH; l++) {
+		for (i = 0; i < ino->nnode[l]; i++) {
+			if (ino->node[l][i] < Superblock.dataStart || ino->node[l][i] >= Superblock.maxBlocks) {
+				return -EIO;
 			}
 		}
-	
-		block[from_parent_inode].subn--;
-		write_dir_inode(block[from_parent_inode]);
-	}	
-
+	}
 	return 0;
 }
 
-static int vfs_link(const char* from, const char* to)
+static void check_reach_blocks(struct inode *ino)
 {
-	int to_parent_inode = find_parent_inode(to);
-	int from_inode = split_to_blockn(from, 0);
-	char from_name[MAX_NAME_LEN], to_name[MAX_NAME_LEN];
-	strcpy(from_name, split_to_name(from));
-	strcpy(to_name, split_to_name(to));
+	// the data blocks and the index nodes
+	int i, l;
+	for (i = 0; i < ino->nextent; i++) {
+		check_reach(ino->ext[i].start, ino->ext[i].len);
+	}
+	if (ino->indirect) {
+		check_reach(ino->location, 1);
+		for (l = 0; l < INDEX_DEPTH; l++) {
+			for (i = 0; i < ino->nnode[l]; i++) {
+				check_reach(ino->node[l][i], 1);
+			}
+		}
+	}
+}
 
-	int j = block[to_parent_inode].subn;
-	block[to_parent_inode].filename_to_inode_dict[j].type = 'f';
-	strcpy(block[to_parent_inode].filename_to_inode_dict[j].name, to_name);
-	block[to_parent_inode].filename_to_inode_dict[j].inode = from_inode;
-	block[to_parent_inode].subn++;
-	block[from_inode].linkcount++;
+static void check_put(struct inode *ino)
+{
+	int l;
+	free(ino->ext);
+	for (l = 0; l < INDEX_DEPTH; l++) {
+		free(ino->node[l]);
+	}
+}
 
-	write_dir_inode(block[to_parent_inode]);
-	write_file_inode(block[from_inode], from_inode);
+static int check_bucket(char *blk)
+{
+	// the number of entries in a directory block, -1 if it does not parse
+	struct disk_dirblock *hdr = (struct disk_dirblock *) blk;
+	struct disk_dirent *de;
+	int off = sizeof(*hdr), used = le32toh(hdr->used), n = 0;
+	blkno_t inode;
 
-	return 0;	
+	if (used < off || used > dir_room(blk)) {
+		return -1;
+	}
+	while (off < used) {
+		de = (struct disk_dirent *) (blk + off);
+		if (off + (int) offsetof(struct disk_dirent, name) > used || de->namelen == 0 
+		    || off + DIRENT_LEN(de->namelen) > used || (de->type != 'f' && de->type != 'd')) {
+			return -1;
+		}
+		inode = le32toh(de->inode);
+		if (inode <= Superblock.root || inode >= INODE_LIMIT) {
+			return -1;
+		}
+		off += DIRENT_LEN(de->namelen);
+		n++;
+	}
+	return n == dir_count(blk) ? n : -1;
 }
 
-static int vfs_unlink(const char* path)
+static void check_file(blkno_t n)
 {
-	int i;
-	int parent_inoden = find_parent_inode(path);
-	int inoden = split_to_blockn(path, 0);
-	char* name = split_to_name(path);
-	int idxinparentino = find_name_in_inode(block[parent_inoden], name);
+	// the rules fsck.py had: a bad index makes the file direct, a one-block index is folded
+	// into the inode, a direct file bigger than a block gets back an index that is still there,
+	// and the size has to end in the last block
+	struct inode ino;
+	int res, wrong, nblocks;
 
-	block[inoden].linkcount--;
-	if (block[inoden].linkcount == 0) {
-		remove_file(inoden);	
+	memset(&ino, 0, sizeof(ino));
+	res = read_inode(n, &ino);
+	if (res < 0) {
+		printf("inode %lld: record is unreadable, skip it\n", (long long) n);
+		check.unsure = 1;
+		return;
 	}
-
-	if (idxinparentino == block[parent_inoden].subn - 1) {
-			block[parent_inoden].filename_to_inode_dict[idxinparentino] 
-				= block[parent_inoden].filename_to_inode_dict[idxinparentino + 1];
+	wrong = check_times(&ino, n);
+	if (ino.inlined) {
+		// an inline file owns no blocks, its bytes end inside the inode record
+		if (ino.indirect != 0 || ino.location != 0) {
+			ino.indirect = 0;
+			ino.location = 0;
+			check_fix(n, "location", 0);
+			wrong = 1;
+		}
+		if (ino.size > INLINE_MAX) {
+			ino.size = INLINE_MAX;
+			check_fix(n, "size", ino.size);
+			wrong = 1;
+		}
+		if (wrong) {
+			write_inode(&ino, n);
+		}
+		check_put(&ino);
+		return;
+	}
+	if (ino.indirect != 0 && (res != 0 || check_extents(&ino) != 0)) {
+		ino.indirect = 0;
+		ino.nextent = 0;
+		add_extent(&ino, ino.location, 1);
+		check_fix(n, "indirect", 0);
+		wrong = 1;
+	}
+	if (ino.indirect != 0 && ino.nextent == 1 && ino.ext[0].len == 1) {
+		ino.indirect = 0;
+		ino.location = ino.ext[0].start;
+		check_fix(n, "location", ino.location);
+		check_fix(n, "indirect", 0);
+		wrong = 1;
+	}
+	if (ino.indirect == 0 && ino.size > BLOCK_SIZE && ino.location >= Superblock.dataStart 
+	    && ino.location < Superblock.maxBlocks) {
+		ino.indirect = 1;
+		if (load_index(&ino) == 0 && check_extents(&ino) == 0) {
+			check_fix(n, "indirect", 1);
+			wrong = 1;
 		}
 		else {
-			for(i = idxinparentino; i < MAX_FILE_NUM; i++) {
-				block[parent_inoden].filename_to_inode_dict[i] 
-					= block[parent_inoden].filename_to_inode_dict[i + 1];
-			}
+			ino.indirect = 0;
+			ino.nextent = 0;
+			add_extent(&ino, ino.location, 1);
+		}
+	}
+	nblocks = file_blocks(&ino);
+	if (ino.size > (off_t) nblocks * BLOCK_SIZE || ino.size < (off_t) (nblocks - 1) * BLOCK_SIZE) {
+		ino.size = (off_t) nblocks * BLOCK_SIZE;
+		check_fix(n, "size", ino.size);
+		wrong = 1;
+	}
+	if (ino.indirect != 0 || (ino.location >= Superblock.dataStart && ino.location < Superblock.maxBlocks)) {
+		check_reach_blocks(&ino);
 	}
+	if (wrong) {
+		write_inode(&ino, n);
+	}
+	check_put(&ino);
+}
 
-	block[parent_inoden].subn--;
-	write_dir_inode(block[parent_inoden]);
-	return 0;
+static void check_push(blkno_t dir, blkno_t parent)
+{
+	struct checkdir *q;
+	pthread_mutex_lock(&check.lock);
+	if (check.nqueue == check.queuecap) {
+		q = realloc(check.queue, (check.queuecap * 2 + 64) * sizeof(struct checkdir));
+		if (q == NULL) {
+			check.res = -ENOMEM;
+			pthread_mutex_unlock(&check.lock);
+			return;
+		}
+		check.queue = q;
+		check.queuecap = check.queuecap * 2 + 64;
+	}
+	check.queue[check.nqueue].inode = dir;
+	check.queue[check.nqueue].parent = parent;
+	check.nqueue++;
+	pthread_cond_signal(&check.cond);
+	pthread_mutex_unlock(&check.lock);
 }
 
-static int vfs_rmdir(const char* path)
+static int check_link(blkno_t file)
 {
-	int i;
-	int inode = split_to_blockn(path, 0);
-	int parent_inoden = find_parent_inode(path);
-	char* name = split_to_name(path);
-	int idxinparentino = find_name_in_inode(block[parent_inoden], name);
+	// count an entry naming file, return whether it is the first
+	unsigned long links;
+	pthread_mutex_lock(&check.lock);
+	links = blockmap_get(&check.links, file);
+	if (blockmap_set(&check.links, file, links + 1) != 0) {
+		check.res = -ENOMEM;
+	}
+	pthread_mutex_unlock(&check.lock);
+	return links == 0;
+}
+
+static void check_cut(blkno_t n, int b, char *blk, blkno_t pb, blkno_t next, const char *why)
+{
+	// end bucket b at its block pb, read into blk, dropping the overflow block next on
+	uint32_t count = htole32(dir_count(blk));
+	printf("inode %lld: overflow block %lld of bucket %d %s, drop it and the rest of the bucket\n", 
+	       (long long) n, (long long) next, b, why);
+	__atomic_add_fetch(&check.fixed, 1, __ATOMIC_RELAXED);
+	((struct disk_dirblock *) blk)->count = count;
+	write_block(pb, &count, sizeof(count), offsetof(struct disk_dirblock, count));
+}
+
+static void check_dir(blkno_t n, blkno_t parent)
+{
+	// repair the directory's own fields and buckets, then check its files and queue its
+	// subdirectories. ".." is the parent field, "." needs nothing
+	struct inode ino;
+	struct disk_dirblock *hdr;
+	struct disk_dirent *de, **ents = NULL;
+	char *blk, *cur, *p;
+	blkno_t inode, pb, *where, *pool = NULL, *q;
+	int *owner, *first = NULL, *r;
+	int b, i, k, nb, nblk = 0, cap, npool = 0, need, off, used, bad, wrong, nent = 0, nsub = 0, misplaced = 0;
+
+	if (check_reach_inode(n)) {
+		printf("inode %lld: directory is linked more than once, skip it\n", (long long) n);
+		return;
+	}
+	__atomic_add_fetch(&check.ndirs, 1, __ATOMIC_RELAXED);
+	memset(&ino, 0, sizeof(ino));
+	if (read_inode(n, &ino) != 0 || check_extents(&ino) != 0) {
+		printf("inode %lld: index of this directory is unreadable, skip it\n", (long long) n);
+		check.unsure = 1;
+		check_put(&ino);
+		return;
+	}
+	wrong = check_times(&ino, n);
+	if (ino.parent != parent) {
+		ino.parent = parent;
+		check_fix(n, "parent", parent);
+		wrong = 1;
+	}
+	check_reach_blocks(&ino);
+	nb = file_blocks(&ino);
+	if (ino.size != (off_t) nb * BLOCK_SIZE) {
+		ino.size = (off_t) nb * BLOCK_SIZE;
+		check_fix(n, "size", ino.size);
+		wrong = 1;
+	}
+
+	// every block of every bucket, overflow blocks after the bucket's own. owner[k] is the
+	// bucket block k belongs to
+	cap = nb;
+	blk = malloc((size_t) cap * BLOCK_SIZE);
+	where = malloc(cap * sizeof(blkno_t));
+	owner = malloc(cap * sizeof(int));
+	bad = blk == NULL || where == NULL || owner == NULL;
+	for (b = 0; !bad && b < nb; b++) {
+		pb = bmap(&ino, b);
+		for (i = 0; pb != 0; i++) {
+			if (nblk == cap) {
+				cap *= 2;
+				p = realloc(blk, (size_t) cap * BLOCK_SIZE);
+				blk = p != NULL ? p : blk;
+				q = realloc(where, cap * sizeof(blkno_t));
+				where = q != NULL ? q : where;
+				r = realloc(owner, cap * sizeof(int));
+				owner = r != NULL ? r : owner;
+				bad = p == NULL || q == NULL || r == NULL;
+				if (bad) {
+					break;
+				}
+			}
+			cur = blk + (size_t) nblk * BLOCK_SIZE;
+			if (read_block(pb, cur, BLOCK_SIZE, 0) != BLOCK_SIZE) {
+				printf("inode %lld: bucket %d of this directory is unreadable, skip it\n", (long long) n, b);
+				check.unsure = 1;
+				free(blk);
+				free(where);
+				free(owner);
+				check_put(&ino);
+				return;
+			}
+			bad = check_bucket(cur) < 0;
+			if (bad && i == 0) {
+				printf("inode %lld: bucket %d of this directory is corrupt, empty it\n", (long long) n, b);
+				__atomic_add_fetch(&check.fixed, 1, __ATOMIC_RELAXED);
+				dir_init_block(pb);
+				memset(cur, 0, BLOCK_SIZE);
+				((struct disk_dirblock *) cur)->used = htole32(sizeof(struct disk_dirblock));
+				bad = 0;
+			}
+			else if (bad) {
+				bad = 0;
+				check_cut(n, b, cur - BLOCK_SIZE, where[nblk - 1], pb, "is corrupt");
+				break;
+			}
+			else if (i > 0 && dir_count(cur) == 0) {
+				check_cut(n, b, cur - BLOCK_SIZE, where[nblk - 1], pb, "is empty");
+				break;
+			}
+			else if (i > 0 && check_reach(pb, 1)) {
+				check_cut(n, b, cur - BLOCK_SIZE, where[nblk - 1], pb, "is in use elsewhere");
+				break;
+			}
+			where[nblk] = pb;
+			owner[nblk] = b;
+			nblk++;
+			pb = dir_next(cur);
+			if (pb != 0 && (pb < Superblock.dataStart || pb >= Superblock.maxBlocks)) {
+				check_cut(n, b, cur, where[nblk - 1], pb, "is out of range");
+				pb = 0;
+			}
+			hdr = (struct disk_dirblock *) cur;
+			used = le32toh(hdr->used);
+			for (off = sizeof(*hdr); off < used; off += DIRENT_LEN(de->namelen)) {
+				de = (struct disk_dirent *) ((char *) hdr + off);
+				misplaced |= dir_bucket(nb, hash_name(2166136261u, de->name, de->namelen)) != b;
+				nent++;
+			}
+		}
+	}
+	if (bad) {
+		check.res = -ENOMEM;
+		free(blk);
+		free(where);
+		free(owner);
+		check_put(&ino);
+		return;
+	}
 
-	if (idxinparentino == block[parent_inoden].subn - 1) {
-			block[parent_inoden].filename_to_inode_dict[idxinparentino] 
-				= block[parent_inoden].filename_to_inode_dict[idxinparentino + 1];
+	// put every entry back in the bucket its hash selects, in the overflow blocks there are
+	if (misplaced) {
+		ents = malloc((nent + 1) * sizeof(*ents));
+		first = calloc(nb + 1, sizeof(int));
+		pool = malloc((nblk + 1) * sizeof(blkno_t));
+		if (ents == NULL || first == NULL || pool == NULL) {
+			check.res = -ENOMEM;
+			misplaced = 0;
 		}
-		else {
-			for(i = idxinparentino; i < MAX_FILE_NUM; i++) {
-				block[parent_inoden].filename_to_inode_dict[i] 
-					= block[parent_inoden].filename_to_inode_dict[i + 1];
+	}
+	for (k = 0; misplaced && k < nblk; k++) {
+		if (k > 0 && owner[k - 1] == owner[k]) {
+			pool[npool++] = where[k];
+		}
+		used = le32toh(((struct disk_dirblock *) (blk + (size_t) k * BLOCK_SIZE))->used);
+		for (off = sizeof(struct disk_dirblock); off < used; off += DIRENT_LEN(de->namelen)) {
+			de = (struct disk_dirent *) (blk + (size_t) k * BLOCK_SIZE + off);
+			first[dir_bucket(nb, hash_name(2166136261u, de->name, de->namelen)) + 1]++;
+		}
+	}
+	for (b = 0; misplaced && b < nb; b++) {
+		first[b + 1] += first[b];
+	}
+	for (k = 0; misplaced && k < nblk; k++) {
+		used = le32toh(((struct disk_dirblock *) (blk + (size_t) k * BLOCK_SIZE))->used);
+		for (off = sizeof(struct disk_dirblock); off < used; off += DIRENT_LEN(de->namelen)) {
+			de = (struct disk_dirent *) (blk + (size_t) k * BLOCK_SIZE + off);
+			ents[first[dir_bucket(nb, hash_name(2166136261u, de->name, de->namelen))]++] = de;
+		}
+	}
+	// first[b] now ends bucket b, so it starts at first[b - 1]
+	for (b = need = 0; misplaced && b < nb; b++) {
+		need += dir_pack(ents + (b > 0 ? first[b - 1] : 0), first[b] - (b > 0 ? first[b - 1] : 0), 0, NULL, NULL) - 1;
+	}
+	if (misplaced && need > npool) {
+		printf("inode %lld: entries of this directory are in the wrong buckets, too many to rehash\n", 
+		       (long long) n);
+	}
+	else if (misplaced) {
+		printf("inode %lld: entries of this directory are in the wrong buckets, rehash it\n", (long long) n);
+		__atomic_add_fetch(&check.fixed, 1, __ATOMIC_RELAXED);
+		for (b = 0; b < nb; b++) {
+			dir_pack(ents + (b > 0 ? first[b - 1] : 0), first[b] - (b > 0 ? first[b - 1] : 0), bmap(&ino, b), 
+			         pool, &npool);
+		}
+		// overflow blocks the packing did not need are free again
+		while (npool > 0) {
+			npool--;
+			__atomic_fetch_and(&check.reached[pool[npool] / 64], ~((uint64_t) 1 << (pool[npool] % 64)), 
+			                   __ATOMIC_RELAXED);
+		}
+	}
+	free(ents);
+	free(first);
+	free(pool);
+
+	nent = 0;
+	for (k = 0; k < nblk; k++) {
+		used = le32toh(((struct disk_dirblock *) (blk + (size_t) k * BLOCK_SIZE))->used);
+		for (off = sizeof(struct disk_dirblock); off < used; off += DIRENT_LEN(de->namelen)) {
+			de = (struct disk_dirent *) (blk + (size_t) k * BLOCK_SIZE + off);
+			inode = le32toh(de->inode);
+			nent++;
+			if (de->type == 'd') {
+				nsub++;
+				check_push(inode, n);
+			}
+			else if (check_link(inode) && !check_reach_inode(inode)) {
+				__atomic_add_fetch(&check.nfiles, 1, __ATOMIC_RELAXED);
+				check_file(inode);
 			}
+		}
 	}
-	memset(&block[inode], 0, sizeof(block[inode]));
-	restore_freeblock(inode);
-	block[parent_inoden].subn--;
-	block[parent_inoden].linkcount--;
-	write_dir_inode(block[parent_inoden]);
-	return 0;
+	free(blk);
+	free(where);
+	free(owner);
+
+	if (ino.subn != nent) {
+		ino.subn = nent;
+		check_fix(n, "entry count", nent);
+		wrong = 1;
+	}
+	if (ino.linkcount != 2 + nsub) {
+		ino.linkcount = 2 + nsub;
+		check_fix(n, "linkcount", ino.linkcount);
+		wrong = 1;
+	}
+	if (wrong) {
+		write_inode(&ino, n);
+	}
+	check_put(&ino);
 }
 
-static int vfs_statfs(const char* path, struct statvfs* stbuf)
+static void *check_worker(void *arg)
 {
-	stbuf->f_bsize = BLOCK_SIZE;
-	stbuf->f_frsize = BLOCK_SIZE;
-	stbuf->f_blocks = MAX_BLOCK_NUM;
-	stbuf->f_bfree = Superblock.freeblocks;
-	stbuf->f_bavail = Superblock.freeblocks;
-	stbuf->f_files = MAX_INODE_NUM;
-	stbuf->f_ffree = Superblock.freeinodes;
-	stbuf->f_favail = Superblock.freeinodes;
-	stbuf->f_fsid = 2970;
-	stbuf->f_flag = 0;
-	stbuf->f_namemax = MAX_NAME_LEN;
-
-	(void) path;
-	return 0;
+	// take directories off the queue until it is empty and nobody can add to it
+	struct checkdir d;
+	(void) arg;
+	pthread_mutex_lock(&check.lock);
+	for (;;) {
+		while (check.nqueue == 0 && check.busy > 0) {
+			pthread_cond_wait(&check.cond, &check.lock);
+		}
+		if (check.nqueue == 0) {
+			break;
+		}
+		d = check.queue[--check.nqueue];
+		check.busy++;
+		pthread_mutex_unlock(&check.lock);
+		check_dir(d.inode, d.parent);
+		pthread_mutex_lock(&check.lock);
+		check.busy--;
+	}
+	pthread_cond_broadcast(&check.cond);
+	pthread_mutex_unlock(&check.lock);
+	return NULL;
 }
 
-static void vfs_destroy(void * fs_data)
+static void check_run(const char *unit, blkno_t n, const char *what)
 {
-	(void) fs_data;
-	int i;
-	char filename[30];
-	for (i = 0; i < MAX_BLOCK_NUM; i++) {	    
-	    sprintf(filename, "%s%d", fusedata, i);
-	    unlink(filename);
+	// report free list errors a run of blocks or inodes at a time, what == NULL ends the last run
+	if (check.runstart != -1 && (what != check.runwhat || n != check.runend + 1)) {
+		if (check.runstart == check.runend) {
+			printf("%s %lld: %s\n", check.rununit, (long long) check.runstart, check.runwhat);
+		}
+		else {
+			printf("%ss %lld-%lld: %s\n", check.rununit, (long long) check.runstart, 
+			       (long long) check.runend, check.runwhat);
+		}
+		check.fixed++;
+		check.runstart = -1;
+	}
+	if (what != NULL) {
+		if (check.runstart == -1) {
+			check.runstart = n;
+			check.runwhat = what;
+			check.rununit = unit;
+		}
+		check.runend = n;
 	}
-	memset(&Superblock, 0, sizeof(Superblock));
-	memset(&block, 0, MAX_BLOCK_NUM * sizeof(struct inode));
 }
 
-// implement following functions to make successful getattr 
-static int vfs_chmod(const char* path, mode_t mode)
+static void check_freelist(void)
 {
-	(void) path;
-	(void) mode;
-	return 0;
+	// a block is free exactly when nothing reached it. where a directory could not be read,
+	// blocks nothing reached may still be its, so only reached ones are taken off the free list
+	static const char *taken = "marked taken but unused, correct the free list";
+	static const char *empty = "in use but marked free, correct the free list";
+	uint64_t want, bad, bits;
+	blkno_t w, b, freeblocks = 0;
+
+	for (w = 0; w < FREEMAP_WORDS; w++) {
+		want = ~check.reached[w];
+		if (w == FREEMAP_WORDS - 1 && Superblock.maxBlocks % 64 != 0) {
+			want &= ((uint64_t) 1 << (Superblock.maxBlocks % 64)) - 1;
+		}
+		bad = freemap[w] ^ want;
+		if (check.unsure) {
+			bad &= freemap[w];
+		}
+		if (bad != 0) {
+			for (bits = bad; bits != 0; bits &= bits - 1) {
+				b = w * 64 + __builtin_ctzll(bits);
+				check_run("block", b, freemap[w] >> (b % 64) & 1 ? empty : taken);
+			}
+			freemap[w] ^= bad;
+			dirty_word(w);
+		}
+		freeblocks += __builtin_popcountll(freemap[w]);
+	}
+	check_run(NULL, 0, NULL);
+	write_freeblock();
+	if (Superblock.freeblocks != freeblocks) {
+		printf("free block count is wrong, correct it to %lld\n", (long long) freeblocks);
+		Superblock.freeblocks = freeblocks;
+	}
 }
 
-static int vfs_chown(const char* path, uid_t uid, gid_t gid)
+static void check_imap(void)
 {
-	(void) path;
-	(void) uid;
-	(void) gid;
-	return 0;
+	// the same for the inode bitmap: an inode is free exactly when no entry reached it.
+	// inode 0 and numbers past maxInodes are never free
+	static const char *taken = "marked taken but unused, correct the inode bitmap";
+	static const char *empty = "in use but marked free, correct the inode bitmap";
+	uint64_t want, bad, bits;
+	blkno_t w, n, freeinodes = 0;
+
+	for (w = 0; w < IMAP_WORDS; w++) {
+		want = ~check.ireached[w];
+		if (w == 0) {
+			want &= ~(uint64_t) 1;
+		}
+		if (w == IMAP_WORDS - 1 && (Superblock.maxInodes + 1) % 64 != 0) {
+			want &= ((uint64_t) 1 << ((Superblock.maxInodes + 1) % 64)) - 1;
+		}
+		bad = imap[w] ^ want;
+		if (check.unsure) {
+			bad &= imap[w];
+		}
+		if (bad != 0) {
+			for (bits = bad; bits != 0; bits &= bits - 1) {
+				n = w * 64 + __builtin_ctzll(bits);
+				check_run("inode", n, imap[w] >> (n % 64) & 1 ? empty : taken);
+			}
+			imap[w] ^= bad;
+			write_imap(w);
+		}
+		freeinodes += __builtin_popcountll(imap[w]);
+	}
+	check_run(NULL, 0, NULL);
+	if (Superblock.freeinodes != freeinodes) {
+		printf("free inode count is wrong, correct it to %lld\n", (long long) freeinodes);
+		Superblock.freeinodes = freeinodes;
+	}
 }
 
-static int vfs_utimens(const char* path, const struct timespec ts[2])
+static int check_image(int nthreads)
 {
-	(void) path;
-	(void) ts;
+	// the superblock and the journal were dealt with by mounting, which replayed it
+	pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+	struct disk_inode d;
+	struct blockent *e;
+	int i, started = 0, now = (int) time(NULL);
+
+	check.reached = calloc(FREEMAP_WORDS, sizeof(uint64_t));
+	check.ireached = BLOCK_INODES ? NULL : calloc(IMAP_WORDS, sizeof(uint64_t));
+	if (check.reached == NULL || (check.ireached == NULL && !BLOCK_INODES) || threads == NULL) {
+		free(threads);
+		return -ENOMEM;
+	}
+	if (Superblock.creationTime > now) {
+		Superblock.creationTime = now;
+		printf("creation time is wrong, correct it to %d\n", now);
+		check.fixed++;
+	}
+
+	// the superblock, free list, journal and inode table, then the tree. where inodes have blocks
+	// of their own, the root's is the first one after the journal and the walk reaches it
+	check_reach(0, BLOCK_INODES ? Superblock.root : Superblock.dataStart);
+	check_push(Superblock.root, Superblock.root);
+	for (i = 1; i < nthreads; i++) {
+		started += pthread_create(&threads[started], NULL, check_worker, NULL) == 0;
+	}
+	check_worker(NULL);
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+	if (check.res != 0) {
+		fprintf(stderr, "%s: out of memory, nothing more was repaired\n", fuseimage);
+		return check.res;
+	}
+
+	// a file's links are the entries naming it
+	for (e = check.links.ent; e < check.links.ent + check.links.cap; e++) {
+		if (e->key == 0) {
+			continue;
+		}
+		// an unreadable record was reported when the walk came to it
+		if (read_block(INODE_BLOCK(e->key - 1), &d, sizeof(d), INODE_POS(e->key - 1)) != sizeof(d)) {
+			continue;
+		}
+		if (le32toh(d.linkcount) != e->val) {
+			d.linkcount = htole32(e->val);
+			write_block(INODE_BLOCK(e->key - 1), &d.linkcount, sizeof(d.linkcount), 
+			            INODE_POS(e->key - 1) + offsetof(struct disk_inode, linkcount));
+			check_fix(e->key - 1, "linkcount", e->val);
+		}
+	}
+
+	check_freelist();
+	if (!BLOCK_INODES) {
+		check_imap();
+	}
+	Superblock.clean = 1;
+	write_superblock();
+	printf("%lld directories, %lld files, %d errors corrected\n", (long long) check.ndirs, 
+	       (long long) check.nfiles, check.fixed);
 	return 0;
 }
 
-static int vfs_truncate(const char* path, off_t size)
+static blkno_t parse_size(const char *s)
 {
-	int r;
-	char filename[30];
-	char blocklist_info[1700];
-	memset(blocklist_info, '\0', sizeof(blocklist_info));
-	
-	int inoden = split_to_blockn(path, 0);
-	
-	if (block[inoden].indirect == 0) {
-		empty_file(block[inoden].location);		
+	// a byte count with an optional K, M, G or T suffix, -1 if it is not one
+	char *end;
+	const char *units = "KMGT";
+	long long n = strtoll(s, &end, 10);
+	if (end == s || n < 0) {
+		return -1;
 	}
-	else {
-		block[inoden].indirect = 0;
-		sprintf(filename, "%s%d", fusedata, block[inoden].location);
-		FILE *fp;
-		fp = fopen(filename, "r");
-		r = fread(blocklist_info, 1, 1700, fp);
-		fclose(fp);
-		r = blocklist(blocklist_info, 3);
-
-		empty_file(block[inoden].location);
+	if (*end != '\0') {
+		if (strchr(units, *end) == NULL || end[1] != '\0') {
+			return -1;
+		}
+		n <<= 10 * (strchr(units, *end) - units + 1);
 	}
-	
-	int parent_inode = find_parent_inode(path);
-	char *name = split_to_name(path);
-	int idxinparentino = find_name_in_inode(block[parent_inode], name);
-	int blockn = block[parent_inode].filename_to_inode_dict[idxinparentino].inode;
-	block[inoden].size = 0;
-	write_file_inode(block[inoden], blockn);
-
-	(void) size;
-	(void) r;
-	return 0;
+	return n;
 }
 
+static int serve(int argc, char *argv[])
+{
+	// mount, and answer the kernel until unmount. libfuse takes its own options from argv
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_chan *ch;
+	struct fuse_session *se;
+	char *mountpoint = NULL;
+	int multithreaded, foreground, res = -1;
 
-static struct fuse_operations vfs_oper = {
-	.getattr    = vfs_getattr,
-	.opendir    = vfs_opendir,
-	.readdir    = vfs_readdir,
-	.releasedir = vfs_releasedir,
-	.open       = vfs_open,
-	.read       = vfs_read,
-	.init       = vfs_init,
-	.create	    = vfs_create,
-	.mkdir      = vfs_mkdir,
-	.rmdir      = vfs_rmdir,
-	.rename     = vfs_rename,
-	.release    = vfs_release,
-	.write      = vfs_write,
-	.link       = vfs_link,
-	.unlink     = vfs_unlink,
-	.statfs     = vfs_statfs,
-	.chmod      = vfs_chmod,
-	.chown      = vfs_chown,
-	.utimens    = vfs_utimens,
-	.truncate   = vfs_truncate,
-	.destroy    = vfs_destroy,
-};
+	if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != 0) {
+		fuse_opt_free_args(&args);
+		return 1;
+	}
+	if (mountpoint == NULL) {
+		fprintf(stderr, "%s: no mount point\n", argv[0]);
+		fuse_opt_free_args(&args);
+		return 1;
+	}
+	ch = fuse_mount(mountpoint, &args);
+	if (ch != NULL) {
+		se = fuse_lowlevel_new(&args, &vfs_ll_oper, sizeof(vfs_ll_oper), NULL);
+		if (se != NULL) {
+			if (fuse_set_signal_handlers(se) == 0) {
+				fuse_session_add_chan(se, ch);
+				fuse_daemonize(foreground);
+				res = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+	free(mountpoint);
+	fuse_opt_free_args(&args);
+	return res == 0 ? 0 : 1;
+}
 
 int main(int argc, char *argv[])
 {	
-	return fuse_main(argc, argv, &vfs_oper, NULL);
+	int i, j, res, maxname = MAX_NAME_LEN, geometry = 0, nthreads = 0;
+	blkno_t nblocks = DEFAULT_BLOCKS, ninodes = -1;
+
+	// --cache=N sets the number of block buffers, --size, --inodes and --name-max the geometry
+	// --mkfs formats with, and --threads=N how many threads --check walks the tree with.
+	// they are taken out before fuse sees the options
+	for (i = j = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--cache=", 8) == 0) {
+			nbuf = atoi(argv[i] + 8);
+		}
+		else if (strncmp(argv[i], "--size=", 7) == 0) {
+			nblocks = parse_size(argv[i] + 7) / BLOCK_SIZE;
+			geometry = 1;
+		}
+		else if (strncmp(argv[i], "--inodes=", 9) == 0) {
+			ninodes = parse_size(argv[i] + 9);
+			geometry = 1;
+		}
+		else if (strncmp(argv[i], "--name-max=", 11) == 0) {
+			maxname = atoi(argv[i] + 11);
+			geometry = 1;
+		}
+		else if (strncmp(argv[i], "--threads=", 10) == 0) {
+			nthreads = atoi(argv[i] + 10);
+		}
+		else {
+			argv[j++] = argv[i];
+		}
+	}
+	argc = j;
+	argv[argc] = NULL;
+	if (nbuf < 16) {
+		fprintf(stderr, "--cache needs at least 16 buffers\n");
+		return 1;
+	}
+	if (bcache_init(nbuf) != 0) {
+		perror("block cache");
+		return 1;
+	}
+	if (geometry && (argc != 2 || strcmp(argv[1], "--mkfs") != 0)) {
+		fprintf(stderr, "--size, --inodes and --name-max only go with --mkfs\n");
+		return 1;
+	}
+	if (nthreads != 0 && (argc != 2 || strcmp(argv[1], "--check") != 0 || nthreads < 1)) {
+		fprintf(stderr, "--threads only goes with --check, and needs at least 1\n");
+		return 1;
+	}
+
+	if (argc == 2 && strcmp(argv[1], "--mkfs") == 0) {
+		if (ninodes == -1) {
+			ninodes = nblocks / BLOCKS_PER_INODE;
+		}
+		fusefd = open(fuseimage, O_RDWR | O_CREAT, 0644);
+		if (fusefd == -1) {
+			perror(fuseimage);
+			return 1;
+		}
+		if (mkfs(nblocks, ninodes, maxname) != 0) {
+			perror(fuseimage);
+			return 1;
+		}
+		return close(fusefd) == 0 ? 0 : 1;
+	}
+
+	// the whole device is one preallocated image, opened once for the life of the mount
+	fusefd = open(fuseimage, O_RDWR);
+	if (fusefd == -1) {
+		perror(fuseimage);
+		return 1;
+	}
+	if (argc == 2 && strcmp(argv[1], "--convert") == 0) {
+		res = convert_text_image();
+		log_commit();
+		log_checkpoint();
+		return fsync(fusefd) == 0 && res == 0 ? 0 : 1;
+	}
+	if (load_superblock() != 0) {
+		return 1;
+	}
+	if (argc == 2 && strcmp(argv[1], "--check") == 0) {
+		res = check_image(nthreads > 0 ? nthreads : 1);
+		log_commit();
+		log_checkpoint();
+		return fsync(fusefd) == 0 && res == 0 ? 0 : 1;
+	}
+	return serve(argc, argv);
 }